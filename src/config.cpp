@@ -21,9 +21,12 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include "config.h"
+#include <string.h>
+
+static const char FileName[] = "minijv880.ini";
 
 CConfig::CConfig (FATFS *pFileSystem)
-:	m_Properties ("minijv880.ini", pFileSystem)
+:	m_Properties (FileName, pFileSystem)
 {
 }
 
@@ -37,6 +40,11 @@ void CConfig::Load (void)
 	
 	m_SoundDevice = m_Properties.GetString ("SoundDevice", "pwm");
 
+	m_nSampleRate = m_Properties.GetNumber ("SampleRate", 32000);
+	m_nResamplerQuality = m_Properties.GetNumber ("ResamplerQuality", 1);
+	m_bOversampling = m_Properties.GetNumber ("Oversampling", 0) != 0;
+	m_SoundFormat = m_Properties.GetString ("SoundFormat", "s16");
+
 	if (m_SoundDevice == "hdmi") {
 		m_nChunkSize = m_Properties.GetNumber ("ChunkSize", 384*6);
 	}
@@ -48,10 +56,48 @@ void CConfig::Load (void)
 		m_nChunkSize = m_Properties.GetNumber ("ChunkSize", 1024);
 #endif
 	}
+
+	// the render chunk can never be smaller than one DMA transfer
+	m_bAdaptiveChunkSize = m_Properties.GetNumber ("AdaptiveChunkSize", 1) != 0;
+	m_nChunkSizeMin = m_Properties.GetNumber ("ChunkSizeMin", m_nChunkSize);
+	if (m_nChunkSizeMin < m_nChunkSize)
+	{
+		m_nChunkSizeMin = m_nChunkSize;
+	}
+	m_nChunkSizeMax = m_Properties.GetNumber ("ChunkSizeMax", 4*m_nChunkSizeMin);
+	if (m_nChunkSizeMax > MaxChunkSize)
+	{
+		m_nChunkSizeMax = MaxChunkSize;
+	}
+	if (m_nChunkSizeMax < m_nChunkSizeMin)
+	{
+		m_nChunkSizeMax = m_nChunkSizeMin;
+	}
+
 	m_nDACI2CAddress = m_Properties.GetNumber ("DACI2CAddress", 0);
 	m_bChannelsSwapped = m_Properties.GetNumber ("ChannelsSwapped", 0) != 0;
 
 	m_nMIDIBaudRate = m_Properties.GetNumber ("MIDIBaudRate", 31250);
+	m_MIDIOutDevice = m_Properties.GetString ("MIDIOutDevice", "both");
+
+	m_WaveROMCard = m_Properties.GetString ("WaveROMCard", "");
+	m_WaveROMExpansion = m_Properties.GetString ("WaveROMExpansion", "");
+	m_CardRAM = m_Properties.GetString ("CardRAM", "");
+	m_Snapshot = m_Properties.GetString ("Snapshot", "");
+	m_NVRAMJournal = m_Properties.GetString ("NVRAMJournal", "jv880_nvram.jnl");
+	m_bPersistSRAM = m_Properties.GetNumber ("PersistSRAM", 0) != 0;
+
+	// one instance per free core
+	m_nInstances = m_Properties.GetNumber ("Instances", 1);
+	if (m_nInstances < 1)
+	{
+		m_nInstances = 1;
+	}
+	if (m_nInstances > 2)
+	{
+		m_nInstances = 2;
+	}
+	m_InstanceMIDI = m_Properties.GetString ("InstanceMIDI", "split");
 
 
 	m_bLCDEnabled = m_Properties.GetNumber ("LCDEnabled", 0) != 0;
@@ -84,8 +130,13 @@ void CConfig::Load (void)
 	m_nST7789Rotation = m_Properties.GetNumber ("ST7789Rotation", 0);
 	m_bST7789SmallFont = m_Properties.GetNumber ("ST7789SmallFont", 0) != 0;
 
+	m_bHDMILCDEnabled = m_Properties.GetNumber ("HDMILCDEnabled", 1) != 0;
+	m_nHDMILCDScale = m_Properties.GetNumber ("HDMILCDScale", 1);
+	m_nHDMILCDFrameRate = m_Properties.GetNumber ("HDMILCDFrameRate", 30);
+
 	m_nLCDColumns = m_Properties.GetNumber ("LCDColumns", 16);
 	m_nLCDRows = m_Properties.GetNumber ("LCDRows", 2);
+	m_bLCDGraphics = m_Properties.GetNumber ("LCDGraphics", 0) != 0;
 
 	m_nButtonPinPreview = m_Properties.GetNumber ("ButtonPinPreview", 0);
 	m_nButtonPinLeft = m_Properties.GetNumber ("ButtonPinLeft", 0);
@@ -101,6 +152,7 @@ void CConfig::Load (void)
 	m_nButtonPinMonitor = m_Properties.GetNumber ("ButtonPinMonitor", 0);
 	m_nButtonPinCompare = m_Properties.GetNumber ("ButtonPinCompare", 0);
 	m_nButtonPinEnter = m_Properties.GetNumber ("ButtonPinEnter", 11);
+	m_nButtonPinOversampling = m_Properties.GetNumber ("ButtonPinOversampling", 0);
 
 	m_ButtonActionPreview = m_Properties.GetString ("ButtonActionPreview", "");
 	m_ButtonActionLeft = m_Properties.GetString ("ButtonActionLeft", "");
@@ -116,6 +168,7 @@ void CConfig::Load (void)
 	m_ButtonActionMonitor = m_Properties.GetString ("ButtonActionMonitor", "");
 	m_ButtonActionCompare = m_Properties.GetString ("ButtonActionCompare", "");
 	m_ButtonActionEnter = m_Properties.GetString("ButtonActionEnter", "click");
+	m_ButtonActionOversampling = m_Properties.GetString ("ButtonActionOversampling", "");
 
 	m_nDoubleClickTimeout = m_Properties.GetNumber ("DoubleClickTimeout", 400);
 	m_nLongPressTimeout = m_Properties.GetNumber ("LongPressTimeout", 600);
@@ -123,6 +176,7 @@ void CConfig::Load (void)
 	m_bEncoderEnabled = m_Properties.GetNumber ("EncoderEnabled", 0) != 0;
 	m_nEncoderPinClock = m_Properties.GetNumber ("EncoderPinClock", 10);
 	m_nEncoderPinData = m_Properties.GetNumber ("EncoderPinData", 9);
+	m_bEncoderAcceleration = m_Properties.GetNumber ("EncoderAcceleration", 1) != 0;
 
 	m_bProfileEnabled = m_Properties.GetNumber ("ProfileEnabled", 0) != 0;
 }
@@ -132,11 +186,113 @@ const char *CConfig::GetSoundDevice (void) const
 	return m_SoundDevice.c_str ();
 }
 
+unsigned CConfig::GetSampleRate (void) const
+{
+	return m_nSampleRate;
+}
+
+unsigned CConfig::GetResamplerQuality (void) const
+{
+	return m_nResamplerQuality;
+}
+
+bool CConfig::GetOversampling (void) const
+{
+	return m_bOversampling;
+}
+
+bool CConfig::SaveOversampling (bool bOversampling)
+{
+	FIL File;
+	if (f_open (&File, FileName, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
+	{
+		return false;
+	}
+
+	// find the digit after "Oversampling=" at the start of a line, as
+	// minijv880.ini has it
+	static const char Key[] = "Oversampling=";
+	const unsigned nKeyLength = sizeof Key - 1;
+	unsigned nMatched = 0;
+	bool bLineStart = true;
+	FSIZE_t nOffset = 0;
+	FSIZE_t nDigit = 0;
+	bool bFound = false;
+
+	char Buffer[256];
+	unsigned nBytesRead;
+	while (   !bFound
+	       && f_read (&File, Buffer, sizeof Buffer, &nBytesRead) == FR_OK
+	       && nBytesRead > 0)
+	{
+		for (unsigned i = 0; i < nBytesRead && !bFound; i++, nOffset++)
+		{
+			char c = Buffer[i];
+			if (nMatched == nKeyLength)
+			{
+				bFound = c == '0' || c == '1';
+				nDigit = nOffset;
+				nMatched = 0;
+			}
+			else if ((bLineStart || nMatched > 0) && c == Key[nMatched])
+			{
+				nMatched++;
+			}
+			else
+			{
+				nMatched = 0;
+			}
+			bLineStart = c == '\n';
+		}
+	}
+
+	// a single digit only, "Oversampling=10" would become "00"
+	char Next = '\n';
+	if (   bFound
+	    && f_lseek (&File, nDigit + 1) == FR_OK
+	    && f_read (&File, &Next, 1, &nBytesRead) == FR_OK
+	    && Next != '\r' && Next != '\n' && nBytesRead == 1)
+	{
+		bFound = false;
+	}
+
+	unsigned nBytesWritten = 0;
+	if (bFound && f_lseek (&File, nDigit) == FR_OK)
+	{
+		char Digit = bOversampling ? '1' : '0';
+		f_write (&File, &Digit, 1, &nBytesWritten);
+	}
+
+	f_close (&File);
+
+	return nBytesWritten == 1;
+}
+
+const char *CConfig::GetSoundFormat (void) const
+{
+	return m_SoundFormat.c_str ();
+}
+
 unsigned CConfig::GetChunkSize (void) const
 {
 	return m_nChunkSize;
 }
 
+bool CConfig::GetAdaptiveChunkSize (void) const
+{
+	return m_bAdaptiveChunkSize;
+}
+
+unsigned CConfig::GetChunkSizeMin (void) const
+{
+	return m_nChunkSizeMin;
+}
+
+unsigned CConfig::GetChunkSizeMax (void) const
+{
+	return m_nChunkSizeMax;
+}
+
 unsigned CConfig::GetDACI2CAddress (void) const
 {
 	return m_nDACI2CAddress;
@@ -152,6 +308,51 @@ unsigned CConfig::GetMIDIBaudRate (void) const
 	return m_nMIDIBaudRate;
 }
 
+const char *CConfig::GetMIDIOutDevice (void) const
+{
+	return m_MIDIOutDevice.c_str ();
+}
+
+const char *CConfig::GetWaveROMCard (void) const
+{
+	return m_WaveROMCard.c_str ();
+}
+
+const char *CConfig::GetWaveROMExpansion (void) const
+{
+	return m_WaveROMExpansion.c_str ();
+}
+
+const char *CConfig::GetCardRAM (void) const
+{
+	return m_CardRAM.c_str ();
+}
+
+const char *CConfig::GetSnapshot (void) const
+{
+	return m_Snapshot.c_str ();
+}
+
+const char *CConfig::GetNVRAMJournal (void) const
+{
+	return m_NVRAMJournal.c_str ();
+}
+
+bool CConfig::GetPersistSRAM (void) const
+{
+	return m_bPersistSRAM;
+}
+
+unsigned CConfig::GetInstances (void) const
+{
+	return m_nInstances;
+}
+
+const char *CConfig::GetInstanceMIDI (void) const
+{
+	return m_InstanceMIDI.c_str ();
+}
+
 
 bool CConfig::GetLCDEnabled (void) const
 {
@@ -282,6 +483,22 @@ bool CConfig::GetST7789SmallFont (void) const
 {
 	return m_bST7789SmallFont;
 }
+
+bool CConfig::GetHDMILCDEnabled (void) const
+{
+	return m_bHDMILCDEnabled;
+}
+
+unsigned CConfig::GetHDMILCDScale (void) const
+{
+	return m_nHDMILCDScale;
+}
+
+unsigned CConfig::GetHDMILCDFrameRate (void) const
+{
+	return m_nHDMILCDFrameRate;
+}
+
 unsigned CConfig::GetLCDColumns (void) const
 {
 	return m_nLCDColumns;
@@ -292,6 +509,11 @@ unsigned CConfig::GetLCDRows (void) const
 	return m_nLCDRows;
 }
 
+bool CConfig::GetLCDGraphics (void) const
+{
+	return m_bLCDGraphics;
+}
+
 unsigned CConfig::GetButtonPinPreview (void) const
 {
 	return m_nButtonPinPreview;
@@ -362,6 +584,11 @@ unsigned CConfig::GetButtonPinEnter (void) const
 	return m_nButtonPinEnter;
 }
 
+unsigned CConfig::GetButtonPinOversampling (void) const
+{
+	return m_nButtonPinOversampling;
+}
+
 const char *CConfig::GetButtonActionPreview (void) const
 {
 	return m_ButtonActionPreview.c_str();
@@ -432,6 +659,11 @@ const char *CConfig::GetButtonActionEnter (void) const
 	return m_ButtonActionEnter.c_str();
 }
 
+const char *CConfig::GetButtonActionOversampling (void) const
+{
+	return m_ButtonActionOversampling.c_str();
+}
+
 bool CConfig::GetEncoderEnabled (void) const
 {
 	return m_bEncoderEnabled;
@@ -447,6 +679,11 @@ unsigned CConfig::GetEncoderPinData (void) const
 	return m_nEncoderPinData;
 }
 
+bool CConfig::GetEncoderAcceleration (void) const
+{
+	return m_bEncoderAcceleration;
+}
+
 unsigned CConfig::GetDoubleClickTimeout (void) const
 {
 	return m_nDoubleClickTimeout;
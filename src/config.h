@@ -56,12 +56,36 @@ public:
 	
 	// Sound device
 	const char *GetSoundDevice (void) const;
+	unsigned GetSampleRate (void) const;
+	unsigned GetResamplerQuality (void) const;	// 0 (8 taps) to 2 (32 taps)
+	bool GetOversampling (void) const;		// 64 kHz PCM output
+	// Writes the value into the Oversampling line of the file, leaving
+	// the rest of it alone. Fails if there is no such line.
+	bool SaveOversampling (bool bOversampling);
+	const char *GetSoundFormat (void) const;	// "s16", "s24_32" or "f32"
 	unsigned GetChunkSize (void) const;
+	// bounds for the render chunk when it is adapted at runtime
+	bool GetAdaptiveChunkSize (void) const;
+	unsigned GetChunkSizeMin (void) const;
+	unsigned GetChunkSizeMax (void) const;
 	unsigned GetDACI2CAddress (void) const;		// 0 for auto probing
 	bool GetChannelsSwapped (void) const;
 
 	// MIDI
 	unsigned GetMIDIBaudRate (void) const;
+	const char *GetMIDIOutDevice (void) const;	// "usb", "serial", "both" or "none"
+
+	// ROM set, file names on the SD card; empty if not present
+	const char *GetWaveROMCard (void) const;	// PCM card (SO-PCM1)
+	const char *GetWaveROMExpansion (void) const;	// SR-JV80 board
+	const char *GetCardRAM (void) const;		// RAM card image
+	const char *GetSnapshot (void) const;		// save state to boot from
+	const char *GetNVRAMJournal (void) const;	// empty to not save the RAMs
+	bool GetPersistSRAM (void) const;
+
+	// Emulator instances
+	unsigned GetInstances (void) const;		// 1 or 2
+	const char *GetInstanceMIDI (void) const;	// "split" or "all"
 
 	// HD44780 LCD
 	// GPIO pin numbers are chip numbers, not header positions
@@ -98,8 +122,14 @@ public:
 	unsigned GetST7789Rotation (void) const;
 	bool     GetST7789SmallFont (void) const;
 
+	// JV-880 LCD on the HDMI screen
+	bool     GetHDMILCDEnabled (void) const;
+	unsigned GetHDMILCDScale (void) const;
+	unsigned GetHDMILCDFrameRate (void) const;
+
 	unsigned GetLCDColumns (void) const;
 	unsigned GetLCDRows (void) const;
+	bool     GetLCDGraphics (void) const;	// SSD1306 and ST7789 only
 
 	// GPIO Button Navigation
 	// GPIO pin numbers are chip numbers, not header positions
@@ -117,6 +147,7 @@ public:
 	unsigned GetButtonPinMonitor (void) const;
 	unsigned GetButtonPinCompare (void) const;
 	unsigned GetButtonPinEnter (void) const;
+	unsigned GetButtonPinOversampling (void) const;	// switches it
 
 	// Action type for buttons: "click", "doubleclick", "longpress", ""
 	const char *GetButtonActionPreview (void) const;
@@ -133,6 +164,7 @@ public:
 	const char *GetButtonActionMonitor (void) const;
 	const char *GetButtonActionCompare (void) const;
 	const char *GetButtonActionEnter (void) const;
+	const char *GetButtonActionOversampling (void) const;
 	
 	// Timeouts for button events in milliseconds
 	unsigned GetDoubleClickTimeout (void) const;
@@ -143,6 +175,7 @@ public:
 	bool GetEncoderEnabled (void) const;
 	unsigned GetEncoderPinClock (void) const;
 	unsigned GetEncoderPinData (void) const;
+	bool GetEncoderAcceleration (void) const;
 
 	bool GetProfileEnabled (void) const;
 
@@ -150,12 +183,30 @@ private:
 	CPropertiesFatFsFile m_Properties;
 	
 	std::string m_SoundDevice;
+	unsigned m_nSampleRate;
+	unsigned m_nResamplerQuality;
+	bool m_bOversampling;
+	std::string m_SoundFormat;
 	unsigned m_nChunkSize;
+	bool m_bAdaptiveChunkSize;
+	unsigned m_nChunkSizeMin;
+	unsigned m_nChunkSizeMax;
 	unsigned m_nDACI2CAddress;
 	bool m_bChannelsSwapped;
 	unsigned m_EngineType;
 
 	unsigned m_nMIDIBaudRate;
+	std::string m_MIDIOutDevice;
+
+	std::string m_WaveROMCard;
+	std::string m_WaveROMExpansion;
+	std::string m_CardRAM;
+	std::string m_Snapshot;
+	std::string m_NVRAMJournal;
+	bool m_bPersistSRAM;
+
+	unsigned m_nInstances;
+	std::string m_InstanceMIDI;
 
 
 	bool m_bLCDEnabled;
@@ -188,8 +239,13 @@ private:
 	unsigned m_nST7789Rotation;
 	unsigned m_bST7789SmallFont;
 
+	bool     m_bHDMILCDEnabled;
+	unsigned m_nHDMILCDScale;
+	unsigned m_nHDMILCDFrameRate;
+
 	unsigned m_nLCDColumns;
 	unsigned m_nLCDRows;
+	bool     m_bLCDGraphics;
 
 	unsigned m_nButtonPinPreview;
 	unsigned m_nButtonPinLeft;
@@ -205,6 +261,7 @@ private:
 	unsigned m_nButtonPinMonitor;
 	unsigned m_nButtonPinCompare;
 	unsigned m_nButtonPinEnter;
+	unsigned m_nButtonPinOversampling;
 
 	std::string m_ButtonActionPreview;
 	std::string m_ButtonActionLeft;
@@ -220,6 +277,7 @@ private:
 	std::string m_ButtonActionMonitor;
 	std::string m_ButtonActionCompare;
 	std::string m_ButtonActionEnter;
+	std::string m_ButtonActionOversampling;
 	
 	unsigned m_nDoubleClickTimeout;
 	unsigned m_nLongPressTimeout;	
@@ -227,6 +285,7 @@ private:
 	bool m_bEncoderEnabled;
 	unsigned m_nEncoderPinClock;
 	unsigned m_nEncoderPinData;
+	bool m_bEncoderAcceleration;
 
 	bool m_bProfileEnabled;
 };
@@ -0,0 +1,104 @@
+//
+// audioformat.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "audioformat.h"
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIO_NEON 1
+#endif
+
+int AUDIO_ParseFormat(const char *name) {
+  if (strcmp(name, "s16") == 0)
+    return AUDIO_FORMAT_S16;
+  if (strcmp(name, "s24_32") == 0)
+    return AUDIO_FORMAT_S24_32;
+  if (strcmp(name, "f32") == 0)
+    return AUDIO_FORMAT_F32;
+  return -1;
+}
+
+void AUDIO_Convert(int format, const int32_t *in, void *out, int count) {
+  switch (format) {
+  case AUDIO_FORMAT_S16:
+    AUDIO_ConvertS16(in, (int16_t *)out, count);
+    break;
+  case AUDIO_FORMAT_S24_32:
+    AUDIO_ConvertS24_32(in, (int32_t *)out, count);
+    break;
+  case AUDIO_FORMAT_F32:
+    AUDIO_ConvertF32(in, (float *)out, count);
+    break;
+  }
+}
+
+void AUDIO_MixS32(const int32_t *in, int32_t *inout, int count) {
+  int i = 0;
+#ifdef AUDIO_NEON
+  for (; i + 4 <= count; i += 4)
+    vst1q_s32(inout + i, vqaddq_s32(vld1q_s32(inout + i), vld1q_s32(in + i)));
+#endif
+  for (; i < count; i++) {
+    int64_t sum = (int64_t)inout[i] + in[i];
+    if (sum > INT32_MAX)
+      sum = INT32_MAX;
+    else if (sum < INT32_MIN)
+      sum = INT32_MIN;
+    inout[i] = (int32_t)sum;
+  }
+}
+
+// The conversions truncate like the original >> 16 of the 16-bit path, so
+// S16 output is bit-identical to what it was before.
+
+void AUDIO_ConvertS16(const int32_t *in, int16_t *out, int count) {
+  int i = 0;
+#ifdef AUDIO_NEON
+  for (; i + 8 <= count; i += 8) {
+    int16x4_t lo = vshrn_n_s32(vld1q_s32(in + i), 16);
+    int16x4_t hi = vshrn_n_s32(vld1q_s32(in + i + 4), 16);
+    vst1q_s16(out + i, vcombine_s16(lo, hi));
+  }
+#endif
+  for (; i < count; i++)
+    out[i] = (int16_t)(in[i] >> 16);
+}
+
+void AUDIO_ConvertS24_32(const int32_t *in, int32_t *out, int count) {
+  int i = 0;
+#ifdef AUDIO_NEON
+  for (; i + 8 <= count; i += 8) {
+    vst1q_s32(out + i, vshrq_n_s32(vld1q_s32(in + i), 8));
+    vst1q_s32(out + i + 4, vshrq_n_s32(vld1q_s32(in + i + 4), 8));
+  }
+#endif
+  for (; i < count; i++)
+    out[i] = in[i] >> 8;
+}
+
+void AUDIO_ConvertF32(const int32_t *in, float *out, int count) {
+  int i = 0;
+#ifdef AUDIO_NEON
+  // fixed point conversion with 31 fractional bits scales to -1.0 .. 1.0
+  for (; i + 8 <= count; i += 8) {
+    vst1q_f32(out + i, vcvtq_n_f32_s32(vld1q_s32(in + i), 31));
+    vst1q_f32(out + i + 4, vcvtq_n_f32_s32(vld1q_s32(in + i + 4), 31));
+  }
+#endif
+  for (; i < count; i++)
+    out[i] = in[i] * (1.0f / 2147483648.0f);
+}
@@ -0,0 +1,45 @@
+//
+// audioformat.h
+//
+// Conversion of the emulator's output samples (int32_t, full scale, the
+// 20-bit PCM mix in the upper bits) to the formats the sound devices take.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <stdint.h>
+
+enum {
+  AUDIO_FORMAT_S16 = 0,
+  AUDIO_FORMAT_S24_32, // 24 bit, LSB aligned in 32 bit
+  AUDIO_FORMAT_F32,    // -1.0 .. 1.0
+};
+
+// parses "s16", "s24_32" or "f32", returns -1 otherwise
+int AUDIO_ParseFormat(const char *name);
+
+inline int AUDIO_BytesPerSample(int format) {
+  return format == AUDIO_FORMAT_S16 ? 2 : 4;
+}
+
+// count is in samples (two per stereo frame); in and out may not overlap
+void AUDIO_Convert(int format, const int32_t *in, void *out, int count);
+
+// inout += in with saturation, to mix the output of several instances
+void AUDIO_MixS32(const int32_t *in, int32_t *inout, int count);
+
+void AUDIO_ConvertS16(const int32_t *in, int16_t *out, int count);
+void AUDIO_ConvertS24_32(const int32_t *in, int32_t *out, int count);
+void AUDIO_ConvertF32(const int32_t *in, float *out, int count);
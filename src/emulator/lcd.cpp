@@ -46,6 +46,7 @@ void LCD::LCD_Enable(uint32_t enable)
 
 void LCD::LCD_Write(uint32_t address, uint8_t data)
 {
+    uint32_t dd_ram = LCD_DD_RAM;
     if (address == 0)
     {
         if ((data & 0xe0) == 0x20)
@@ -56,15 +57,19 @@ void LCD::LCD_Write(uint32_t address, uint8_t data)
         }
         else if ((data & 0xf8) == 0x8)
         {
+            uint32_t control = (LCD_D << 2) | (LCD_C << 1) | LCD_B;
             LCD_D = (data & 0x4) != 0;
             LCD_C = (data & 0x2) != 0;
             LCD_B = (data & 0x1) != 0;
+            if ((data & 7) != control)
+                LCD_Changed();
         }
         else if ((data & 0xff) == 0x01)
         {
             LCD_DD_RAM = 0;
             LCD_ID = 1;
             memset(LCD_Data, 0x20, sizeof(LCD_Data));
+            LCD_Invalidate();
         }
         else if ((data & 0xff) == 0x02)
         {
@@ -94,7 +99,12 @@ void LCD::LCD_Write(uint32_t address, uint8_t data)
     {
         if (!LCD_RAM_MODE)
         {
-            LCD_CG[LCD_CG_RAM] = data & 0x1f;
+            if (LCD_CG[LCD_CG_RAM] != (data & 0x1f))
+            {
+                LCD_CG[LCD_CG_RAM] = data & 0x1f;
+                lcd_cg_dirty.fetch_or(1 << (LCD_CG_RAM >> 3));
+                LCD_Changed();
+            }
             if (LCD_ID)
             {
                 LCD_CG_RAM++;
@@ -112,18 +122,18 @@ void LCD::LCD_Write(uint32_t address, uint8_t data)
                 if (LCD_DD_RAM & 0x40)
                 {
                     if ((LCD_DD_RAM & 0x3f) < 40)
-                        LCD_Data[(LCD_DD_RAM & 0x3f) + 40] = data;
+                        LCD_WriteData((LCD_DD_RAM & 0x3f) + 40, data);
                 }
                 else
                 {
                     if ((LCD_DD_RAM & 0x3f) < 40)
-                        LCD_Data[LCD_DD_RAM & 0x3f] = data;
+                        LCD_WriteData(LCD_DD_RAM & 0x3f, data);
                 }
             }
             else
             {
                 if (LCD_DD_RAM < 80)
-                    LCD_Data[LCD_DD_RAM] = data;
+                    LCD_WriteData(LCD_DD_RAM, data);
             }
             if (LCD_ID)
             {
@@ -136,6 +146,10 @@ void LCD::LCD_Write(uint32_t address, uint8_t data)
             LCD_DD_RAM &= 0x7f;
         }
     }
+    // the cursor is only seen when it is on
+    if (LCD_C && LCD_DD_RAM != dd_ram)
+        LCD_Changed();
+
     //printf("%i %.2x ", address, data);
     // if (data >= 0x20 && data <= 'z')
     //     printf("%c\n", data);
@@ -143,76 +157,145 @@ void LCD::LCD_Write(uint32_t address, uint8_t data)
     //    printf("\n");
 }
 
-void LCD::LCD_FontRenderStandard(int32_t x, int32_t y, uint8_t ch, bool overlay)
+void LCD::LCD_WriteData(int index, uint8_t data)
+{
+    if (LCD_Data[index] == data)
+        return;
+
+    LCD_Data[index] = data;
+    int row = index / 40;
+    int col = index % 40;
+    if (col < lcd_cols)
+    {
+        lcd_dirty[row].fetch_or(1 << col);
+        LCD_Changed();
+    }
+}
+
+void LCD::LCD_Invalidate(void)
+{
+    for (int i = 0; i < lcd_rows; i++)
+        lcd_dirty[i].fetch_or((1 << lcd_cols) - 1);
+    LCD_Changed();
+}
+
+// The pixels of every possible row of 5 dots, so that a character is
+// rendered by copying 7 * 5 lines of lcd_cell_width pixels. This serves
+// lcd_font and the CG RAM characters alike.
+struct LCD_DotRows {
+    uint32_t pixels[32][lcd_cell_width];
+
+    constexpr LCD_DotRows() : pixels()
+    {
+        for (int bits = 0; bits < 32; bits++)
+        {
+            for (int x = 0; x < lcd_cell_width; x++)
+            {
+                if (x % 6 == 5)
+                    pixels[bits][x] = lcd_col3;
+                else if (bits & (1 << (4 - x / 6)))
+                    pixels[bits][x] = lcd_col1;
+                else
+                    pixels[bits][x] = lcd_col2;
+            }
+        }
+    }
+};
+
+static constexpr LCD_DotRows lcd_dot_rows;
+
+void LCD::LCD_RenderCell(int row, int col, bool cursor)
 {
-    uint8_t* f;
+    uint8_t ch = LCD_Data[row * 40 + col];
+    const uint8_t* f;
     if (ch >= 16)
         f = &lcd_font[ch - 16][0];
     else
         f = &LCD_CG[(ch & 7) * 8];
+    const uint8_t* underscore = &lcd_font['_' - 16][0];
+
+    int x = lcd_cell_left(col);
+    int y = lcd_cell_top(row);
     for (int i = 0; i < 7; i++)
     {
-        for (int j = 0; j < 5; j++)
-        {
-            uint32_t col;
-            if (f[i] & (1<<(4-j)))
-            {
-                col = lcd_col1;
-            }
-            else
-            {
-                col = lcd_col2;
-            }
-            int xx = x + i * 6;
-            int yy = y + j * 6;
-            for (int ii = 0; ii < 5; ii++)
-            {
-                for (int jj = 0; jj < 5; jj++)
-                {
-                    if (overlay)
-                        lcd_buffer[xx+ii][yy+jj] &= col;
-                    else
-                        lcd_buffer[xx+ii][yy+jj] = col;
-                }
-            }
-        }
+        int bits = f[i] & 0x1f;
+        // the cursor is drawn over the character, dark dots win
+        if (cursor)
+            bits |= underscore[i];
+        const uint32_t* line = lcd_dot_rows.pixels[bits];
+        for (int ii = 0; ii < 5; ii++)
+            memcpy(&lcd_buffer[y + i * 6 + ii][x], line, sizeof(lcd_dot_rows.pixels[0]));
     }
 }
 
-uint32_t* LCD::LCD_Update(void)
+uint32_t* LCD::LCD_Update(uint32_t* rendered)
 {
-    for (size_t i = 0; i < lcd_height; i++) {
-        for (size_t j = 0; j < lcd_width; j++) {
-            lcd_buffer[i][j] = lcd_col3;
+    uint32_t dirty[lcd_rows];
+    for (int i = 0; i < lcd_rows; i++)
+        dirty[i] = lcd_dirty[i].exchange(0);
+
+    if (!lcd_cleared)
+    {
+        for (size_t i = 0; i < lcd_height; i++) {
+            for (size_t j = 0; j < lcd_width; j++) {
+                lcd_buffer[i][j] = lcd_col3;
+            }
         }
+        for (int i = 0; i < lcd_rows; i++)
+            dirty[i] = (1 << lcd_cols) - 1;
+        lcd_cursor_cell = -1;
+        lcd_cleared = true;
     }
 
-    for (int i = 0; i < 2; i++)
+    // cells showing a CG RAM character that was redefined
+    uint32_t cg_dirty = lcd_cg_dirty.exchange(0);
+    if (cg_dirty)
     {
-        for (int j = 0; j < 24; j++)
+        for (int i = 0; i < lcd_rows; i++)
         {
-            uint8_t ch = LCD_Data[i * 40 + j];
-            LCD_FontRenderStandard(4 + i * 50, 4 + j * 34, ch);
+            for (int j = 0; j < lcd_cols; j++)
+            {
+                uint8_t ch = LCD_Data[i * 40 + j];
+                if (ch < 16 && (cg_dirty & (1 << (ch & 7))))
+                    dirty[i] |= 1 << j;
+            }
         }
     }
-    
+
     // cursor
     int j = LCD_DD_RAM % 0x40;
     int i = LCD_DD_RAM / 0x40;
-    if (i < 2 && j < 24 && LCD_C)
-        LCD_FontRenderStandard(4 + i * 50, 4 + j * 34, '_', true);
+    int cursor = -1;
+    if (i < lcd_rows && j < lcd_cols && LCD_C)
+        cursor = i * lcd_cols + j;
+    if (cursor != lcd_cursor_cell)
+    {
+        if (lcd_cursor_cell >= 0)
+            dirty[lcd_cursor_cell / lcd_cols] |= 1 << (lcd_cursor_cell % lcd_cols);
+        if (cursor >= 0)
+            dirty[i] |= 1 << j;
+        lcd_cursor_cell = cursor;
+    }
+
+    for (int row = 0; row < lcd_rows; row++)
+    {
+        for (uint32_t bits = dirty[row]; bits; bits &= bits - 1)
+        {
+            int col = __builtin_ctz(bits);
+            LCD_RenderCell(row, col, row * lcd_cols + col == cursor);
+        }
+        if (rendered)
+            rendered[row] = dirty[row];
+    }
 
     return (uint32_t*)lcd_buffer;
 }
 
 void LCD::LCD_SendButton(uint8_t button, int state) {
-    uint32_t button_pressed = mcu->mcu_button_pressed;
-    int mask = (1 << button);
     if (state) {
-        button_pressed |= mask;
+        mcu->MCU_PressButton(button);
     } else {
-        button_pressed &= ~mask;
+        mcu->MCU_ReleaseButton(button);
     }
-    mcu->mcu_button_pressed = button_pressed;
 }
 
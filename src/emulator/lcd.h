@@ -33,14 +33,30 @@
  */
 #pragma once
 
+#include <atomic>
 #include <stdint.h>
 #include <string>
 
 struct MCU;
 
+// the HD44780 character ROM from code 16 on, 5 bits a row
+extern uint8_t lcd_font[240][10];
+
 constexpr int lcd_width = 820;
 constexpr int lcd_height = 100;
 
+// the visible part of the 2x40 display
+constexpr int lcd_rows = 2;
+constexpr int lcd_cols = 24;
+
+// a 5x7 character of 5x5 pixel dots with a 1 pixel gap
+constexpr int lcd_cell_width = 5 * 6 - 1;
+constexpr int lcd_cell_height = 7 * 6 - 1;
+
+// where a cell is in lcd_buffer
+constexpr int lcd_cell_left(int col) { return 4 + col * 34; }
+constexpr int lcd_cell_top(int row) { return 4 + row * 50; }
+
 #ifdef STANDALONE
 constexpr uint32_t lcd_col1 = 0x000000;
 constexpr uint32_t lcd_col2 = 0x78b500;
@@ -64,10 +80,31 @@ struct LCD {
     uint8_t lcd_enable = 1;
 
     uint32_t lcd_buffer[lcd_height][lcd_width];
-    
-    void LCD_FontRenderStandard(int32_t x, int32_t y, uint8_t ch, bool overlay = false);
+
+    // Cells that LCD_Update has to render again, a bit per column of each
+    // row. LCD_Write sets them on the emulator core, LCD_Update takes them
+    // on the UI core.
+    std::atomic<uint32_t> lcd_dirty[lcd_rows] = {};
+    // CG RAM characters that changed, a bit each
+    std::atomic<uint32_t> lcd_cg_dirty = {};
+    // Counts the changes of what the display shows: DD and CG RAM
+    // contents, the cursor and the display control. Readers compare it
+    // with the value they last rendered.
+    std::atomic<uint32_t> lcd_generation = {};
+    // what lcd_buffer shows
+    bool lcd_cleared = false;
+    int lcd_cursor_cell = -1;
+
+    void LCD_WriteData(int index, uint8_t data);
+    void LCD_RenderCell(int row, int col, bool cursor);
     void LCD_Write(uint32_t address, uint8_t data);
     void LCD_Enable(uint32_t enable);
-    uint32_t* LCD_Update(void);
+    // everything is rendered again on the next LCD_Update
+    void LCD_Invalidate(void);
+    void LCD_Changed(void) { lcd_generation.fetch_add(1, std::memory_order_release); }
+    uint32_t LCD_GetGeneration(void) const { return lcd_generation.load(std::memory_order_acquire); }
+    // renders the cells that changed; their bits are returned in
+    // rendered[lcd_rows] if given
+    uint32_t* LCD_Update(uint32_t* rendered = nullptr);
     void LCD_SendButton(uint8_t button, int state);
 };
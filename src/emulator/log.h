@@ -0,0 +1,33 @@
+//
+// log.h
+//
+// Logging shim so the emulator core builds both on Circle and on a
+// regular host (standalone_test), where circle/logger.h does not exist.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifdef __circle__
+#include <circle/logger.h>
+#else
+#include <stdio.h>
+
+#define LOGMODULE(name) static const char From[] = name
+#define LOGPANIC(...) (fprintf(stderr, "%s: ", From), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGERR(...) (fprintf(stderr, "%s: ", From), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGWARN(...) (fprintf(stderr, "%s: ", From), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGNOTE(...) (fprintf(stderr, "%s: ", From), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGDBG(...) ((void)From)
+#endif
@@ -32,9 +32,10 @@
  *  POSSIBILITY OF SUCH DAMAGE.
  */
 #include "mcu.h"
+#include "midi.h"
 #include <stdio.h>
 #include <string.h>
-#include <circle/logger.h>
+#include "log.h"
 
 #if __linux__
 #include <limits.h>
@@ -200,7 +201,8 @@ uint8_t MCU::MCU_DeviceRead(uint32_t address) {
     return 0xff;
   case DEV_P7DR: {
     uint8_t data = 0xff;
-    uint32_t button_pressed = mcu_button_pressed;
+    uint32_t button_pressed =
+        mcu_button_pressed.load(std::memory_order_relaxed);
 
     if (io_sd == 0b11111011)
       data &= ((button_pressed >> 0) & 0b11111) ^ 0xFF;
@@ -277,6 +279,7 @@ void MCU::MCU_UpdateAnalog(const uint64_t cycles) {
 }
 
 uint8_t MCU::MCU_Read(uint32_t address) {
+  PROFILE_READ(opcode_profile, address, (dev_register[DEV_RAME] & 0x80) != 0);
   uint32_t address_rom = address & 0x3ffff;
   uint8_t page = (address >> 16) & 0xf;
   address &= 0xffff;
@@ -335,14 +338,17 @@ uint8_t MCU::MCU_Read(uint32_t address) {
 }
 
 void MCU::MCU_Write(uint32_t address, const uint8_t value) {
+  PROFILE_WRITE(opcode_profile, address, (dev_register[DEV_RAME] & 0x80) != 0);
   uint8_t page = (address >> 16) & 0xf;
   address &= 0xffff;
   if (page == 0 && address & 0x8000) {
     if (address >= 0xfb80 && address < 0xff80 &&
         (dev_register[DEV_RAME] & 0x80) != 0)
       ram[(address - 0xfb80) & 0x3ff] = value;
-    else if (address < 0xe000)
+    else if (address < 0xe000) {
       sram[address & 0x7fff] = value;
+      MCU_MarkDirty(MCU_REGION_SRAM, address & 0x7fff);
+    }
     else if (address >= 0xf400 && address < 0xf800) {
       if (address == 0xf404 || address == 0xf405)
         lcd.LCD_Write(address & 1, value);
@@ -357,13 +363,16 @@ void MCU::MCU_Write(uint32_t address, const uint8_t value) {
       MCU_DeviceWrite(address & 0x7f, value);
     else
         LOGWARN("Unknown write %x%04x\n", page, address);
-  } else if (page == 10)
+  } else if (page == 10) {
     sram[address & 0x7fff] = value;
-  else if (page == 12)
+    MCU_MarkDirty(MCU_REGION_SRAM, address & 0x7fff);
+  } else if (page == 12) {
     nvram[address & 0x7fff] = value;
-  else if (page == 14)
+    MCU_MarkDirty(MCU_REGION_NVRAM, address & 0x7fff);
+  } else if (page == 14 || page == 15) {
     cardram[address & 0x7fff] = value;
-  else
+    MCU_MarkDirty(MCU_REGION_CARDRAM, address & 0x7fff);
+  } else
       LOGWARN("Unknown write %x%04x\n", page, address);
 }
 
@@ -424,7 +433,6 @@ void MCU::MCU_UpdateUART_RX() {
                            (dev_register[DEV_SCR] & 0x40) != 0);
 }
 
-// dummy TX
 void MCU::MCU_UpdateUART_TX() {
   if ((dev_register[DEV_SCR] & 32) == 0) // TX disabled
     return;
@@ -435,36 +443,27 @@ void MCU::MCU_UpdateUART_TX() {
   if (mcu.cycles < uart_tx_delay)
     return;
 
+  // while the buffer is full TDRE stays clear, which holds the firmware
+  // back instead of dropping the byte
+  if (uart_tx_count >= uart_tx_buffer_size)
+    return;
+
+  // TDRE was cleared by the firmware, so TDR holds a byte to send
+  uart_tx_buffer[uart_tx_count++] = dev_register[DEV_TDR];
+
   dev_register[DEV_SSR] |= 0x80;
   MCU_Interrupt_SetRequest(INTERRUPT_SOURCE_UART_TX,
                            (dev_register[DEV_SCR] & 0x80) != 0);
-
-  // printf("tx:%x\n", dev_register[DEV_TDR]);
 }
 
-void MCU::MCU_PatchROM() {
-  // Disable intro
-  rom2[0x318f7] = 0x19;
-}
+void MCU::MCU_FlushUART_TX(MidiTxRing *ring) {
+  if (uart_tx_count == 0)
+    return;
 
-void unscramble(const uint8_t *src, uint8_t *dst, const int len) {
-  for (int i = 0; i < len; i++) {
-    int address = i & ~0xfffff;
-    static const int aa[] = {2, 0,  3,  4,  1, 9, 13, 10, 18, 17,
-                             6, 15, 11, 16, 8, 5, 12, 7,  14, 19};
-    for (int j = 0; j < 20; j++) {
-      if (i & (1 << j))
-        address |= 1 << aa[j];
-    }
-    uint8_t srcdata = src[address];
-    uint8_t data = 0;
-    static const int dd[] = {2, 0, 4, 5, 7, 6, 3, 1};
-    for (int j = 0; j < 8; j++) {
-      if (srcdata & (1 << dd[j]))
-        data |= 1 << j;
-    }
-    dst[i] = data;
-  }
+  uint32_t written = ring->MIDI_Write(uart_tx_buffer, uart_tx_count);
+  // keep what did not fit for the next flush
+  memmove(uart_tx_buffer, uart_tx_buffer + written, uart_tx_count - written);
+  uart_tx_count -= written;
 }
 
 void MCU::MCU_GA_SetGAInt(const int line, const int value) {
@@ -476,9 +475,41 @@ void MCU::MCU_GA_SetGAInt(const int line, const int value) {
   MCU_Interrupt_SetRequest(INTERRUPT_SOURCE_IRQ0, ga_int_trigger != 0);
 }
 
-void MCU::MCU_EncoderTrigger(const int dir) {
-  MCU_GA_SetGAInt(dir == 0 ? 3 : 4, 0);
-  MCU_GA_SetGAInt(dir == 0 ? 3 : 4, 1);
+void MCU::MCU_EncoderTrigger(const int dir, const int steps) {
+  int32_t delta = dir == 0 ? -steps : steps;
+  int32_t pending = encoder_steps.load(std::memory_order_relaxed);
+  int32_t queued;
+  do {
+    // a spin that outruns the firmware must not keep it scrolling for long
+    queued = pending + delta;
+    if (queued > encoder_queue_size)
+      queued = encoder_queue_size;
+    else if (queued < -encoder_queue_size)
+      queued = -encoder_queue_size;
+  } while (!encoder_steps.compare_exchange_weak(pending, queued,
+                                                std::memory_order_relaxed));
+}
+
+void MCU::MCU_UpdateEncoder() {
+  // the firmware has not taken the last interrupt yet
+  if (ga_int_trigger != 0)
+    return;
+
+  int32_t steps = encoder_steps.load(std::memory_order_relaxed);
+  if (steps == 0)
+    return;
+
+  // while the firmware has the line masked, the detents are lost as on the
+  // hardware, rather than coming through in a burst once it is unmasked
+  int line = steps > 0 ? 4 : 3;
+  if ((ga_int_enable & (1 << line)) == 0) {
+    encoder_steps.store(0, std::memory_order_relaxed);
+    return;
+  }
+
+  encoder_steps.fetch_sub(steps > 0 ? 1 : -1, std::memory_order_relaxed);
+  MCU_GA_SetGAInt(line, 0);
+  MCU_GA_SetGAInt(line, 1);
 }
 
 void MCU::MCU_Interrupt_Handle() {
@@ -752,49 +783,90 @@ void MCU::TIMER_Clock(const uint64_t cycles) {
 
 MCU::MCU() : pcm(this), lcd(this) {}
 
-int MCU::startSC55(const uint8_t *s_rom1, const uint8_t *s_rom2,
-                   const uint8_t *s_waverom1, const uint8_t *s_waverom2,
-                   const uint8_t *s_nvram) {
-  uint8_t *tempbuf = (uint8_t *)malloc(0x800000);
+MCU::~MCU() {
+  if (romset)
+    romset->ROMSET_Release();
+}
+
+int MCU::startSC55(RomSet *roms, const uint8_t *s_nvram) {
+  roms->ROMSET_Retain();
+  if (romset)
+    romset->ROMSET_Release();
+  romset = roms;
+  rom1 = roms->rom1;
+  rom2 = roms->rom2;
+  pcm.roms = roms;
+  pcm.wave_generation = ~0u;
+  while (!roms->ROMSET_CopyWaveBanks(pcm.wave, &pcm.wave_generation)) {
+    // a card or expansion is being enabled right now
+  }
 
   memset(&mcu, 0, sizeof(mcu_t));
 
-  memcpy(rom1, s_rom1, ROM1_SIZE);
-  memcpy(rom2, s_rom2, ROM2_SIZE);
+  // heap allocated instances start from the same state as static ones
+  memset(ram, 0, RAM_SIZE);
+  memset(sram, 0, SRAM_SIZE);
   memcpy(nvram, s_nvram, NVRAM_SIZE);
-
-  memcpy(tempbuf, s_waverom1, 0x200000);
-  unscramble(tempbuf, pcm.waverom1, 0x200000);
-  memcpy(tempbuf, s_waverom2, 0x200000);
-  unscramble(tempbuf, pcm.waverom2, 0x200000);
-
-  free(tempbuf);
+  memset(cardram, 0, CARDRAM_SIZE);
+  memset(dirty_pages, 0, sizeof(dirty_pages));
 
   SC55_Reset();
 
   return 0;
 }
 
-void MCU::updateSC55(const int nSamples) {
-  sample_write_ptr = 0;
-  while (sample_write_ptr < nSamples) {
-    if (!mcu.ex_ignore)
-      MCU_Interrupt_Handle();
-    else
-      mcu.ex_ignore = 0;
+void MCU::MCU_LoadCardRAM(const uint8_t *data) {
+  memcpy(cardram, data, CARDRAM_SIZE);
+}
 
-    if (!mcu.sleep)
-      MCU_ReadInstruction();
+uint8_t *MCU::MCU_GetRegion(int region) {
+  switch (region) {
+  case MCU_REGION_SRAM:
+    return sram;
+  case MCU_REGION_NVRAM:
+    return nvram;
+  case MCU_REGION_CARDRAM:
+    return cardram;
+  }
+  return nullptr;
+}
 
-    mcu.cycles += 12; // FIXME: assume 12 cycles per instruction
+void MCU::MCU_CollectDirtyPages(int region, uint8_t *image, uint32_t *pages) {
+  const uint8_t *data = MCU_GetRegion(region);
+  for (int i = 0; i < MCU_REGION_PAGES / 32; i++) {
+    uint32_t bits = dirty_pages[region][i];
+    pages[i] |= bits;
+    dirty_pages[region][i] = 0;
+    while (bits) {
+      int page = i * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      memcpy(image + page * MCU_PAGE_SIZE, data + page * MCU_PAGE_SIZE,
+             MCU_PAGE_SIZE);
+    }
+  }
+}
+
+int MCU::startSC55(const uint8_t *s_rom1, const uint8_t *s_rom2,
+                   const uint8_t *s_waverom1, const uint8_t *s_waverom2,
+                   const uint8_t *s_nvram) {
+  RomSet *roms = RomSet::ROMSET_Create(s_rom1, s_rom2, s_waverom1, s_waverom2);
+  if (!roms)
+    return 1;
 
-    TIMER_Clock(mcu.cycles);
-    MCU_UpdateUART_RX();
-    MCU_UpdateUART_TX();
-    MCU_UpdateAnalog(mcu.cycles);
+  int ret = startSC55(roms, s_nvram);
+  roms->ROMSET_Release();
 
-    pcm.PCM_Update(mcu.cycles);
-  }
+  return ret;
+}
+
+// renders into the current sample buffer, which must hold nSamples
+void MCU::updateSC55(const int nSamples) {
+  sample_write_ptr = 0;
+  sample_write_end = nSamples;
+  pcm.PCM_SyncWaveBanks();
+  PROFILE_START(profile);
+  while (sample_write_ptr < nSamples)
+    MCU_Step();
 }
 
 void MCU::SC55_Reset() {
@@ -803,6 +875,7 @@ void MCU::SC55_Reset() {
   ga_int_enable = 0;
   ga_int_trigger = 0;
   ga_lcd_counter = 0;
+  encoder_steps = 0;
   io_sd = 0x00;
   adf_rd = 0;
   analog_end_time = 0;
@@ -814,10 +887,10 @@ void MCU::SC55_Reset() {
   uart_rx_byte = 0x00;
   uart_rx_delay = 0x00;
   uart_tx_delay = 0x00;
+  uart_tx_count = 0;
   memset(dev_register, 0, sizeof(dev_register));
 
   MCU_Init();
-  MCU_PatchROM();
   MCU_Reset();
   pcm.PCM_Reset();
   TIMER_Reset();
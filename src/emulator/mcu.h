@@ -37,9 +37,13 @@
 #include "lcd.h"
 #include "mcu_opcodes.h"
 #include "pcm.h"
+#include "profile.h"
+#include <atomic>
 #include <stdint.h>
 #include <vector>
 
+struct MidiTxRing;
+
 enum {
   DEV_P1DDR = 0x00,
   DEV_P5DDR = 0x08,
@@ -239,24 +243,40 @@ enum {
 
 constexpr uint32_t ANALOG_LEVEL_BATTERY = 0x2a0;
 
-static const int ROM1_SIZE = 0x8000;
-static const int ROM2_SIZE = 0x40000;
 static const int RAM_SIZE = 0x400;
 static const int SRAM_SIZE = 0x8000;
 static const int NVRAM_SIZE = 0x8000;   // JV880 only
 static const int CARDRAM_SIZE = 0x8000; // JV880 only
 static const int ROMSM_SIZE = 0x1000;
+
+// RAMs tracked for persistence, in pages of MCU_PAGE_SIZE
+enum {
+  MCU_REGION_SRAM = 0,
+  MCU_REGION_NVRAM,
+  MCU_REGION_CARDRAM,
+  MCU_REGIONS,
+};
+static const int MCU_REGION_SIZE = 0x8000;
+static const int MCU_PAGE_SIZE = 0x100;
+static const int MCU_REGION_PAGES = MCU_REGION_SIZE / MCU_PAGE_SIZE;
 const uint32_t uart_buffer_size = 8192;
+const uint32_t uart_tx_buffer_size = 1024;
+// most encoder steps queued in either direction
+const int32_t encoder_queue_size = 256;
 
 static const int audio_buffer_size = 4096;
 
 struct MCU {
-  uint32_t mcu_button_pressed;
+  // one bit per MCU_BUTTON_*, set and cleared from other cores while
+  // the firmware scans the key matrix
+  std::atomic<uint32_t> mcu_button_pressed;
 
   mcu_t mcu;
 
-  uint8_t rom1[ROM1_SIZE];
-  uint8_t rom2[ROM2_SIZE];
+  // read only and shared, see romset.h; rom1 and rom2 point into romset
+  RomSet *romset = nullptr;
+  const uint8_t *rom1 = nullptr;
+  const uint8_t *rom2 = nullptr;
   uint8_t ram[RAM_SIZE];
   uint8_t sram[SRAM_SIZE];
   uint8_t nvram[NVRAM_SIZE];
@@ -264,11 +284,24 @@ struct MCU {
 
   int rom2_mask = ROM2_SIZE - 1;
 
+  // pages written since the last MCU_CollectDirtyPages, a bit per page
+  uint32_t dirty_pages[MCU_REGIONS][MCU_REGION_PAGES / 32] = {};
+
   int ga_int[8] = {0};
   int ga_int_enable = 0;
   int ga_int_trigger = 0;
   int ga_lcd_counter = 0;
 
+  // encoder steps not yet delivered, positive clockwise; queued from the UI
+  // and passed to the firmware one per serviced IRQ, dropped while it has
+  // the encoder interrupt masked
+  std::atomic<int32_t> encoder_steps{0};
+
+  // stage counters and firmware statistics of this instance, see
+  // profile.h
+  Profile profile;
+  OpcodeProfile opcode_profile;
+
   uint8_t dev_register[0x80] = {0};
 
   uint8_t io_sd = 0x00;
@@ -286,6 +319,9 @@ struct MCU {
   uint8_t uart_rx_byte;
   uint64_t uart_rx_delay;
   uint64_t uart_tx_delay;
+  // bytes sent by the firmware, staged until MCU_FlushUART_TX
+  uint8_t uart_tx_buffer[uart_tx_buffer_size];
+  uint32_t uart_tx_count;
 
   uint32_t operand_type;
   uint16_t operand_ea;
@@ -324,19 +360,44 @@ struct MCU {
   Pcm pcm;
   LCD lcd;
 
-  int16_t sample_buffer[audio_buffer_size] = {0};
+  // The PCM writes straight into the buffer handed over with
+  // MCU_SetSampleBuffer (e.g. the audio stream of the host); sample_buffer
+  // is only the default target. Samples are full scale int32_t, so the
+  // 20-bit mix is kept; see audioformat.h for the conversions.
+  int32_t sample_buffer[audio_buffer_size] = {0};
+  int32_t *sample_out = sample_buffer;
   int sample_write_ptr = 0;
+  int sample_write_end = audio_buffer_size;
 
   MCU();
+  ~MCU();
+  MCU(const MCU &) = delete;
+  MCU &operator=(const MCU &) = delete;
 
+  // takes a reference to roms, which may be shared with other instances
+  int startSC55(RomSet *roms, const uint8_t *s_nvram);
+  // convenience for a single instance, creates a private RomSet
   int startSC55(const uint8_t *s_rom1, const uint8_t *s_rom2,
                 const uint8_t *s_waverom1, const uint8_t *s_waverom2,
                 const uint8_t *s_nvram);
   void updateSC55(const int nSamples);
+  // contents of a RAM card (pages 14 and 15), CARDRAM_SIZE bytes; call
+  // after startSC55, which clears it
+  void MCU_LoadCardRAM(const uint8_t *data);
+
+  // sram, nvram or cardram, MCU_REGION_SIZE bytes
+  uint8_t *MCU_GetRegion(int region);
+  // Copies the pages of region written since the last call into image (of
+  // the region's size, other pages are left alone), adds them to the
+  // bitmap in pages[MCU_REGION_PAGES / 32] and starts over. Like the
+  // render calls, not concurrently with the instance running.
+  void MCU_CollectDirtyPages(int region, uint8_t *image, uint32_t *pages);
   void postMidiSC55(const uint8_t *message, int length);
   void SC55_Reset();
   void MCU_PostUART(const uint8_t data);
-  void MCU_EncoderTrigger(const int dir);
+  // queues steps of the data entry knob, any context
+  void MCU_EncoderTrigger(const int dir, const int steps = 1);
+  void MCU_UpdateEncoder();
 
   void MCU_ErrorTrap();
 
@@ -346,6 +407,7 @@ struct MCU {
   void MCU_GA_SetGAInt(const int line, const int value);
   void MCU_UpdateUART_RX();
   void MCU_UpdateUART_TX();
+  void MCU_FlushUART_TX(MidiTxRing *ring);
 
   uint16_t MCU_AnalogReadPin(const uint32_t pin);
   void MCU_AnalogSample(const int channel);
@@ -355,7 +417,6 @@ struct MCU {
   void MCU_UpdateAnalog(const uint64_t cycles);
   void MCU_Init();
   void MCU_Reset();
-  void MCU_PatchROM();
 
   void MCU_Interrupt_Handle();
 
@@ -367,15 +428,41 @@ struct MCU {
   void TIMER2_Write(const uint32_t address, const uint8_t data);
   uint8_t TIMER_Read2(const uint32_t address);
 
+  // samples is the size of buffer in int32_t (two per stereo frame)
+  // also the point where wave banks loaded meanwhile are switched in
+  inline void MCU_SetSampleBuffer(int32_t *buffer, int samples) {
+    sample_out = buffer;
+    sample_write_ptr = 0;
+    sample_write_end = samples;
+    pcm.PCM_SyncWaveBanks();
+  }
+
   inline void MCU_PostSample(int *sample) {
-    sample_buffer[sample_write_ptr++] = sample[0] >> 16;
-    sample_buffer[sample_write_ptr++] = sample[1] >> 16;
-    sample_write_ptr %= audio_buffer_size;
-
-    // int ptr = SDL_AtomicGet(&sample_write_ptr);
-    // sample_buffer[ptr] = sample[0] >> 16;
-    // sample_buffer[ptr + 1] = sample[1] >> 16;
-    // SDL_AtomicSet(&sample_write_ptr, (ptr + 2) % audio_buffer_size);
+    // the render loops stop at the end of the buffer, but a PCM update
+    // may post more than one frame
+    if (sample_write_ptr >= sample_write_end)
+      return;
+    sample_out[sample_write_ptr] = sample[0];
+    sample_out[sample_write_ptr + 1] = sample[1];
+    sample_write_ptr += 2;
+  }
+
+  inline void MCU_MarkDirty(int region, uint32_t offset) {
+    dirty_pages[region][offset >> 13] |= 1u << ((offset >> 8) & 31);
+  }
+
+  // hold and release a front panel button; several can be held at once
+  inline void MCU_PressButton(int button) {
+    mcu_button_pressed.fetch_or(1u << button, std::memory_order_relaxed);
+  }
+
+  inline void MCU_ReleaseButton(int button) {
+    mcu_button_pressed.fetch_and(~(1u << button), std::memory_order_relaxed);
+  }
+
+  inline uint32_t MCU_UARTFree() {
+    return uart_buffer_size - 1 -
+           ((uart_write_ptr - uart_read_ptr) & (uart_buffer_size - 1));
   }
 
   inline uint32_t MCU_GetAddress(const uint8_t page, const uint16_t address) {
@@ -534,6 +621,7 @@ struct MCU {
 
   inline void MCU_ReadInstruction() {
     uint8_t operand = MCU_ReadCodeAdvance();
+    PROFILE_INSTRUCTION(opcode_profile, mcu.cp, mcu.pc - 1, operand);
 
     MCU_Operand_Table[operand](this, operand);
 
@@ -542,6 +630,34 @@ struct MCU {
     }
   }
 
+  // One instruction and everything clocked after it, up to the PCM; the
+  // step of all render loops, so that they keep the same timing
+  inline void MCU_Step() {
+    if (!mcu.ex_ignore)
+      MCU_Interrupt_Handle();
+    else
+      mcu.ex_ignore = 0;
+    PROFILE_STAGE(profile, PROFILE_INTERRUPT);
+
+    if (!mcu.sleep)
+      MCU_ReadInstruction();
+
+    mcu.cycles += 12; // FIXME: assume 12 cycles per instruction
+    PROFILE_STAGE(profile, PROFILE_EXECUTE);
+
+    TIMER_Clock(mcu.cycles);
+    PROFILE_STAGE(profile, PROFILE_TIMER);
+    MCU_UpdateUART_RX();
+    MCU_UpdateUART_TX();
+    PROFILE_STAGE(profile, PROFILE_UART);
+    MCU_UpdateAnalog(mcu.cycles);
+    MCU_UpdateEncoder();
+    PROFILE_STAGE(profile, PROFILE_ANALOG);
+
+    pcm.PCM_Update(mcu.cycles);
+    PROFILE_STAGE(profile, PROFILE_PCM_EFFECTS);
+  }
+
   inline void MCU_Interrupt_SetRequest(const uint32_t interrupt,
                                        const uint32_t value) {
     mcu.interrupt_pending[interrupt] = value;
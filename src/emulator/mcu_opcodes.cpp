@@ -719,6 +719,7 @@ void MCU_Operand_General(MCU *mcu, uint8_t operand)
     mcu->operand_data = data;
     mcu->operand_status = 0;
 
+    PROFILE_OPCODE(mcu->opcode_profile, type, opcode);
     MCU_Opcode_Table[opcode](mcu, opcode, opcode_reg);
 }
 
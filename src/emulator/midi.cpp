@@ -0,0 +1,211 @@
+//
+// midi.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "midi.h"
+#include "mcu.h"
+
+// How long a half-received SysEx may block the other inputs before it is
+// terminated, in MCU cycles (20 MHz, 625 per 32 kHz frame): 150 ms of
+// emulated time, which runs with the sound output, however often the
+// merge is called.
+static const uint64_t sysex_stall_cycles = 625 * 32000 / 1000 * 150;
+
+static int MIDI_DataLength(const uint8_t status) {
+  switch (status & 0xf0) {
+  case 0xc0:
+  case 0xd0:
+    return 1;
+  case 0xf0:
+    if (status == 0xf1 || status == 0xf3)
+      return 1;
+    if (status == 0xf2)
+      return 2;
+    return 0;
+  default:
+    return 2;
+  }
+}
+
+static void MIDI_Emit(MidiQueue *queue, uint64_t timestamp,
+                      const uint8_t *data, uint8_t length) {
+  midi_event_t event;
+  event.timestamp = timestamp;
+  event.length = length;
+  for (int i = 0; i < length; i++)
+    event.data[i] = data[i];
+  queue->MIDI_Push(event);
+}
+
+uint32_t MidiTxRing::MIDI_Write(const uint8_t *src, uint32_t length) {
+  uint32_t wr = write_ptr.load(std::memory_order_relaxed);
+  uint32_t free =
+      midi_tx_ring_size - (wr - read_ptr.load(std::memory_order_acquire));
+  if (length > free)
+    length = free;
+  for (uint32_t i = 0; i < length; i++)
+    data[(wr + i) & (midi_tx_ring_size - 1)] = src[i];
+  write_ptr.store(wr + length, std::memory_order_release);
+  return length;
+}
+
+uint32_t MidiTxRing::MIDI_Read(uint8_t *dst, uint32_t length) {
+  uint32_t rd = read_ptr.load(std::memory_order_relaxed);
+  uint32_t avail = write_ptr.load(std::memory_order_acquire) - rd;
+  if (length > avail)
+    length = avail;
+  for (uint32_t i = 0; i < length; i++)
+    dst[i] = data[(rd + i) & (midi_tx_ring_size - 1)];
+  read_ptr.store(rd + length, std::memory_order_release);
+  return length;
+}
+
+void MidiParser::MIDI_Reset() {
+  running_status = 0;
+  count = 0;
+  expected = 0;
+  sysex = false;
+}
+
+void MidiParser::MIDI_Parse(const uint8_t *data, int length,
+                            uint64_t timestamp, MidiQueue *queue) {
+  for (int i = 0; i < length; i++) {
+    uint8_t byte = data[i];
+
+    if (byte >= 0xf8) { // real-time, may appear anywhere
+      MIDI_Emit(queue, timestamp, &byte, 1);
+      continue;
+    }
+
+    if (sysex) {
+      if ((byte & 0x80) == 0) {
+        message[count++] = byte;
+        if (count == 3) {
+          MIDI_Emit(queue, timestamp, message, count);
+          count = 0;
+        }
+        continue;
+      }
+
+      // EOX, or a status byte cutting the SysEx short: terminate it so
+      // the firmware does not wait for the rest
+      if (count == 3) {
+        MIDI_Emit(queue, timestamp, message, count);
+        count = 0;
+      }
+      message[count++] = 0xf7;
+      MIDI_Emit(queue, timestamp, message, count);
+      count = 0;
+      sysex = false;
+      if (byte == 0xf7)
+        continue;
+    }
+
+    if (byte == 0xf0) {
+      running_status = 0;
+      sysex = true;
+      message[0] = byte;
+      count = 1;
+      continue;
+    }
+
+    if (byte & 0x80) {
+      if (byte == 0xf7) { // stray EOX
+        count = 0;
+        continue;
+      }
+      // system common messages cancel running status
+      running_status = byte < 0xf0 ? byte : 0;
+      message[0] = byte;
+      count = 1;
+      expected = 1 + MIDI_DataLength(byte);
+      if (count == expected) {
+        MIDI_Emit(queue, timestamp, message, count);
+        count = 0;
+      }
+      continue;
+    }
+
+    if (count == 0) {
+      if (!running_status)
+        continue; // data byte without status
+      message[0] = running_status;
+      count = 1;
+      expected = 1 + MIDI_DataLength(running_status);
+    }
+    message[count++] = byte;
+    if (count == expected) {
+      MIDI_Emit(queue, timestamp, message, count);
+      count = 0;
+    }
+  }
+}
+
+static uint32_t MIDI_UARTFree(MCU *const *mcus, int mcu_count) {
+  uint32_t space = mcus[0]->MCU_UARTFree();
+  for (int i = 1; i < mcu_count; i++) {
+    uint32_t free = mcus[i]->MCU_UARTFree();
+    if (free < space)
+      space = free;
+  }
+  return space;
+}
+
+static void MIDI_PostUART(MCU *const *mcus, int mcu_count, uint8_t byte) {
+  for (int i = 0; i < mcu_count; i++)
+    mcus[i]->MCU_PostUART(byte);
+}
+
+void MidiMerge::MIDI_Drain(MidiQueue *const *queues, int count,
+                           MCU *const *mcus, int mcu_count) {
+  while (MIDI_UARTFree(mcus, mcu_count) >= 3) {
+    int source = -1;
+    const midi_event_t *event = nullptr;
+
+    if (sysex_source >= 0) {
+      // do not interleave other inputs into a running SysEx
+      source = sysex_source;
+      event = queues[source]->MIDI_Peek();
+      if (!event) {
+        if (mcus[0]->mcu.cycles - sysex_cycles < sysex_stall_cycles)
+          return;
+        MIDI_PostUART(mcus, mcu_count, 0xf7);
+        sysex_source = -1;
+        continue;
+      }
+    } else {
+      for (int i = 0; i < count; i++) {
+        const midi_event_t *head = queues[i]->MIDI_Peek();
+        if (head && (!event || head->timestamp < event->timestamp)) {
+          event = head;
+          source = i;
+        }
+      }
+      if (!event)
+        return;
+    }
+
+    for (int i = 0; i < event->length; i++) {
+      uint8_t byte = event->data[i];
+      if (byte == 0xf0)
+        sysex_source = source;
+      else if (byte == 0xf7)
+        sysex_source = -1;
+      MIDI_PostUART(mcus, mcu_count, byte);
+    }
+    queues[source]->MIDI_Pop();
+    sysex_cycles = mcus[0]->mcu.cycles;
+  }
+}
@@ -0,0 +1,116 @@
+//
+// midi.h
+//
+// MIDI plumbing shared by the USB, serial (DIN) and host ports:
+// a running-status aware parser, a lock-free single-producer /
+// single-consumer event queue, a merger that feeds the emulated UART and
+// a byte ring carrying the UART output back out.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+struct MCU;
+
+// One complete channel/system message with its status byte, or a chunk
+// of up to three SysEx bytes. timestamp is in microseconds of whatever
+// clock the producer uses (CTimer::GetClockTicks on Circle).
+struct midi_event_t {
+  uint64_t timestamp;
+  uint8_t length;
+  uint8_t data[3];
+};
+
+static const uint32_t midi_queue_size = 1024; // must be a power of two
+
+// Lock-free SPSC ring: exactly one context may push (e.g. the serial
+// poller or the USB IRQ handler) and exactly one may pop (the emulator
+// core).
+struct MidiQueue {
+  midi_event_t events[midi_queue_size];
+  std::atomic<uint32_t> write_ptr{0};
+  std::atomic<uint32_t> read_ptr{0};
+  uint32_t dropped = 0;
+
+  inline bool MIDI_Push(const midi_event_t &event) {
+    uint32_t wr = write_ptr.load(std::memory_order_relaxed);
+    if (wr - read_ptr.load(std::memory_order_acquire) >= midi_queue_size) {
+      dropped++;
+      return false;
+    }
+    events[wr & (midi_queue_size - 1)] = event;
+    write_ptr.store(wr + 1, std::memory_order_release);
+    return true;
+  }
+
+  inline const midi_event_t *MIDI_Peek() {
+    uint32_t rd = read_ptr.load(std::memory_order_relaxed);
+    if (rd == write_ptr.load(std::memory_order_acquire))
+      return nullptr;
+    return &events[rd & (midi_queue_size - 1)];
+  }
+
+  inline void MIDI_Pop() {
+    read_ptr.store(read_ptr.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+  }
+};
+
+static const uint32_t midi_tx_ring_size = 4096; // must be a power of two
+
+// Lock-free SPSC byte ring for MIDI leaving the emulated UART. Both ends
+// move whole batches and publish them with a single atomic store, so the
+// emulator does not pay for synchronisation per transmitted byte.
+struct MidiTxRing {
+  uint8_t data[midi_tx_ring_size];
+  std::atomic<uint32_t> write_ptr{0};
+  std::atomic<uint32_t> read_ptr{0};
+
+  uint32_t MIDI_Write(const uint8_t *src, uint32_t length);
+  uint32_t MIDI_Read(uint8_t *dst, uint32_t length);
+};
+
+// Byte-stream parser. Running status is expanded so that every emitted
+// message carries its status byte; this is what allows messages from
+// several inputs to be interleaved on the single emulated UART.
+// Real-time bytes are emitted immediately and do not disturb the
+// message in progress.
+struct MidiParser {
+  uint8_t running_status = 0;
+  uint8_t message[3] = {0};
+  uint8_t count = 0;
+  uint8_t expected = 0;
+  bool sysex = false;
+
+  void MIDI_Reset();
+  void MIDI_Parse(const uint8_t *data, int length, uint64_t timestamp,
+                  MidiQueue *queue);
+};
+
+// Merges several queues into the emulated UART in timestamp order.
+// Must only be called from the context that runs the emulator.
+struct MidiMerge {
+  int sysex_source = -1;
+  uint64_t sysex_cycles = 0; // of the first MCU when the last event went in
+
+  void MIDI_Drain(MidiQueue *const *queues, int count, MCU *mcu) {
+    MIDI_Drain(queues, count, &mcu, 1);
+  }
+  // the same stream to each of mcus, e.g. to layer several instances
+  void MIDI_Drain(MidiQueue *const *queues, int count, MCU *const *mcus,
+                  int mcu_count);
+};
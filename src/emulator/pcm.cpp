@@ -37,7 +37,42 @@
 #include "mcu.h"
 #include "pcm.h"
 
-Pcm::Pcm(MCU *mcu): mcu(mcu) {}
+Pcm::Pcm(MCU *mcu): mcu(mcu)
+{
+    for (int slot = 0; slot < 32; slot++)
+        stem_bus[slot] = slot < 28 ? PCM_STEM_DRY + slot : PCM_STEM_DRY;
+}
+
+void Pcm::PCM_SetStemBuffer(int32_t *buffer, int frames)
+{
+    stem_out = buffer;
+    stem_write_ptr = 0;
+    stem_write_end = frames;
+}
+
+// one frame of stems, the accumulators are cleared for the next one
+static inline void PCM_PostStems(Pcm *p, bool clear)
+{
+    if (p->stem_write_ptr < p->stem_write_end)
+    {
+        int32_t *out = p->stem_out + p->stem_write_ptr * PCM_STEM_BUSES * 2;
+        for (int bus = 0; bus < PCM_STEM_BUSES; bus++)
+        {
+            for (int ch = 0; ch < 2; ch++)
+            {
+                int v = p->stem_accum[bus][ch];
+                if (v > 0x7ffff)
+                    v = 0x7ffff;
+                else if (v < -0x80000)
+                    v = -0x80000;
+                out[bus * 2 + ch] = v * (1 << 12);
+            }
+        }
+        p->stem_write_ptr++;
+    }
+    if (clear)
+        memset(p->stem_accum, 0, sizeof(p->stem_accum));
+}
 
 void Pcm::PCM_Write(uint32_t address, uint8_t data)
 {
@@ -459,6 +494,8 @@ void Pcm::PCM_Update(uint64_t cycles)
             tt[1] = (int)((pcm.ram1[30][4] & ~write_mask) << 12);
 
             mcu->MCU_PostSample(tt);
+            if (stem_out)
+                PCM_PostStems(this, !oversampling);
 
             xr = ((shifter >> 0) ^ (shifter >> 1) ^ (shifter >> 7) ^ (shifter >> 12)) & 1;
             shifter = (shifter >> 1) | (xr << 15);
@@ -472,9 +509,7 @@ void Pcm::PCM_Update(uint64_t cycles)
             pcm.ram1[30][5] = addclip20(pcm.accum_r,
                 orval | (shifter & noise_mask), 0);
 
-            // if (pcm.config_reg_3c & 0x40) // oversampling
-            // if (true) // oversampling
-            if (false) // oversampling
+            if (oversampling && (pcm.config_reg_3c & 0x40)) // oversampling
             {
                 pcm.ram2[30][10] = shifter;
 
@@ -486,6 +521,16 @@ void Pcm::PCM_Update(uint64_t cycles)
                 tt[1] = (int)((pcm.ram1[30][5] & ~write_mask) << 12);
 
                 mcu->MCU_PostSample(tt);
+                if (stem_out)
+                    PCM_PostStems(this, true); // held, the buses are not oversampled
+            }
+            else if (oversampling)
+            {
+                // the firmware has oversampling off: hold the sample to
+                // keep the output rate
+                mcu->MCU_PostSample(tt);
+                if (stem_out)
+                    PCM_PostStems(this, true);
             }
         }
 
@@ -955,6 +1000,10 @@ void Pcm::PCM_Update(uint64_t cycles)
         // int rc0_per_slot[32] = {0};
         // int rc1_per_slot[32] = {0};
 
+        PROFILE_STAGE(mcu->profile, PROFILE_PCM_EFFECTS);
+
+        const bool stems = stem_out != nullptr;
+
         for (int slot = 0; slot < reg_slots; slot++)
         {
             uint32_t *ram1 = pcm.ram1[slot];
@@ -1400,6 +1449,23 @@ void Pcm::PCM_Update(uint64_t cycles)
                 }
             }
 
+            if (stems)
+            {
+                int *dry = stem_accum[stem_bus[slot]];
+                dry[0] += sx20(sampl >> 6);
+                dry[1] += sx20(sampr >> 6);
+
+                switch (next_slot)
+                {
+                    case 17: stem_accum[PCM_STEM_REVERB][0] += sx20(rcadd[0] >> 1); break;
+                    case 18: stem_accum[PCM_STEM_REVERB][1] += sx20(rcadd[1] >> 1); break;
+                    case 21: stem_accum[PCM_STEM_CHORUS][0] += sx20(rcadd[2] >> 1); break;
+                    case 22: stem_accum[PCM_STEM_CHORUS][1] += sx20(rcadd[3] >> 1); break;
+                    case 23: stem_accum[PCM_STEM_CHORUS][0] += sx20(rcadd[4] >> 1); break;
+                    case 31: stem_accum[PCM_STEM_CHORUS][1] += sx20(rcadd[5] >> 1); break;
+                }
+            }
+
             pcm.rcsum[0] = addclip20(pcm.rcsum[0], rc0 >> 1, rc0 & 1);
             pcm.rcsum[1] = addclip20(pcm.rcsum[1], rc1 >> 1, rc1 & 1);
 
@@ -1417,6 +1483,8 @@ void Pcm::PCM_Update(uint64_t cycles)
             }
         }
 
+        PROFILE_STAGE(mcu->profile, PROFILE_PCM_VOICES);
+
         if (pcm.nfs)
         {
             pcm.ram2[31][7] |= 0x20;
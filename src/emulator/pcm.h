@@ -32,6 +32,7 @@
  *  POSSIBILITY OF SUCH DAMAGE.
  */
 #pragma once
+#include "romset.h"
 #include <stdint.h>
 // #include <circle/spinlock.h>
 
@@ -66,16 +67,45 @@ struct pcm_t {
 
 struct MCU;
 
+// Stem buses: the effect returns, then by default one dry bus per slot
+enum {
+  PCM_STEM_REVERB = 0,
+  PCM_STEM_CHORUS,
+  PCM_STEM_DRY,
+  PCM_STEM_BUSES = PCM_STEM_DRY + 28,
+};
+
 struct Pcm {
   MCU *mcu;
   Pcm(MCU *mcu);
 
   pcm_t pcm = {0};
-  uint8_t waverom1[0x200000];
-  uint8_t waverom2[0x200000];
-  uint8_t waverom3[0x100000];
-  uint8_t waverom_card[0x200000];
-  uint8_t waverom_exp[0x800000];
+
+  // Post both sub-samples of the mixer (64 kHz output instead of 32 kHz).
+  // May be changed between two PCM_Update calls.
+  bool oversampling = false;
+
+  // Optional stem output, written alongside every frame posted to the MCU:
+  // PCM_STEM_BUSES stereo buses per frame, full scale like the main mix.
+  // The dry signal of each slot (voice) goes to stem_bus[slot], so a host
+  // that knows the firmware's voice allocation can group slots by part.
+  // The buses add up to the main mix apart from the mixer's rounding.
+  int32_t *stem_out = nullptr;
+  int stem_write_ptr = 0; // frames
+  int stem_write_end = 0;
+  uint8_t stem_bus[32];
+  int stem_accum[PCM_STEM_BUSES][2] = {};
+
+  // frames is the size of buffer in frames of PCM_STEM_BUSES * 2 samples;
+  // nullptr turns the stem output off
+  void PCM_SetStemBuffer(int32_t *buffer, int frames);
+
+  // shared with other instances, set by MCU::startSC55
+  const RomSet *roms = nullptr;
+  // this instance's copy of the bank table, so that banks loaded later can
+  // be switched in between two chunks; see PCM_SyncWaveBanks
+  WaveBank wave[WAVEROM_BANKS] = {};
+  unsigned wave_generation = ~0u;
 
   // CSpinLock pcm_lock;
 
@@ -83,24 +113,14 @@ struct Pcm {
   uint8_t PCM_Read(uint32_t address);
   void PCM_Reset(void);
   void PCM_Update(uint64_t cycles);
+  // picks up wave banks loaded since the last call
+  inline void PCM_SyncWaveBanks() {
+    if (roms)
+      roms->ROMSET_CopyWaveBanks(wave, &wave_generation);
+  }
 
   inline uint8_t PCM_ReadROM(const uint32_t address) {
-    int bank = (address >> 21) & 7;
-    switch (bank) {
-    case 0:
-      return waverom1[address & 0x1fffff];
-    case 1:
-      return waverom2[address & 0x1fffff];
-    case 2:
-      return waverom_card[address & 0x1fffff];
-    case 3:
-    case 4:
-    case 5:
-    case 6:
-      return waverom_exp[(address & 0x1fffff) + (bank - 3) * 0x200000];
-    default:
-      break;
-    }
-    return 0;
+    const WaveBank &bank = wave[(address >> 21) & 7];
+    return bank.data[address & bank.mask];
   }
 };
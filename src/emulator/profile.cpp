@@ -0,0 +1,211 @@
+//
+// profile.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "profile.h"
+#include <algorithm>
+#include <stdio.h>
+
+#ifndef __circle__
+#include <chrono>
+#endif
+
+static const char *const profile_stage_names[PROFILE_STAGES] = {
+    "interrupts", "execute",     "timers",     "uart",
+    "analog",     "pcm effects", "pcm voices", "audio write",
+};
+
+static const char *const profile_mode_names[profile_modes] = {
+    "direct", "indirect", "absolute", "immediate"};
+
+static const char *const profile_region_names[PROFILE_REGIONS] = {
+    "rom1",    "rom2", "ram",        "sram",   "nvram",
+    "cardram", "pcm",  "gate array", "device", "unmapped",
+};
+
+void Profile::PROFILE_Enable() {
+#if defined(__aarch64__) && defined(__circle__)
+  // PMCR_EL0: enable (E), reset the cycle counter (C), 64 bits (LC)
+  uint64_t pmcr;
+  asm volatile("mrs %0, pmcr_el0" : "=r"(pmcr));
+  pmcr |= (1 << 0) | (1 << 2) | (1 << 6);
+  asm volatile("msr pmcr_el0, %0" : : "r"(pmcr));
+  asm volatile("msr pmcntenset_el0, %0" : : "r"((uint64_t)1 << 31));
+#elif defined(__arm__) && defined(__circle__)
+  // PMCR: enable (E), reset the cycle counter (C); PMCNTENSET: C
+  uint32_t pmcr;
+  asm volatile("mrc p15, 0, %0, c9, c12, 0" : "=r"(pmcr));
+  pmcr |= (1 << 0) | (1 << 2);
+  asm volatile("mcr p15, 0, %0, c9, c12, 0" : : "r"(pmcr));
+  asm volatile("mcr p15, 0, %0, c9, c12, 1" : : "r"(1u << 31));
+#endif
+}
+
+profile_ticks_t Profile::PROFILE_NowGeneric() {
+#ifndef __circle__
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#else
+  return 0;
+#endif
+}
+
+void Profile::PROFILE_Chunk(uint32_t render_us, uint32_t deadline_us) {
+  int bin = 0;
+  if (render_us < deadline_us)
+    bin = 1 + (int)((uint64_t)(deadline_us - render_us) * 10 / deadline_us);
+  if (bin >= profile_slack_bins)
+    bin = profile_slack_bins - 1;
+  slack[bin]++;
+  chunks++;
+}
+
+void Profile::PROFILE_Diff(const Profile &now, const Profile &before) {
+  for (int i = 0; i < PROFILE_STAGES; i++)
+    ticks[i] = now.ticks[i] - before.ticks[i];
+  for (int i = 0; i < profile_slack_bins; i++)
+    slack[i] = now.slack[i] - before.slack[i];
+  chunks = now.chunks - before.chunks;
+}
+
+void Profile::PROFILE_Add(const Profile &other) {
+  for (int i = 0; i < PROFILE_STAGES; i++)
+    ticks[i] += other.ticks[i];
+  for (int i = 0; i < profile_slack_bins; i++)
+    slack[i] += other.slack[i];
+  chunks += other.chunks;
+}
+
+size_t Profile::PROFILE_Format(char *buffer, size_t size) const {
+  size_t length = 0;
+  auto print = [&](const char *format, auto... args) {
+    if (length < size)
+      length += snprintf(buffer + length, size - length, format, args...);
+  };
+
+  uint64_t total = 0;
+  for (int i = 0; i < PROFILE_STAGES; i++)
+    total += ticks[i];
+
+  print("%u chunks, %llu Mticks\n", chunks,
+        (unsigned long long)(total / 1000000));
+  for (int i = 0; i < PROFILE_STAGES; i++) {
+    unsigned permille = total ? (unsigned)(ticks[i] * 1000 / total) : 0;
+    print("%-12s %3u.%u%% %llu\n", profile_stage_names[i], permille / 10,
+          permille % 10, (unsigned long long)ticks[i]);
+  }
+
+  print("slack missed:%u", slack[0]);
+  for (int i = 1; i < profile_slack_bins; i++)
+    print(" %d%%:%u", (i - 1) * 10, slack[i]);
+  print("\n");
+
+  return length < size ? length : size - 1;
+}
+
+int OpcodeProfile::PROFILE_Region(uint32_t address, bool ram_enabled) {
+  uint32_t page = (address >> 16) & 0xf;
+  address &= 0xffff;
+  switch (page) {
+  case 0:
+    if (address < 0x8000)
+      return PROFILE_REGION_ROM1;
+    if (address >= 0xfb80 && address < 0xff80 && ram_enabled)
+      return PROFILE_REGION_RAM;
+    if (address < 0xe000)
+      return PROFILE_REGION_SRAM;
+    if (address >= 0xff80)
+      return PROFILE_REGION_DEVICE;
+    if (address >= 0xf000 && address < 0xf400)
+      return PROFILE_REGION_PCM;
+    if (address >= 0xf400 && address < 0xf800)
+      return PROFILE_REGION_GATE_ARRAY;
+    return PROFILE_REGION_UNMAPPED;
+  case 1:
+  case 2:
+  case 3:
+  case 4:
+    return PROFILE_REGION_ROM2;
+  case 10:
+  case 11:
+    return PROFILE_REGION_SRAM;
+  case 12:
+  case 13:
+    return PROFILE_REGION_NVRAM;
+  case 14:
+  case 15:
+    return PROFILE_REGION_CARDRAM;
+  default:
+    return PROFILE_REGION_UNMAPPED;
+  }
+}
+
+void OpcodeProfile::PROFILE_Add(const OpcodeProfile &other) {
+  instructions += other.instructions;
+  for (int i = 0; i < 256; i++)
+    operands[i] += other.operands[i];
+  for (int mode = 0; mode < profile_modes; mode++) {
+    for (int i = 0; i < 32; i++)
+      opcodes[mode][i] += other.opcodes[mode][i];
+  }
+  for (int i = 0; i < PROFILE_REGIONS; i++) {
+    reads[i] += other.reads[i];
+    writes[i] += other.writes[i];
+  }
+  if (!other.pcs.empty()) {
+    if (pcs.empty())
+      pcs.resize(other.pcs.size());
+    for (size_t i = 0; i < pcs.size(); i++)
+      pcs[i] += other.pcs[i];
+  }
+}
+
+bool OpcodeProfile::PROFILE_WriteCSV(FILE *file) const {
+  fprintf(file, "kind,mode,code,count\n");
+  fprintf(file, "instructions,,,%llu\n", (unsigned long long)instructions);
+  for (int i = 0; i < 256; i++) {
+    if (operands[i])
+      fprintf(file, "operand,,0x%02x,%llu\n", i,
+              (unsigned long long)operands[i]);
+  }
+  for (int mode = 0; mode < profile_modes; mode++) {
+    for (int i = 0; i < 32; i++) {
+      if (opcodes[mode][i])
+        fprintf(file, "opcode,%s,0x%02x,%llu\n", profile_mode_names[mode], i,
+                (unsigned long long)opcodes[mode][i]);
+    }
+  }
+  for (int i = 0; i < PROFILE_REGIONS; i++) {
+    if (reads[i])
+      fprintf(file, "read,%s,,%llu\n", profile_region_names[i],
+              (unsigned long long)reads[i]);
+    if (writes[i])
+      fprintf(file, "write,%s,,%llu\n", profile_region_names[i],
+              (unsigned long long)writes[i]);
+  }
+
+  std::vector<uint32_t> sampled;
+  for (uint32_t i = 0; i < pcs.size(); i++) {
+    if (pcs[i])
+      sampled.push_back(i);
+  }
+  std::sort(sampled.begin(), sampled.end(),
+            [this](uint32_t a, uint32_t b) { return pcs[a] > pcs[b]; });
+  for (uint32_t i : sampled)
+    fprintf(file, "pc,,%x:%04x,%u\n", i >> 16, i & 0xffff, pcs[i]);
+
+  return !ferror(file);
+}
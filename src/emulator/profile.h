@@ -0,0 +1,179 @@
+//
+// profile.h
+//
+// Cycle counters for the stages of the emulator loop and a histogram of
+// the deadline slack of the audio chunks, and statistics of the executed
+// firmware. The counting is built in with -DJV880_PROFILE and
+// -DJV880_PROFILE_OPCODES only; without them the PROFILE_* macros expand
+// to nothing and the counters stay zero.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+enum {
+  PROFILE_INTERRUPT = 0,
+  PROFILE_EXECUTE,
+  PROFILE_TIMER,
+  PROFILE_UART,
+  PROFILE_ANALOG, // A/D converter and encoder
+  PROFILE_PCM_EFFECTS, // mixing, reverb and chorus
+  PROFILE_PCM_VOICES,
+  PROFILE_AUDIO_WRITE, // resampling, conversion and the sound device
+  PROFILE_STAGES,
+};
+
+// chunks by the part of their deadline that was left: missed, then 10%
+// steps
+static const int profile_slack_bins = 11;
+
+// counts of the cycle counter, wrapping; 32 bits on 32-bit ARM
+typedef unsigned long profile_ticks_t;
+
+struct Profile {
+  uint64_t ticks[PROFILE_STAGES] = {0};
+  uint32_t slack[profile_slack_bins] = {0};
+  uint32_t chunks = 0;
+
+  // end of the last stage
+  profile_ticks_t last = 0;
+
+  // the cycle counter of the calling core; on Circle it has to be enabled
+  // on each core first
+  static void PROFILE_Enable();
+  static inline profile_ticks_t PROFILE_Now() {
+#if defined(__aarch64__) && defined(__circle__)
+    uint64_t ticks;
+    asm volatile("mrs %0, pmccntr_el0" : "=r"(ticks));
+    return ticks;
+#elif defined(__arm__) && defined(__circle__)
+    uint32_t ticks;
+    asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(ticks));
+    return ticks;
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#elif defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return PROFILE_NowGeneric();
+#endif
+  }
+
+  inline void PROFILE_Start() { last = PROFILE_Now(); }
+
+  // the time since the end of the last stage goes to stage
+  inline void PROFILE_Stage(int stage) {
+    profile_ticks_t now = PROFILE_Now();
+    ticks[stage] += (profile_ticks_t)(now - last);
+    last = now;
+  }
+
+  // one audio chunk that took render_us of the deadline_us it had
+  void PROFILE_Chunk(uint32_t render_us, uint32_t deadline_us);
+
+  // this = now - before, of the same profile read at two times
+  void PROFILE_Diff(const Profile &now, const Profile &before);
+  void PROFILE_Add(const Profile &other);
+
+  // a report of a few lines, each ending with '\n'
+  size_t PROFILE_Format(char *buffer, size_t size) const;
+
+private:
+  static profile_ticks_t PROFILE_NowGeneric();
+};
+
+#ifdef JV880_PROFILE
+#define PROFILE_START(p) (p).PROFILE_Start()
+#define PROFILE_STAGE(p, stage) (p).PROFILE_Stage(stage)
+#define PROFILE_CHUNK(p, render_us, deadline_us)                               \
+  (p).PROFILE_Chunk(render_us, deadline_us)
+#else
+#define PROFILE_START(p) ((void)0)
+#define PROFILE_STAGE(p, stage) ((void)0)
+#define PROFILE_CHUNK(p, render_us, deadline_us) ((void)0)
+#endif
+
+// Execution statistics of the firmware, to decide on decode caching and
+// fast paths: every operand byte and opcode by addressing mode, the memory
+// regions read and written, and the program counter sampled every
+// profile_pc_period instructions. Counting each instruction and access is
+// slow, so this has its own switch, -DJV880_PROFILE_OPCODES, meant for the
+// headless build (render -C).
+
+enum {
+  PROFILE_REGION_ROM1 = 0,
+  PROFILE_REGION_ROM2,
+  PROFILE_REGION_RAM, // on-chip
+  PROFILE_REGION_SRAM,
+  PROFILE_REGION_NVRAM,
+  PROFILE_REGION_CARDRAM,
+  PROFILE_REGION_PCM,
+  PROFILE_REGION_GATE_ARRAY, // LCD, key scan, interrupt lines
+  PROFILE_REGION_DEVICE, // on-chip registers
+  PROFILE_REGION_UNMAPPED,
+  PROFILE_REGIONS,
+};
+
+// the general operand types of mcu_opcodes.cpp
+static const int profile_modes = 4;
+static const uint32_t profile_pc_period = 64;
+
+struct OpcodeProfile {
+  uint64_t instructions = 0;
+  uint64_t operands[256] = {0};
+  uint64_t opcodes[profile_modes][32] = {{0}};
+  uint64_t reads[PROFILE_REGIONS] = {0};
+  uint64_t writes[PROFILE_REGIONS] = {0};
+  // samples by (cp << 16) | pc, allocated with the first
+  std::vector<uint32_t> pcs;
+
+  inline void PROFILE_Instruction(uint8_t cp, uint16_t pc, uint8_t operand) {
+    operands[operand]++;
+    if (instructions++ % profile_pc_period != 0)
+      return;
+    if (pcs.empty())
+      pcs.resize(1 << 20);
+    pcs[((cp & 0xf) << 16) | pc]++;
+  }
+
+  // the region MCU_Read and MCU_Write decode address to
+  static int PROFILE_Region(uint32_t address, bool ram_enabled);
+
+  void PROFILE_Add(const OpcodeProfile &other);
+
+  // kind,mode,code,count; pc samples sorted by count
+  bool PROFILE_WriteCSV(FILE *file) const;
+};
+
+#ifdef JV880_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION(p, cp, pc, operand)                                \
+  (p).PROFILE_Instruction(cp, pc, operand)
+#define PROFILE_OPCODE(p, mode, opcode) ((p).opcodes[mode][opcode]++)
+#define PROFILE_READ(p, address, ram_enabled)                                  \
+  ((p).reads[OpcodeProfile::PROFILE_Region(address, ram_enabled)]++)
+#define PROFILE_WRITE(p, address, ram_enabled)                                 \
+  ((p).writes[OpcodeProfile::PROFILE_Region(address, ram_enabled)]++)
+#else
+#define PROFILE_INSTRUCTION(p, cp, pc, operand) ((void)0)
+#define PROFILE_OPCODE(p, mode, opcode) ((void)0)
+#define PROFILE_READ(p, address, ram_enabled) ((void)0)
+#define PROFILE_WRITE(p, address, ram_enabled) ((void)0)
+#endif
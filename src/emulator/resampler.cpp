@@ -0,0 +1,210 @@
+//
+// resampler.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "resampler.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLER_NEON 1
+#endif
+
+// more phases than this would make the coefficient table unreasonably
+// large; such ratios (e.g. between two odd rates) are not supported
+static const int max_phases = 4096;
+
+static const struct {
+  int taps;
+  double beta; // Kaiser window
+  double passband; // fraction of the lower Nyquist frequency kept flat
+} quality_table[] = {
+    {8, 5.0, 0.80},
+    {16, 7.0, 0.90},
+    {32, 9.0, 0.95},
+};
+
+static int RESAMPLER_Gcd(int a, int b) {
+  while (b) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// zeroth order modified Bessel function of the first kind
+static double RESAMPLER_I0(double x) {
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 32; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+bool Resampler::RESAMPLER_Init(int in_rate, int out_rate, int quality,
+                               int max_in) {
+  int g = RESAMPLER_Gcd(in_rate, out_rate);
+  up = out_rate / g;
+  down = in_rate / g;
+  if (up > max_phases) {
+    up = down = 1;
+    return false;
+  }
+
+  if (quality < RESAMPLER_QUALITY_LOW)
+    quality = RESAMPLER_QUALITY_LOW;
+  if (quality > RESAMPLER_QUALITY_HIGH)
+    quality = RESAMPLER_QUALITY_HIGH;
+  taps = quality_table[quality].taps;
+  max_in_frames = max_in;
+
+  // cutoff relative to the input rate: below the output Nyquist frequency
+  // when decimating
+  double cutoff = quality_table[quality].passband;
+  if (up < down)
+    cutoff *= (double)up / down;
+
+  const double beta = quality_table[quality].beta;
+  const double half = taps / 2.0;
+  coefs.resize((size_t)up * taps);
+  for (int p = 0; p < up; p++) {
+    float *h = &coefs[(size_t)p * taps];
+    double sum = 0;
+    for (int k = 0; k < taps; k++) {
+      // distance of tap k from the output position, in input frames
+      double d = k - (half - 1) - (double)p / up;
+      double x = M_PI * cutoff * d;
+      double sinc = x == 0 ? 1.0 : sin(x) / x;
+      double r = d / half;
+      double w = r * r < 1 ? RESAMPLER_I0(beta * sqrt(1 - r * r)) : 0;
+      double v = sinc * w;
+      h[k] = (float)v;
+      sum += v;
+    }
+    // unity gain at DC for every phase
+    for (int k = 0; k < taps; k++)
+      h[k] = (float)(h[k] / sum);
+  }
+
+  hist_l.assign(taps + 2 * max_in_frames, 0.0f);
+  hist_r.assign(taps + 2 * max_in_frames, 0.0f);
+  RESAMPLER_Reset();
+  return true;
+}
+
+void Resampler::RESAMPLER_Reset() {
+  // pad with half a window of silence so that output frame 0 is centred
+  // on input frame 0
+  std::fill(hist_l.begin(), hist_l.end(), 0.0f);
+  std::fill(hist_r.begin(), hist_r.end(), 0.0f);
+  hist_count = taps > 0 ? taps / 2 - 1 : 0;
+  pos = 0;
+  phase = 0;
+}
+
+static inline int32_t RESAMPLER_Saturate(float v) {
+  // the largest float below 2^31
+  if (v >= 2147483520.0f)
+    return 2147483520;
+  if (v <= -2147483648.0f)
+    return INT32_MIN;
+  return (int32_t)lrintf(v);
+}
+
+#ifdef RESAMPLER_NEON
+static inline float RESAMPLER_Sum(float32x4_t v) {
+#ifdef __aarch64__
+  return vaddvq_f32(v);
+#else
+  float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+  return vget_lane_f32(vpadd_f32(s, s), 0);
+#endif
+}
+#endif
+
+// taps is a multiple of 8
+static inline void RESAMPLER_Dot(const float *h, const float *l,
+                                 const float *r, int taps, float *out_l,
+                                 float *out_r) {
+#ifdef RESAMPLER_NEON
+  float32x4_t acc_l0 = vdupq_n_f32(0), acc_l1 = vdupq_n_f32(0);
+  float32x4_t acc_r0 = vdupq_n_f32(0), acc_r1 = vdupq_n_f32(0);
+  for (int k = 0; k < taps; k += 8) {
+    float32x4_t h0 = vld1q_f32(h + k), h1 = vld1q_f32(h + k + 4);
+    acc_l0 = vmlaq_f32(acc_l0, h0, vld1q_f32(l + k));
+    acc_l1 = vmlaq_f32(acc_l1, h1, vld1q_f32(l + k + 4));
+    acc_r0 = vmlaq_f32(acc_r0, h0, vld1q_f32(r + k));
+    acc_r1 = vmlaq_f32(acc_r1, h1, vld1q_f32(r + k + 4));
+  }
+  *out_l = RESAMPLER_Sum(vaddq_f32(acc_l0, acc_l1));
+  *out_r = RESAMPLER_Sum(vaddq_f32(acc_r0, acc_r1));
+#else
+  float sum_l = 0, sum_r = 0;
+  for (int k = 0; k < taps; k++) {
+    sum_l += h[k] * l[k];
+    sum_r += h[k] * r[k];
+  }
+  *out_l = sum_l;
+  *out_r = sum_r;
+#endif
+}
+
+int Resampler::RESAMPLER_Process(const int32_t *in, int in_frames,
+                                 int32_t *out, int max_out_frames) {
+  if (RESAMPLER_IsBypass()) {
+    int n = in_frames < max_out_frames ? in_frames : max_out_frames;
+    memcpy(out, in, n * 2 * sizeof(int32_t));
+    return n;
+  }
+
+  int space = (int)hist_l.size() - hist_count;
+  if (in_frames > space)
+    in_frames = space; // only if the caller keeps the output short
+  float *l = &hist_l[hist_count];
+  float *r = &hist_r[hist_count];
+  for (int i = 0; i < in_frames; i++) {
+    l[i] = (float)in[2 * i];
+    r[i] = (float)in[2 * i + 1];
+  }
+  hist_count += in_frames;
+
+  int n = 0;
+  while (n < max_out_frames && pos + taps <= hist_count) {
+    float out_l, out_r;
+    RESAMPLER_Dot(&coefs[(size_t)phase * taps], &hist_l[pos], &hist_r[pos],
+                  taps, &out_l, &out_r);
+    out[2 * n] = RESAMPLER_Saturate(out_l);
+    out[2 * n + 1] = RESAMPLER_Saturate(out_r);
+    n++;
+
+    phase += down;
+    pos += phase / up;
+    phase %= up;
+  }
+
+  // drop the consumed input
+  int consumed = pos < hist_count ? pos : hist_count;
+  int keep = hist_count - consumed;
+  memmove(&hist_l[0], &hist_l[consumed], keep * sizeof(float));
+  memmove(&hist_r[0], &hist_r[consumed], keep * sizeof(float));
+  hist_count = keep;
+  pos -= consumed;
+
+  return n;
+}
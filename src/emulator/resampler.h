@@ -0,0 +1,66 @@
+//
+// resampler.h
+//
+// Polyphase windowed-sinc sample rate converter from the PCM's native
+// 32 kHz to the rate of the output device.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+enum {
+  RESAMPLER_QUALITY_LOW = 0, // 8 taps
+  RESAMPLER_QUALITY_MEDIUM,  // 16 taps
+  RESAMPLER_QUALITY_HIGH,    // 32 taps
+};
+
+// Stereo, interleaved full scale int32_t in and out (float inside).
+// out_rate / in_rate is reduced to up / down and one filter phase is kept
+// per output position, so the conversion is exact for rational ratios
+// like 32000 -> 44100 (441/320).
+struct Resampler {
+  int up = 1;
+  int down = 1;
+  int taps = 0;
+  int max_in_frames = 0;
+  std::vector<float> coefs; // up phases of taps coefficients
+
+  // input history, one array per channel so the kernels can use
+  // contiguous loads
+  std::vector<float> hist_l;
+  std::vector<float> hist_r;
+  int hist_count = 0;
+  int pos = 0;   // first history frame of the next output's window
+  int phase = 0; // fractional position of the next output, in 1/up
+
+  // max_in_frames bounds the frames passed to a single RESAMPLER_Process
+  bool RESAMPLER_Init(int in_rate, int out_rate, int quality,
+                      int max_in_frames);
+  void RESAMPLER_Reset();
+
+  inline bool RESAMPLER_IsBypass() const { return up == down; }
+
+  // input frames needed to produce about out_frames
+  inline int RESAMPLER_InputFrames(int out_frames) const {
+    return (int)(((int64_t)out_frames * down + up - 1) / up);
+  }
+
+  // Returns the number of frames written to out. Frames that do not fit
+  // into max_out_frames stay in the history for the next call.
+  int RESAMPLER_Process(const int32_t *in, int in_frames, int32_t *out,
+                        int max_out_frames);
+};
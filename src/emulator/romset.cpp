@@ -0,0 +1,146 @@
+//
+// romset.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "romset.h"
+#include <new>
+#include <string.h>
+
+static const uint8_t wave_zero[1] = {0};
+
+RomSet *RomSet::ROMSET_Create(const uint8_t *s_rom1, const uint8_t *s_rom2,
+                              const uint8_t *s_waverom1,
+                              const uint8_t *s_waverom2) {
+  RomSet *set = new (std::nothrow) RomSet;
+  if (!set)
+    return nullptr;
+
+  set->wave_storage = new (std::nothrow) uint8_t[2 * WAVEROM_SIZE];
+  if (!set->wave_storage) {
+    delete set;
+    return nullptr;
+  }
+
+  memcpy(set->rom1, s_rom1, ROM1_SIZE);
+  memcpy(set->rom2, s_rom2, ROM2_SIZE);
+
+  // Disable intro
+  set->rom2[0x318f7] = 0x19;
+
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < ROM1_SIZE; i++)
+    hash = (hash ^ set->rom1[i]) * 16777619u;
+  for (int i = 0; i < ROM2_SIZE; i++)
+    hash = (hash ^ set->rom2[i]) * 16777619u;
+  set->rom_checksum = hash;
+
+  for (int i = 0; i < WAVEROM_BANKS; i++)
+    set->wave[i] = {wave_zero, 0};
+
+  unscramble(s_waverom1, set->wave_storage, WAVEROM_SIZE);
+  unscramble(s_waverom2, set->wave_storage + WAVEROM_SIZE, WAVEROM_SIZE);
+  set->ROMSET_PublishBanks(WAVEROM_BANK_INTERNAL1, 2, set->wave_storage);
+
+  return set;
+}
+
+RomSet::~RomSet() {
+  delete[] wave_storage;
+  delete[] card_storage;
+  delete[] exp_storage;
+}
+
+bool RomSet::ROMSET_LoadCard(const uint8_t *image) {
+  if (card_storage)
+    return false;
+  card_storage = new (std::nothrow) uint8_t[WAVEROM_SIZE];
+  if (!card_storage)
+    return false;
+
+  unscramble(image, card_storage, WAVEROM_SIZE);
+  ROMSET_PublishBanks(WAVEROM_BANK_CARD, 1, card_storage);
+
+  return true;
+}
+
+bool RomSet::ROMSET_LoadExpansion(const uint8_t *image) {
+  if (exp_storage)
+    return false;
+  exp_storage = new (std::nothrow) uint8_t[WAVEROM_EXP_SIZE];
+  if (!exp_storage)
+    return false;
+
+  unscramble(image, exp_storage, WAVEROM_EXP_SIZE);
+  ROMSET_PublishBanks(WAVEROM_BANK_EXP, WAVEROM_EXP_SIZE / WAVEROM_SIZE,
+                      exp_storage);
+
+  return true;
+}
+
+// The table is published like a seqlock: readers copy it and check that
+// the generation was even and did not change meanwhile.
+void RomSet::ROMSET_PublishBanks(int first, int count, const uint8_t *data) {
+  wave_generation.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (int i = 0; i < count; i++)
+    wave[first + i] = {data + i * WAVEROM_SIZE, WAVEROM_SIZE - 1};
+
+  wave_generation.fetch_add(1, std::memory_order_release);
+}
+
+bool RomSet::ROMSET_CopyWaveBanks(WaveBank *banks,
+                                  unsigned *generation) const {
+  unsigned before = wave_generation.load(std::memory_order_acquire);
+  if (before == *generation || (before & 1))
+    return false;
+
+  for (int i = 0; i < WAVEROM_BANKS; i++)
+    banks[i] = wave[i];
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (wave_generation.load(std::memory_order_relaxed) != before)
+    return false;
+
+  *generation = before;
+  return true;
+}
+
+void RomSet::ROMSET_Release() {
+  // the images are only read, so the last owner just needs to see the
+  // other owners' decrements
+  if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    delete this;
+}
+
+void unscramble(const uint8_t *src, uint8_t *dst, const int len) {
+  for (int i = 0; i < len; i++) {
+    int address = i & ~0xfffff;
+    static const int aa[] = {2, 0,  3,  4,  1, 9, 13, 10, 18, 17,
+                             6, 15, 11, 16, 8, 5, 12, 7,  14, 19};
+    for (int j = 0; j < 20; j++) {
+      if (i & (1 << j))
+        address |= 1 << aa[j];
+    }
+    uint8_t srcdata = src[address];
+    uint8_t data = 0;
+    static const int dd[] = {2, 0, 4, 5, 7, 6, 3, 1};
+    for (int j = 0; j < 8; j++) {
+      if (srcdata & (1 << dd[j]))
+        data |= 1 << j;
+    }
+    dst[i] = data;
+  }
+}
@@ -0,0 +1,91 @@
+//
+// romset.h
+//
+// The read-only images an emulated JV-880 runs from: program ROMs and the
+// (unscrambled) wave ROMs. A RomSet never changes after ROMSET_Create, so
+// any number of MCU instances, on any cores, can share one.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+static const int ROM1_SIZE = 0x8000;
+static const int ROM2_SIZE = 0x40000;
+
+// The PCM addresses wave data in eight banks of 2 MiB (address bits 21-23)
+static const int WAVEROM_SIZE = 0x200000;
+static const int WAVEROM_EXP_SIZE = 0x800000; // SR-JV80 board, banks 3-6
+static const int WAVEROM_BANKS = 8;
+
+enum {
+  WAVEROM_BANK_INTERNAL1 = 0,
+  WAVEROM_BANK_INTERNAL2,
+  WAVEROM_BANK_CARD,
+  WAVEROM_BANK_EXP,
+};
+
+// data[address & mask]; banks without an image read a shared zero byte
+// with mask 0, so they take no memory
+struct WaveBank {
+  const uint8_t *data;
+  uint32_t mask;
+};
+
+struct RomSet {
+  uint8_t rom1[ROM1_SIZE];
+  uint8_t rom2[ROM2_SIZE]; // patched, see ROMSET_Create
+  uint32_t rom_checksum;   // FNV-1a of rom1 and rom2, tells firmwares apart
+
+  // Loads the images as dumped from the chips; the wave ROMs are
+  // unscrambled here once instead of per instance, into one allocation
+  // owned by the set. Returns nullptr if out of memory. The caller holds
+  // the first reference.
+  static RomSet *ROMSET_Create(const uint8_t *s_rom1, const uint8_t *s_rom2,
+                               const uint8_t *s_waverom1,
+                               const uint8_t *s_waverom2);
+
+  // Unscramble a PCM card (WAVEROM_SIZE) or SR-JV80 expansion board
+  // (WAVEROM_EXP_SIZE) image into the set and enable its banks. This takes
+  // a while, so it may run on another thread while the instances render;
+  // they pick the banks up at their next chunk. Only one thread may load
+  // at a time, and each bank is loaded once.
+  bool ROMSET_LoadCard(const uint8_t *image);
+  bool ROMSET_LoadExpansion(const uint8_t *image);
+
+  // Copies the bank table if it changed since *generation and updates
+  // that. Fails while a load is publishing its banks; try again later.
+  bool ROMSET_CopyWaveBanks(WaveBank *banks, unsigned *generation) const;
+
+  void ROMSET_Retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+  // deletes the set with the last reference
+  void ROMSET_Release();
+
+private:
+  RomSet() = default;
+  ~RomSet();
+  void ROMSET_PublishBanks(int first, int count, const uint8_t *data);
+
+  std::atomic<int> refs{1};
+  // odd while ROMSET_PublishBanks writes wave
+  std::atomic<unsigned> wave_generation{0};
+  WaveBank wave[WAVEROM_BANKS];
+  uint8_t *wave_storage = nullptr;
+  uint8_t *card_storage = nullptr;
+  uint8_t *exp_storage = nullptr;
+};
+
+void unscramble(const uint8_t *src, uint8_t *dst, const int len);
@@ -0,0 +1,184 @@
+//
+// snapshot.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "snapshot.h"
+#include "mcu.h"
+#include <string.h>
+
+static const char snapshot_magic[8] = {'J', 'V', '8', '8', '0', 'S', 'S', 0};
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t size; // of the whole snapshot, catches layout differences
+  uint32_t rom_checksum; // the wave ROMs are not checked
+  uint32_t reserved;
+  uint64_t nvram_hash;
+  uint64_t card_hash;
+  uint64_t expansion_hash;
+};
+
+uint64_t SNAPSHOT_Hash(const void *data, size_t size, uint64_t hash) {
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 0x100000001b3ull;
+  return hash;
+}
+
+// The state, in file order. Buffers of the host (sample and stem output,
+// the rendered LCD bitmap, staged MIDI OUT) and host settings such as
+// pcm.oversampling are left out.
+template <typename F> static void SNAPSHOT_Fields(MCU &m, F &&field) {
+  field(m.mcu);
+  field(m.ram);
+  field(m.sram);
+  field(m.nvram);
+  field(m.cardram);
+  field(m.rom2_mask);
+
+  field(m.ga_int);
+  field(m.ga_int_enable);
+  field(m.ga_int_trigger);
+  field(m.ga_lcd_counter);
+  field(m.dev_register);
+  field(m.io_sd);
+  field(m.adf_rd);
+  field(m.analog_end_time);
+  field(m.ssr_rd);
+
+  field(m.midi_ready);
+  field(m.uart_write_ptr);
+  field(m.uart_read_ptr);
+  field(m.uart_buffer);
+  field(m.uart_rx_byte);
+  field(m.uart_rx_delay);
+  field(m.uart_tx_delay);
+
+  field(m.operand_type);
+  field(m.operand_ea);
+  field(m.operand_ep);
+  field(m.operand_size);
+  field(m.operand_reg);
+  field(m.operand_status);
+  field(m.operand_data);
+  field(m.opcode_extended);
+
+  field(m.timer_tempreg);
+  field(m.timer8_enabled);
+  field(m.timer8_cmiea);
+  field(m.timer8_cmfa);
+  field(m.timer8_cmfa_read);
+  field(m.timer8_tcora);
+  field(m.timer8_tcnt);
+  field(m.timer0_ocra);
+  field(m.timer1_ocra);
+  field(m.timer2_ocra);
+  field(m.timer0_frc);
+  field(m.timer1_frc);
+  field(m.timer2_frc);
+  field(m.timer0_ocfa);
+  field(m.timer1_ocfa);
+  field(m.timer2_ocfa);
+  field(m.timer0_ocfa_read);
+  field(m.timer1_ocfa_read);
+  field(m.timer2_ocfa_read);
+  field(m.timer0_ociea);
+  field(m.timer1_ociea);
+  field(m.timer2_ociea);
+
+  field(m.pcm.pcm); // includes the effect RAM
+
+  field(m.lcd.LCD_DL);
+  field(m.lcd.LCD_N);
+  field(m.lcd.LCD_F);
+  field(m.lcd.LCD_D);
+  field(m.lcd.LCD_C);
+  field(m.lcd.LCD_B);
+  field(m.lcd.LCD_ID);
+  field(m.lcd.LCD_S);
+  field(m.lcd.LCD_DD_RAM);
+  field(m.lcd.LCD_AC);
+  field(m.lcd.LCD_CG_RAM);
+  field(m.lcd.LCD_RAM_MODE);
+  field(m.lcd.LCD_Data);
+  field(m.lcd.LCD_CG);
+  field(m.lcd.lcd_enable);
+}
+
+size_t SNAPSHOT_Size(const MCU *mcu) {
+  size_t total = sizeof(SnapshotHeader);
+  SNAPSHOT_Fields(const_cast<MCU &>(*mcu),
+                  [&](auto &value) { total += sizeof(value); });
+  return total;
+}
+
+size_t SNAPSHOT_Save(const MCU *mcu, const SnapshotImages &images,
+                     uint8_t *buffer, size_t size) {
+  const size_t total = SNAPSHOT_Size(mcu);
+  if (size < total)
+    return 0;
+
+  SnapshotHeader header;
+  memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.size = (uint32_t)total;
+  header.rom_checksum = mcu->romset->rom_checksum;
+  header.reserved = 0;
+  header.nvram_hash = images.nvram;
+  header.card_hash = images.card;
+  header.expansion_hash = images.expansion;
+  memcpy(buffer, &header, sizeof(header));
+
+  uint8_t *p = buffer + sizeof(header);
+  SNAPSHOT_Fields(const_cast<MCU &>(*mcu), [&](auto &value) {
+    memcpy(p, &value, sizeof(value));
+    p += sizeof(value);
+  });
+
+  return total;
+}
+
+bool SNAPSHOT_Load(MCU *mcu, const SnapshotImages &images,
+                   const uint8_t *data, size_t size) {
+  const size_t total = SNAPSHOT_Size(mcu);
+  if (size < total)
+    return false;
+
+  SnapshotHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION || header.size != total ||
+      header.rom_checksum != mcu->romset->rom_checksum ||
+      header.nvram_hash != images.nvram || header.card_hash != images.card ||
+      header.expansion_hash != images.expansion)
+    return false;
+
+  const uint8_t *p = data + sizeof(header);
+  SNAPSHOT_Fields(*mcu, [&](auto &value) {
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+  });
+
+  // nothing of the old run may leak into the restored one
+  mcu->uart_tx_count = 0;
+  mcu->sample_write_ptr = 0;
+  // the RAMs differ from whatever was persisted
+  memset(mcu->dirty_pages, 0xff, sizeof(mcu->dirty_pages));
+  // and the display from what is shown
+  mcu->lcd.LCD_Invalidate();
+
+  return true;
+}
@@ -0,0 +1,62 @@
+//
+// snapshot.h
+//
+// Save states: everything an MCU instance changes while it runs (CPU,
+// RAMs, peripherals, the PCM with its effect RAM and the LCD controller),
+// but not the ROMs and images, which are only identified by hashes. A snapshot
+// is a flat copy, so saving and restoring take well under a millisecond,
+// and restoring one right after startSC55 skips the firmware's boot.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct MCU;
+
+// Bump with every change to the saved fields or their types. Snapshots
+// are only read back by builds for the same architecture.
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+// What the firmware saw at boot besides rom1 and rom2, which the snapshot
+// checks by itself: hashes of the NVRAM image startSC55 was given and of
+// the card and expansion wave ROMs, 0 for none. How an image is hashed is
+// up to the caller, as long as it does so the same way every time.
+struct SnapshotImages {
+  uint64_t nvram = 0;
+  uint64_t card = 0;
+  uint64_t expansion = 0;
+};
+
+// 64-bit FNV-1a, continues from hash to hash a file in pieces
+static const uint64_t SNAPSHOT_HASH_START = 0xcbf29ce484222325ull;
+uint64_t SNAPSHOT_Hash(const void *data, size_t size,
+                       uint64_t hash = SNAPSHOT_HASH_START);
+
+// size of a snapshot in bytes, the same for every instance
+size_t SNAPSHOT_Size(const MCU *mcu);
+
+// Must not run concurrently with the instance. Returns the number of
+// bytes written, or 0 if size is too small.
+size_t SNAPSHOT_Save(const MCU *mcu, const SnapshotImages &images,
+                     uint8_t *buffer, size_t size);
+
+// The instance must have been started with startSC55, with the same ROMs
+// the snapshot was taken with. Returns false, leaving the instance alone,
+// if data is not a snapshot of this version and layout or if the ROMs or
+// images differ.
+bool SNAPSHOT_Load(MCU *mcu, const SnapshotImages &images,
+                   const uint8_t *data, size_t size);
@@ -1 +1,9 @@
+if [ "$(uname)" = "Darwin" ]; then
 gcc standalone.cpp ../*.cpp -I /opt/homebrew/include/SDL2/ --std=c++2a -F/Library/Frameworks -framework SDL2 -g -O3 -lstdc++
+gcc render.cpp ../*.cpp --std=c++2a -g -O3 -lstdc++ -o render
+gcc golden.cpp ../*.cpp --std=c++2a -g -O3 -lstdc++ -o golden
+else
+g++ standalone.cpp ../*.cpp $(sdl2-config --cflags --libs) --std=c++2a -g -O3
+g++ render.cpp ../*.cpp --std=c++2a -g -O3 -pthread -o render
+g++ golden.cpp ../*.cpp --std=c++2a -g -O3 -pthread -o golden
+fi
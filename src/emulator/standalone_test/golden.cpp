@@ -0,0 +1,525 @@
+//
+// golden.cpp
+//
+// Golden audio regression check: boots the firmware headless, plays a fixed
+// set of scripted MIDI cases and compares the rendered PCM bit for bit with
+// the hashes recorded before, so that optimizations of PCM_Update, calc_tv
+// or the interpreter can be verified not to change the output.
+//
+//   golden [-o] [-r romdir] [-R dumpdir] golden.txt
+//   golden [-o] [-r romdir] [-b boot.snap] [-R dumpdir] -w golden.txt
+//   golden -D dumpdirA dumpdirB
+//   golden -l
+//
+// -w records the hashes of all cases to golden.txt, without it they are
+// compared to it. The mix and the reverb and chorus returns are hashed
+// separately. -R also writes each of them as raw interleaved 32-bit
+// samples, <case>.<bus>.raw; -D compares such dumps of two builds (scalar
+// against SIMD, interpreter against block cache) sample by sample and shows
+// where they start to differ. The ROMs are not part of the repository, so
+// neither is a golden.txt: record it with the build before the change.
+// -b keeps the booted state in a file for recording again; a check always
+// boots, so that the boot of the build under test is part of it.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "headless.h"
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static const double preroll = 2.0; // seconds for the firmware to boot
+
+// -------------------------------------------------------------------------
+// Cases
+
+struct GoldenCase {
+  const char *name;
+  double length; // seconds rendered, the events have to end before
+  std::vector<MidiEvent> events;
+};
+
+static void Note(std::vector<MidiEvent> &ev, double on, double off, int ch,
+                 int key, int velocity) {
+  ev.push_back({on, {(uint8_t)(0x90 | ch), (uint8_t)key, (uint8_t)velocity}});
+  ev.push_back({off, {(uint8_t)(0x80 | ch), (uint8_t)key, 0x40}});
+}
+
+static void Control(std::vector<MidiEvent> &ev, double t, int ch, int cc,
+                    int value) {
+  ev.push_back({t, {(uint8_t)(0xb0 | ch), (uint8_t)cc, (uint8_t)value}});
+}
+
+// a Roland DT1 (data set) to the JV-880, device ID 17
+static void DataSet(std::vector<MidiEvent> &ev, double t,
+                    const uint8_t address[4],
+                    const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> msg = {0xf0, 0x41, 0x10, 0x46, 0x12};
+  int sum = 0;
+  for (int i = 0; i < 4; i++) {
+    msg.push_back(address[i]);
+    sum += address[i];
+  }
+  for (uint8_t b : data) {
+    msg.push_back(b);
+    sum += b;
+  }
+  msg.push_back((128 - (sum & 0x7f)) & 0x7f);
+  msg.push_back(0xf7);
+  ev.push_back({t, msg});
+}
+
+// Note () adds the note off right away
+static void SortEvents(std::vector<MidiEvent> &ev) {
+  std::stable_sort(ev.begin(), ev.end(),
+                   [](const MidiEvent &a, const MidiEvent &b) {
+                     return a.seconds < b.seconds;
+                   });
+}
+
+// The cases only depend on the ROMs; changing one invalidates its hashes.
+// Events are kept sorted by time.
+static std::vector<GoldenCase> GoldenCases() {
+  std::vector<GoldenCase> cases;
+
+  { // single notes and a chord across the keyboard and velocities
+    GoldenCase c = {"notes", 4.0, {}};
+    Note(c.events, 0.0, 0.4, 0, 60, 100);
+    Note(c.events, 0.5, 0.7, 0, 36, 30);
+    Note(c.events, 0.8, 1.0, 0, 96, 127);
+    Note(c.events, 1.2, 2.5, 0, 48, 64);
+    Note(c.events, 1.2, 2.5, 0, 55, 80);
+    Note(c.events, 1.2, 2.5, 0, 64, 96);
+    SortEvents(c.events);
+    cases.push_back(c);
+  }
+
+  { // program changes between notes, sparse over the internal patches
+    GoldenCase c = {"programs", 8.0, {}};
+    const int programs[] = {0, 9, 23, 38, 51, 63};
+    double t = 0;
+    for (int program : programs) {
+      c.events.push_back({t, {0xc0, (uint8_t)program}});
+      Note(c.events, t + 0.1, t + 0.8, 0, 60, 100);
+      t += 1.2;
+    }
+    cases.push_back(c);
+  }
+
+  { // an identity request, then the temporary patch name set by DT1 while
+    // a note sounds
+    GoldenCase c = {"sysex", 3.0, {}};
+    c.events.push_back({0.0, {0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7}});
+    Note(c.events, 0.1, 1.5, 0, 62, 100);
+    const uint8_t patch_name[4] = {0x00, 0x08, 0x20, 0x00};
+    DataSet(c.events, 0.5, patch_name,
+            {'G', 'o', 'l', 'd', 'e', 'n', ' ', ' ', ' ', ' ', ' ', ' '});
+    SortEvents(c.events);
+    cases.push_back(c);
+  }
+
+  { // pitch bend, modulation, volume, pan and sustain
+    GoldenCase c = {"controllers", 5.0, {}};
+    c.events.push_back({0.0, {0x90, 60, 100}});
+    for (int i = 0; i <= 16; i++) {
+      int bend = i * 16383 / 16;
+      c.events.push_back(
+          {0.1 + i * 0.05, {0xe0, (uint8_t)(bend & 0x7f), (uint8_t)(bend >> 7)}});
+    }
+    c.events.push_back({1.0, {0xe0, 0x00, 0x40}});
+    for (int i = 0; i <= 8; i++)
+      Control(c.events, 1.1 + i * 0.05, 0, 1, i * 127 / 8);
+    Control(c.events, 1.6, 0, 1, 0);
+    Control(c.events, 1.7, 0, 7, 60);
+    Control(c.events, 1.8, 0, 10, 0);
+    Control(c.events, 1.9, 0, 10, 127);
+    c.events.push_back({2.0, {0x80, 60, 0x40}});
+    Control(c.events, 2.1, 0, 64, 127);
+    Note(c.events, 2.2, 2.4, 0, 64, 100);
+    Note(c.events, 2.5, 2.7, 0, 67, 100);
+    Control(c.events, 3.5, 0, 64, 0);
+    Control(c.events, 3.6, 0, 7, 100);
+    Control(c.events, 3.6, 0, 10, 64);
+    cases.push_back(c);
+  }
+
+  { // full reverb and chorus sends, short notes to leave the tails alone
+    GoldenCase c = {"effects", 6.0, {}};
+    Control(c.events, 0.0, 0, 91, 127);
+    Control(c.events, 0.0, 0, 93, 127);
+    const int keys[] = {48, 55, 60, 67, 72, 79};
+    for (int i = 0; i < 6; i++)
+      Note(c.events, 0.1 + i * 0.25, 0.2 + i * 0.25, 0, keys[i], 110);
+    SortEvents(c.events);
+    Control(c.events, 5.0, 0, 91, 40);
+    Control(c.events, 5.0, 0, 93, 0);
+    cases.push_back(c);
+  }
+
+  { // more keys than voices, so that voices are stolen
+    GoldenCase c = {"polyphony", 4.0, {}};
+    for (int i = 0; i < 40; i++)
+      c.events.push_back({i * 0.02, {0x90, (uint8_t)(36 + i), 90}});
+    for (int i = 0; i < 40; i++)
+      c.events.push_back({2.0 + i * 0.01, {0x80, (uint8_t)(36 + i), 0x40}});
+    cases.push_back(c);
+  }
+
+  return cases;
+}
+
+// -------------------------------------------------------------------------
+// Rendering
+
+enum {
+  GOLDEN_MIX = 0,
+  GOLDEN_REVERB,
+  GOLDEN_CHORUS,
+  GOLDEN_BUSES,
+};
+
+static const char *const golden_bus_names[GOLDEN_BUSES] = {"mix", "reverb",
+                                                           "chorus"};
+
+// over the samples as little endian 32-bit words
+static void HashSamples(Fnv1a &hash, const int32_t *samples, int count) {
+  for (int i = 0; i < count; i++) {
+    uint32_t v = (uint32_t)samples[i];
+    const uint8_t bytes[4] = {(uint8_t)v, (uint8_t)(v >> 8),
+                              (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+    hash.FNV_Add(bytes, 4);
+  }
+}
+
+struct GoldenResult {
+  uint64_t frames = 0;
+  uint64_t hash[GOLDEN_BUSES] = {0};
+};
+
+static std::string DumpPath(const std::string &dir, const char *name,
+                            int bus) {
+  return dir + "/" + name + "." + golden_bus_names[bus] + ".raw";
+}
+
+// Every case starts from the state after the preroll, so that the cases
+// do not depend on each other
+static bool RenderCase(const Roms &roms, bool oversampling,
+                       const GoldenCase &c, const std::string &dumpdir,
+                       GoldenResult &result) {
+  MCU *mcu = new MCU();
+  mcu->startSC55(roms.set, &roms.nvram[0]);
+  mcu->pcm.oversampling = oversampling;
+  if (!SNAPSHOT_Load(mcu, roms.images, &roms.snapshot[0],
+                     roms.snapshot.size())) {
+    fprintf(stderr, "%s: snapshot does not match\n", c.name);
+    delete mcu;
+    return false;
+  }
+
+  FILE *dump[GOLDEN_BUSES] = {nullptr};
+  bool ok = true;
+  if (!dumpdir.empty()) {
+    for (int bus = 0; bus < GOLDEN_BUSES; bus++) {
+      std::string path = DumpPath(dumpdir, c.name, bus);
+      dump[bus] = fopen(path.c_str(), "wb");
+      if (!dump[bus]) {
+        fprintf(stderr, "Cannot create %s\n", path.c_str());
+        ok = false;
+      }
+    }
+  }
+
+  Fnv1a hash[GOLDEN_BUSES];
+  std::vector<int32_t> stem_buffer((size_t)block_frames * PCM_STEM_BUSES * 2);
+  int32_t block[GOLDEN_BUSES][block_frames * 2];
+  EventCursor cursor;
+  // time 0 of the case is where the snapshot was taken
+  const uint64_t start_cycles = mcu->mcu.cycles;
+  const uint64_t end_cycles = start_cycles + (uint64_t)(c.length * mcu_clock);
+  while (ok && mcu->mcu.cycles < end_cycles) {
+    mcu->pcm.PCM_SetStemBuffer(&stem_buffer[0], block_frames);
+    RenderBlock(mcu, block[GOLDEN_MIX], c.events, &cursor, start_cycles);
+
+    for (int i = 0; i < block_frames * 2; i++) {
+      block[GOLDEN_REVERB][i] =
+          stem_buffer[(i / 2 * PCM_STEM_BUSES + PCM_STEM_REVERB) * 2 + i % 2];
+      block[GOLDEN_CHORUS][i] =
+          stem_buffer[(i / 2 * PCM_STEM_BUSES + PCM_STEM_CHORUS) * 2 + i % 2];
+    }
+    for (int bus = 0; bus < GOLDEN_BUSES; bus++) {
+      HashSamples(hash[bus], block[bus], block_frames * 2);
+      if (dump[bus] && fwrite(block[bus], sizeof(int32_t), block_frames * 2,
+                              dump[bus]) != block_frames * 2) {
+        fprintf(stderr, "%s: cannot write the dump\n", c.name);
+        ok = false;
+      }
+    }
+    result.frames += block_frames;
+  }
+  if (cursor.next < c.events.size()) {
+    fprintf(stderr, "%s: events after the end\n", c.name);
+    ok = false;
+  }
+
+  for (int bus = 0; bus < GOLDEN_BUSES; bus++) {
+    result.hash[bus] = hash[bus].value;
+    if (dump[bus])
+      fclose(dump[bus]);
+  }
+  delete mcu;
+  return ok;
+}
+
+// -------------------------------------------------------------------------
+// Comparing two dumps
+
+static bool ReadDump(const std::string &path, std::vector<int32_t> &samples) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  samples.clear();
+  int32_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, sizeof(int32_t), 4096, f)) > 0)
+    samples.insert(samples.end(), buffer, buffer + n);
+  fclose(f);
+  return true;
+}
+
+// Returns the number of dumps that differ, or -1 if none were found
+static int DiffDumps(const std::string &dir_a, const std::string &dir_b) {
+  int compared = 0, differing = 0;
+  for (const GoldenCase &c : GoldenCases()) {
+    for (int bus = 0; bus < GOLDEN_BUSES; bus++) {
+      std::vector<int32_t> a, b;
+      std::string path_a = DumpPath(dir_a, c.name, bus);
+      std::string path_b = DumpPath(dir_b, c.name, bus);
+      if (!ReadDump(path_a, a) || !ReadDump(path_b, b))
+        continue;
+      compared++;
+
+      // the sample rate is not in the dump, the case length is
+      const double frame_rate =
+          a.size() / 2 > c.length * 48000 ? 64000 : 32000;
+      size_t count = std::min(a.size(), b.size());
+      size_t first = count, samples = 0;
+      int64_t max_diff = 0;
+      for (size_t i = 0; i < count; i++) {
+        if (a[i] == b[i])
+          continue;
+        if (first == count)
+          first = i;
+        samples++;
+        int64_t diff = std::abs((int64_t)a[i] - b[i]);
+        if (diff > max_diff)
+          max_diff = diff;
+      }
+
+      const char *bus_name = golden_bus_names[bus];
+      if (a.size() != b.size()) {
+        printf("%s %s: %zu and %zu frames\n", c.name, bus_name, a.size() / 2,
+               b.size() / 2);
+        differing++;
+      } else if (samples) {
+        printf("%s %s: %zu samples differ, from frame %zu (%.4f s, %s), "
+               "by up to %" PRId64 "\n",
+               c.name, bus_name, samples, first / 2,
+               first / 2 / frame_rate, first % 2 ? "right" : "left",
+               max_diff);
+        differing++;
+      } else {
+        printf("%s %s: identical\n", c.name, bus_name);
+      }
+    }
+  }
+  if (compared == 0) {
+    fprintf(stderr, "No dumps in both %s and %s\n", dir_a.c_str(),
+            dir_b.c_str());
+    return -1;
+  }
+  return differing;
+}
+
+// -------------------------------------------------------------------------
+
+// one line per case: name frames mix reverb chorus, the hashes in hex;
+// lines starting with '#' are comments
+static bool ReadGolden(const char *path, bool &oversampling,
+                       std::vector<std::string> &names,
+                       std::vector<GoldenResult> &results) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#') {
+      int value;
+      if (sscanf(line, "# oversampling %d", &value) == 1)
+        oversampling = value != 0;
+      continue;
+    }
+    char name[64];
+    GoldenResult r;
+    if (sscanf(line, "%63s %" SCNu64 " %" SCNx64 " %" SCNx64 " %" SCNx64,
+               name, &r.frames, &r.hash[GOLDEN_MIX], &r.hash[GOLDEN_REVERB],
+               &r.hash[GOLDEN_CHORUS]) == 5) {
+      names.push_back(name);
+      results.push_back(r);
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  std::string romdir, dumpdir;
+  const char *snapshot = nullptr;
+  bool oversampling = false, write = false, diff = false, list = false;
+  bool usage = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "or:b:R:wDl")) != -1) {
+    switch (c) {
+    case 'o':
+      oversampling = true;
+      break;
+    case 'r':
+      romdir = optarg;
+      break;
+    case 'b':
+      snapshot = optarg;
+      break;
+    case 'R':
+      dumpdir = optarg;
+      break;
+    case 'w':
+      write = true;
+      break;
+    case 'D':
+      diff = true;
+      break;
+    case 'l':
+      list = true;
+      break;
+    default:
+      usage = true;
+    }
+  }
+  if (list) {
+    for (const GoldenCase &gc : GoldenCases())
+      printf("%-12s %4.1f s, %zu events\n", gc.name, gc.length,
+             gc.events.size());
+    return 0;
+  }
+  if (diff) {
+    if (argc - optind != 2) {
+      usage = true;
+    } else {
+      int differing = DiffDumps(argv[optind], argv[optind + 1]);
+      return differing == 0 ? 0 : 1;
+    }
+  }
+  if (usage || argc - optind != 1) {
+    fprintf(stderr, "usage: %s [-o] [-r romdir] [-R dumpdir] golden.txt\n"
+                    "       %s [-o] [-r romdir] [-b boot.snap] [-R dumpdir] "
+                    "-w golden.txt\n"
+                    "       %s -D dumpdirA dumpdirB\n"
+                    "       %s -l\n",
+            argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  const char *golden = argv[optind];
+  // a snapshot only says which ROMs and options it was made with, not by
+  // which build; restoring one would leave the boot of this build unchecked
+  if (snapshot && !write) {
+    fprintf(stderr, "-b only works with -w\n");
+    return 1;
+  }
+
+  std::vector<std::string> names;
+  std::vector<GoldenResult> expected;
+  if (!write) {
+    // the recorded mode wins over -o
+    if (!ReadGolden(golden, oversampling, names, expected))
+      return 1;
+  }
+
+  Roms roms;
+  if (!LoadRoms(romdir, nullptr, nullptr, roms))
+    return 1;
+  Boot(roms, snapshot, preroll, oversampling);
+
+  FILE *out = nullptr;
+  if (write) {
+    out = fopen(golden, "w");
+    if (!out) {
+      fprintf(stderr, "Cannot create %s\n", golden);
+      return 1;
+    }
+    fprintf(out, "# golden audio of golden.cpp: case frames mix reverb "
+                 "chorus\n# oversampling %d\n",
+            oversampling ? 1 : 0);
+  }
+
+  int failed = 0;
+  for (const GoldenCase &gc : GoldenCases()) {
+    GoldenResult result;
+    if (!RenderCase(roms, oversampling, gc, dumpdir, result)) {
+      failed++;
+      continue;
+    }
+    if (write) {
+      fprintf(out, "%s %" PRIu64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64
+                   "\n",
+              gc.name, result.frames, result.hash[GOLDEN_MIX],
+              result.hash[GOLDEN_REVERB], result.hash[GOLDEN_CHORUS]);
+      printf("%s: recorded\n", gc.name);
+      continue;
+    }
+
+    size_t i = std::find(names.begin(), names.end(), gc.name) - names.begin();
+    if (i == names.size()) {
+      printf("%s: not in %s\n", gc.name, golden);
+      failed++;
+      continue;
+    }
+    std::string differs;
+    if (result.frames != expected[i].frames)
+      differs = " length";
+    for (int bus = 0; bus < GOLDEN_BUSES; bus++) {
+      if (result.hash[bus] != expected[i].hash[bus])
+        differs += std::string(" ") + golden_bus_names[bus];
+    }
+    if (differs.empty()) {
+      printf("%s: ok\n", gc.name);
+    } else {
+      printf("%s: FAILED,%s differ%s\n", gc.name, differs.c_str(),
+             dumpdir.empty() ? "; -R and -D show where" : "");
+      failed++;
+    }
+  }
+
+  if (out && fclose(out) != 0) {
+    fprintf(stderr, "Cannot write %s\n", golden);
+    return 1;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,212 @@
+//
+// headless.h
+//
+// What the host tools (render, golden) share to run the emulator without
+// a sound device: the ROM set, the boot up to a snapshot that every song
+// starts from, optionally kept in a file, and the render loop that posts
+// MIDI events into the UART at their exact MCU cycle.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include "../mcu.h"
+#include "../snapshot.h"
+#include "romfile.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+// PCM_Update advances 625 MCU cycles per 32 kHz frame
+static const double mcu_clock = 625.0 * 32000;
+static const int block_frames = 1024;
+
+// a message and when it is due, in seconds from the start of the song
+struct MidiEvent {
+  double seconds;
+  std::vector<uint8_t> data;
+};
+
+// the ROM images are shared by all emulators, only the NVRAM is copied;
+// every song starts from the snapshot taken after the preroll
+struct Roms {
+  RomSet *set = nullptr;
+  std::vector<uint8_t> nvram;
+  std::vector<uint8_t> snapshot;
+  // what the snapshot is checked against besides rom1 and rom2
+  SnapshotImages images;
+  // of jv880_waverom1.bin and jv880_waverom2.bin, for the snapshot file
+  uint64_t waverom_hash = 0;
+};
+
+// 64-bit FNV-1a, fed in pieces
+struct Fnv1a {
+  uint64_t value = 0xcbf29ce484222325ull;
+
+  void FNV_Add(const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      value ^= data[i];
+      value *= 0x100000001b3ull;
+    }
+  }
+};
+
+static inline bool LoadRom(const std::string &dir, const char *name,
+                           RomFile &file, size_t size) {
+  std::string path = dir.empty() ? name : dir + "/" + name;
+  return file.ROMFILE_Open(path.c_str(), size);
+}
+
+// The jv880_*.bin files from romdir; card and expansion are paths as
+// given, not relative to romdir, or nullptr
+static inline bool LoadRoms(const std::string &romdir, const char *card,
+                            const char *expansion, Roms &roms) {
+  RomFile rom1, rom2, nvram, waverom1, waverom2;
+  if (!LoadRom(romdir, "jv880_rom1.bin", rom1, ROM1_SIZE) ||
+      !LoadRom(romdir, "jv880_rom2.bin", rom2, ROM2_SIZE) ||
+      !LoadRom(romdir, "jv880_nvram.bin", nvram, NVRAM_SIZE) ||
+      !LoadRom(romdir, "jv880_waverom1.bin", waverom1, WAVEROM_SIZE) ||
+      !LoadRom(romdir, "jv880_waverom2.bin", waverom2, WAVEROM_SIZE))
+    return false;
+  roms.nvram.assign(nvram.data, nvram.data + NVRAM_SIZE);
+  roms.images.nvram = SNAPSHOT_Hash(nvram.data, NVRAM_SIZE);
+  roms.waverom_hash = SNAPSHOT_Hash(
+      waverom2.data, WAVEROM_SIZE,
+      SNAPSHOT_Hash(waverom1.data, WAVEROM_SIZE));
+  roms.set = RomSet::ROMSET_Create(rom1.data, rom2.data, waverom1.data,
+                                   waverom2.data);
+  if (!roms.set) {
+    fprintf(stderr, "Out of memory\n");
+    return false;
+  }
+
+  RomFile image;
+  if (card) {
+    if (!image.ROMFILE_Open(card, WAVEROM_SIZE) ||
+        !roms.set->ROMSET_LoadCard(image.data))
+      return false;
+    roms.images.card = SNAPSHOT_Hash(image.data, image.size);
+  }
+  if (expansion) {
+    if (!image.ROMFILE_Open(expansion, WAVEROM_EXP_SIZE) ||
+        !roms.set->ROMSET_LoadExpansion(image.data))
+      return false;
+    roms.images.expansion = SNAPSHOT_Hash(image.data, image.size);
+  }
+  return true;
+}
+
+// the next event to post and how many of its bytes are in the UART
+struct EventCursor {
+  size_t next = 0;
+  size_t sent = 0;
+};
+
+// Renders one block; the events from cursor on go into the UART at their
+// exact cycle, start_cycles being time 0 of the song. A message longer
+// than the free space (a bulk SysEx dump) goes in as the firmware reads.
+// Event is anything with seconds and data like MidiEvent.
+template <typename Event>
+static void RenderBlock(MCU *mcu, int32_t *block,
+                        const std::vector<Event> &events, EventCursor *cursor,
+                        uint64_t start_cycles) {
+  mcu->MCU_SetSampleBuffer(block, block_frames * 2);
+  PROFILE_START(mcu->profile);
+  while (mcu->sample_write_ptr < block_frames * 2) {
+    while (cursor->next < events.size() &&
+           start_cycles + (uint64_t)(events[cursor->next].seconds *
+                                     mcu_clock) <=
+               mcu->mcu.cycles) {
+      const std::vector<uint8_t> &data = events[cursor->next].data;
+      while (cursor->sent < data.size() && mcu->MCU_UARTFree() > 0)
+        mcu->MCU_PostUART(data[cursor->sent++]);
+      if (cursor->sent < data.size())
+        break;
+      cursor->next++;
+      cursor->sent = 0;
+    }
+
+    PROFILE_STAGE(mcu->profile, PROFILE_UART);
+
+    mcu->MCU_Step();
+  }
+  mcu->uart_tx_count = 0; // MIDI OUT is not used here
+}
+
+// Boots the firmware once for all songs: runs the preroll up to the next
+// block boundary and keeps the state there. Songs take mcu.cycles of the
+// restored snapshot as their time 0.
+static inline void Preroll(Roms &roms, double preroll, bool oversampling) {
+  MCU *mcu = new MCU();
+  mcu->startSC55(roms.set, &roms.nvram[0]);
+  mcu->pcm.oversampling = oversampling;
+
+  const uint64_t start_cycles = (uint64_t)(preroll * mcu_clock);
+  const std::vector<MidiEvent> no_events;
+  EventCursor cursor;
+  int32_t block[block_frames * 2];
+  while (mcu->mcu.cycles < start_cycles)
+    RenderBlock(mcu, block, no_events, &cursor, start_cycles);
+
+  roms.snapshot.resize(SNAPSHOT_Size(mcu));
+  SNAPSHOT_Save(mcu, roms.images, &roms.snapshot[0], roms.snapshot.size());
+  delete mcu;
+}
+
+// Preroll, or with a snapshot file, restores the state from it if it was
+// made with the same preroll, oversampling and wave ROMs, which a line at
+// the start of the file names, and with the same ROMs, NVRAM, card and
+// expansion, which the snapshot checks; else boots and writes it.
+static inline void Boot(Roms &roms, const char *snapshot, double preroll,
+                        bool oversampling) {
+  char tag[96];
+  snprintf(tag, sizeof(tag),
+           "snapshot: preroll %.6f oversampling %d waverom %016llx\n",
+           preroll, oversampling ? 1 : 0,
+           (unsigned long long)roms.waverom_hash);
+  const size_t tag_length = strlen(tag);
+
+  bool restored = false;
+  if (snapshot) {
+    RomFile file;
+    struct stat st;
+    if (stat(snapshot, &st) == 0 && (size_t)st.st_size > tag_length &&
+        file.ROMFILE_Open(snapshot, (size_t)st.st_size) &&
+        memcmp(file.data, tag, tag_length) == 0) {
+      roms.snapshot.assign(file.data + tag_length, file.data + file.size);
+      MCU *mcu = new MCU();
+      mcu->startSC55(roms.set, &roms.nvram[0]);
+      restored = SNAPSHOT_Load(mcu, roms.images, &roms.snapshot[0],
+                               roms.snapshot.size());
+      delete mcu;
+    }
+    if (!restored && stat(snapshot, &st) == 0)
+      fprintf(stderr, "%s does not match, booting\n", snapshot);
+  }
+  if (restored)
+    return;
+
+  Preroll(roms, preroll, oversampling);
+  if (snapshot) {
+    FILE *f = fopen(snapshot, "wb");
+    if (!f || fwrite(tag, 1, tag_length, f) != tag_length ||
+        fwrite(&roms.snapshot[0], 1, roms.snapshot.size(), f) !=
+            roms.snapshot.size())
+      fprintf(stderr, "Cannot write %s\n", snapshot);
+    if (f)
+      fclose(f);
+  }
+}
@@ -0,0 +1,539 @@
+//
+// render.cpp
+//
+// Offline renderer: plays Standard MIDI Files through the emulator as fast
+// as the host allows and writes the result to WAV files, one file per
+// worker thread at a time.
+//
+//   render [-j jobs] [-f s16|s24|f32] [-o] [-s] [-p preroll] [-t tail]
+//          [-r romdir] [-d outdir] [-P profile.txt] [-C opcodes.csv]
+//          song.mid...
+//
+// -b keeps the booted state in a file for later runs with the same -p, -o,
+// -c and -e.
+// -P writes the stage counters of all files (see profile.h) to a file,
+// -C the statistics of the executed firmware as CSV; build with
+// -DJV880_PROFILE or -DJV880_PROFILE_OPCODES for them to count.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "../audioformat.h"
+#include "headless.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct RenderOptions {
+  int format = AUDIO_FORMAT_S16;
+  bool oversampling = false;
+  bool stems = false;
+  double preroll = 2.0; // seconds for the firmware to boot, not written
+  double tail = 3.0;    // seconds rendered after the last event
+  std::string outdir;
+  const char *profile = nullptr;
+  const char *opcodes = nullptr;
+};
+
+// the counters of the files rendered so far
+static Profile profile_total;
+static OpcodeProfile opcode_total;
+static std::mutex profile_mutex;
+
+// -------------------------------------------------------------------------
+// Standard MIDI File
+
+struct SmfEvent {
+  uint64_t tick;
+  int track;
+  int order; // position in the track, keeps the sort stable
+  uint32_t tempo; // for tempo meta events, else 0
+  std::vector<uint8_t> data;
+  double seconds;
+};
+
+static uint32_t SMF_ReadVLQ(const uint8_t *&p, const uint8_t *end) {
+  uint32_t value = 0;
+  while (p < end) {
+    uint8_t b = *p++;
+    value = (value << 7) | (b & 0x7f);
+    if (!(b & 0x80))
+      break;
+  }
+  return value;
+}
+
+static uint32_t SMF_Read32(const uint8_t *p) {
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static bool SMF_Load(const char *path, std::vector<SmfEvent> &events) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+  std::vector<uint8_t> file;
+  uint8_t buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    file.insert(file.end(), buffer, buffer + n);
+  fclose(f);
+
+  if (file.size() < 14 || memcmp(&file[0], "MThd", 4) != 0)
+    return false;
+  uint32_t header_len = SMF_Read32(&file[4]);
+  int tracks = (file[10] << 8) | file[11];
+  int division = (int16_t)((file[12] << 8) | file[13]);
+
+  const uint8_t *p = &file[8] + header_len;
+  const uint8_t *file_end = &file[0] + file.size();
+  for (int track = 0; track < tracks && p + 8 <= file_end; track++) {
+    uint32_t len = SMF_Read32(p + 4);
+    bool is_track = memcmp(p, "MTrk", 4) == 0;
+    p += 8;
+    const uint8_t *end = std::min(p + len, file_end);
+    if (!is_track) {
+      p = end;
+      continue;
+    }
+
+    uint64_t tick = 0;
+    uint8_t running_status = 0;
+    int order = 0;
+    while (p < end) {
+      tick += SMF_ReadVLQ(p, end);
+      if (p >= end)
+        break;
+
+      SmfEvent ev = {tick, track, order++, 0, {}, 0};
+      uint8_t status = *p;
+      if (status == 0xff) {
+        if (p + 2 > end)
+          break;
+        uint8_t type = p[1];
+        p += 2;
+        uint32_t mlen = SMF_ReadVLQ(p, end);
+        if (type == 0x51 && mlen == 3 && p + 3 <= end) {
+          ev.tempo = (p[0] << 16) | (p[1] << 8) | p[2];
+          events.push_back(ev);
+        }
+        if (type == 0x2f)
+          break;
+        p += mlen;
+        continue;
+      }
+      if (status == 0xf0 || status == 0xf7) {
+        p++;
+        uint32_t slen = SMF_ReadVLQ(p, end);
+        if (status == 0xf0)
+          ev.data.push_back(0xf0);
+        ev.data.insert(ev.data.end(), p, std::min(p + slen, end));
+        p += slen;
+        events.push_back(ev);
+        continue;
+      }
+
+      if (status & 0x80) {
+        running_status = status;
+        p++;
+      }
+      if (!running_status)
+        return false;
+      int data_len =
+          ((running_status & 0xf0) == 0xc0 || (running_status & 0xf0) == 0xd0)
+              ? 1
+              : 2;
+      ev.data.push_back(running_status);
+      for (int i = 0; i < data_len && p < end; i++)
+        ev.data.push_back(*p++);
+      events.push_back(ev);
+    }
+    p = end;
+  }
+
+  std::sort(events.begin(), events.end(),
+            [](const SmfEvent &a, const SmfEvent &b) {
+              if (a.tick != b.tick)
+                return a.tick < b.tick;
+              if (a.track != b.track)
+                return a.track < b.track;
+              return a.order < b.order;
+            });
+
+  // tempo map
+  double seconds = 0;
+  uint64_t last_tick = 0;
+  double seconds_per_tick;
+  if (division < 0) // SMPTE: frames per second and ticks per frame
+    seconds_per_tick = 1.0 / (-(division >> 8) * (division & 0xff));
+  else
+    seconds_per_tick = 0.5 / division; // 120 bpm until the first tempo
+  for (SmfEvent &ev : events) {
+    seconds += (ev.tick - last_tick) * seconds_per_tick;
+    last_tick = ev.tick;
+    ev.seconds = seconds;
+    if (ev.tempo && division > 0)
+      seconds_per_tick = ev.tempo / 1e6 / division;
+  }
+  return true;
+}
+
+// -------------------------------------------------------------------------
+// WAV
+
+struct WavWriter {
+  FILE *f = nullptr;
+  int format = AUDIO_FORMAT_S16;
+  int channels = 2;
+  uint32_t sample_rate = 32000;
+  uint64_t frames = 0;
+  int32_t peak = 0;
+  std::vector<uint8_t> buffer;
+
+  int WAV_BytesPerSample() const {
+    return format == AUDIO_FORMAT_S24_32 ? 3 : AUDIO_BytesPerSample(format);
+  }
+
+  // written again with the final length on close
+  void WAV_Header() {
+    int bps = WAV_BytesPerSample();
+    uint32_t data_len = (uint32_t)(frames * channels * bps);
+    uint8_t h[44];
+    memcpy(h, "RIFF", 4);
+    uint32_t riff_len = 36 + data_len;
+    memcpy(h + 4, &riff_len, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    uint32_t fmt_len = 16;
+    memcpy(h + 16, &fmt_len, 4);
+    uint16_t tag = format == AUDIO_FORMAT_F32 ? 3 : 1;
+    memcpy(h + 20, &tag, 2);
+    uint16_t ch = channels;
+    memcpy(h + 22, &ch, 2);
+    memcpy(h + 24, &sample_rate, 4);
+    uint32_t byte_rate = sample_rate * channels * bps;
+    memcpy(h + 28, &byte_rate, 4);
+    uint16_t align = channels * bps;
+    memcpy(h + 32, &align, 2);
+    uint16_t bits = bps * 8;
+    memcpy(h + 34, &bits, 2);
+    memcpy(h + 36, "data", 4);
+    memcpy(h + 40, &data_len, 4);
+    fseek(f, 0, SEEK_SET);
+    fwrite(h, 1, sizeof(h), f);
+  }
+
+  bool WAV_Open(const std::string &path, int fmt, int ch, uint32_t rate) {
+    f = fopen(path.c_str(), "wb");
+    format = fmt;
+    channels = ch;
+    sample_rate = rate;
+    if (f)
+      WAV_Header();
+    return f != nullptr;
+  }
+
+  // count is in samples, interleaved
+  void WAV_Write(const int32_t *in, int count) {
+    for (int i = 0; i < count; i++) {
+      int32_t v = in[i] < 0 ? -(in[i] + 1) : in[i];
+      if (v > peak)
+        peak = v;
+    }
+    int bps = WAV_BytesPerSample();
+    buffer.resize((size_t)count * 4);
+    if (format == AUDIO_FORMAT_S24_32) {
+      for (int i = 0; i < count; i++) {
+        int32_t v = in[i] >> 8;
+        buffer[i * 3] = v & 0xff;
+        buffer[i * 3 + 1] = (v >> 8) & 0xff;
+        buffer[i * 3 + 2] = (v >> 16) & 0xff;
+      }
+    } else {
+      AUDIO_Convert(format, in, &buffer[0], count);
+    }
+    fwrite(&buffer[0], bps, count, f);
+    frames += count / channels;
+  }
+
+  void WAV_Close() {
+    if (!f)
+      return;
+    WAV_Header();
+    fclose(f);
+    f = nullptr;
+  }
+};
+
+// -------------------------------------------------------------------------
+
+static std::string OutputPath(const RenderOptions &opt, const char *midi,
+                              const char *suffix) {
+  std::string base = midi;
+  if (!opt.outdir.empty()) {
+    size_t slash = base.find_last_of('/');
+    if (slash != std::string::npos)
+      base = base.substr(slash + 1);
+    base = opt.outdir + "/" + base;
+  }
+  size_t dot = base.find_last_of('.');
+  if (dot != std::string::npos && base.find('/', dot) == std::string::npos)
+    base = base.substr(0, dot);
+  return base + suffix + ".wav";
+}
+
+static bool RenderFile(const Roms &roms, const RenderOptions &opt,
+                       const char *midi) {
+  std::vector<SmfEvent> events;
+  if (!SMF_Load(midi, events)) {
+    fprintf(stderr, "%s: not a valid MIDI file\n", midi);
+    return false;
+  }
+
+  MCU *mcu = new MCU();
+  mcu->startSC55(roms.set, &roms.nvram[0]);
+  mcu->pcm.oversampling = opt.oversampling;
+  if (!SNAPSHOT_Load(mcu, roms.images, &roms.snapshot[0],
+                     roms.snapshot.size())) {
+    fprintf(stderr, "%s: snapshot does not match\n", midi);
+    delete mcu;
+    return false;
+  }
+  const int frame_rate = opt.oversampling ? 64000 : 32000;
+
+  WavWriter wav;
+  if (!wav.WAV_Open(OutputPath(opt, midi, ""), opt.format, 2, frame_rate)) {
+    fprintf(stderr, "%s: cannot create output file\n", midi);
+    delete mcu;
+    return false;
+  }
+
+  std::vector<WavWriter> stem_wav;
+  std::vector<std::string> stem_path;
+  std::vector<int32_t> stem_buffer;
+  if (opt.stems) {
+    stem_wav.resize(PCM_STEM_BUSES);
+    stem_buffer.resize((size_t)block_frames * PCM_STEM_BUSES * 2);
+    for (int bus = 0; bus < PCM_STEM_BUSES; bus++) {
+      char suffix[32];
+      if (bus == PCM_STEM_REVERB)
+        snprintf(suffix, sizeof(suffix), ".reverb");
+      else if (bus == PCM_STEM_CHORUS)
+        snprintf(suffix, sizeof(suffix), ".chorus");
+      else
+        snprintf(suffix, sizeof(suffix), ".slot%02d", bus - PCM_STEM_DRY);
+      stem_path.push_back(OutputPath(opt, midi, suffix));
+      stem_wav[bus].WAV_Open(stem_path[bus], opt.format, 2, frame_rate);
+    }
+  }
+
+  // event times in MCU cycles; the snapshot, taken at the first block
+  // boundary after the preroll, is time 0 of the song
+  const uint64_t start_cycles = mcu->mcu.cycles;
+  const double length = events.empty() ? 0 : events.back().seconds;
+  const uint64_t end_cycles =
+      start_cycles + (uint64_t)((length + opt.tail) * mcu_clock);
+
+  auto started = std::chrono::steady_clock::now();
+
+  int32_t block[block_frames * 2];
+  int32_t stem_block[block_frames * 2];
+  EventCursor cursor;
+#ifdef JV880_PROFILE
+  // a block is due in real time after the one before
+  const uint32_t block_us = (uint32_t)(1000000LL * block_frames / frame_rate);
+#endif
+  while (mcu->mcu.cycles < end_cycles) {
+#ifdef JV880_PROFILE
+    auto block_started = std::chrono::steady_clock::now();
+#endif
+    if (opt.stems)
+      mcu->pcm.PCM_SetStemBuffer(&stem_buffer[0], block_frames);
+    RenderBlock(mcu, block, events, &cursor, start_cycles);
+
+    PROFILE_START(mcu->profile);
+
+    wav.WAV_Write(block, block_frames * 2);
+    if (opt.stems) {
+      for (int bus = 0; bus < PCM_STEM_BUSES; bus++) {
+        for (int i = 0; i < block_frames; i++) {
+          stem_block[i * 2] = stem_buffer[(i * PCM_STEM_BUSES + bus) * 2];
+          stem_block[i * 2 + 1] =
+              stem_buffer[(i * PCM_STEM_BUSES + bus) * 2 + 1];
+        }
+        stem_wav[bus].WAV_Write(stem_block, block_frames * 2);
+      }
+    }
+    PROFILE_STAGE(mcu->profile, PROFILE_AUDIO_WRITE);
+    PROFILE_CHUNK(mcu->profile,
+                  (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - block_started)
+                      .count(),
+                  block_us);
+  }
+
+  wav.WAV_Close();
+  for (int bus = 0; bus < (int)stem_wav.size(); bus++) {
+    stem_wav[bus].WAV_Close();
+    if (stem_wav[bus].peak == 0) // never sounded
+      unlink(stem_path[bus].c_str());
+  }
+  if (opt.profile || opt.opcodes) {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    profile_total.PROFILE_Add(mcu->profile);
+    opcode_total.PROFILE_Add(mcu->opcode_profile);
+  }
+  delete mcu;
+
+  // the firmware stopped reading MIDI before the end
+  if (cursor.next < events.size()) {
+    fprintf(stderr, "%s: event %zu at %.3f s (%zu bytes) not delivered\n",
+            midi, cursor.next, events[cursor.next].seconds,
+            events[cursor.next].data.size());
+    return false;
+  }
+
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  double rendered = (double)wav.frames / frame_rate;
+  printf("%s: %.1f s rendered in %.1f s (%.1fx real time)\n", midi, rendered,
+         elapsed, elapsed > 0 ? rendered / elapsed : 0);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  RenderOptions opt;
+  std::string romdir;
+  const char *card = nullptr, *expansion = nullptr;
+  const char *snapshot = nullptr;
+  unsigned jobs = std::thread::hardware_concurrency();
+
+  int c;
+  while ((c = getopt(argc, argv, "j:f:osp:t:r:d:c:e:b:P:C:")) != -1) {
+    switch (c) {
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'f':
+      opt.format = strcmp(optarg, "s24") == 0 ? AUDIO_FORMAT_S24_32
+                                              : AUDIO_ParseFormat(optarg);
+      break;
+    case 'o':
+      opt.oversampling = true;
+      break;
+    case 's':
+      opt.stems = true;
+      break;
+    case 'p':
+      opt.preroll = atof(optarg);
+      break;
+    case 't':
+      opt.tail = atof(optarg);
+      break;
+    case 'r':
+      romdir = optarg;
+      break;
+    case 'd':
+      opt.outdir = optarg;
+      break;
+    case 'c':
+      card = optarg;
+      break;
+    case 'e':
+      expansion = optarg;
+      break;
+    case 'b':
+      snapshot = optarg;
+      break;
+    case 'P':
+      opt.profile = optarg;
+      break;
+    case 'C':
+      opt.opcodes = optarg;
+      break;
+    default:
+      opt.format = -1;
+    }
+  }
+  if (optind >= argc || opt.format < 0) {
+    fprintf(stderr, "usage: %s [-j jobs] [-f s16|s24|f32] [-o] [-s] "
+                    "[-p preroll] [-t tail] [-r romdir] [-d outdir] "
+                    "[-c card.bin] [-e expansion.bin] [-b boot.snap] "
+                    "[-P profile.txt] [-C opcodes.csv] song.mid...\n",
+            argv[0]);
+    return 1;
+  }
+
+  Roms roms;
+  if (!LoadRoms(romdir, card, expansion, roms))
+    return 1;
+  // -b keeps the state after the preroll in a file
+  Boot(roms, snapshot, opt.preroll, opt.oversampling);
+
+  // one emulator per file, files are spread over the workers
+  std::atomic<int> next_file{optind};
+  std::atomic<int> failed{0};
+  auto worker = [&]() {
+    int i;
+    while ((i = next_file++) < argc) {
+      if (!RenderFile(roms, opt, argv[i]))
+        failed++;
+    }
+  };
+
+  if (jobs < 1)
+    jobs = 1;
+  if (jobs > (unsigned)(argc - optind))
+    jobs = argc - optind;
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < jobs; i++)
+    threads.emplace_back(worker);
+  for (std::thread &t : threads)
+    t.join();
+
+  roms.set->ROMSET_Release();
+
+  if (opt.profile) {
+#ifndef JV880_PROFILE
+    fprintf(stderr, "Built without -DJV880_PROFILE, the profile is empty\n");
+#endif
+    char report[1024];
+    size_t length = profile_total.PROFILE_Format(report, sizeof(report));
+    FILE *f = fopen(opt.profile, "w");
+    if (!f || fwrite(report, 1, length, f) != length)
+      fprintf(stderr, "Cannot write %s\n", opt.profile);
+    if (f)
+      fclose(f);
+  }
+
+  if (opt.opcodes) {
+#ifndef JV880_PROFILE_OPCODES
+    fprintf(stderr, "Built without -DJV880_PROFILE_OPCODES, the statistics "
+                    "are empty\n");
+#endif
+    FILE *f = fopen(opt.opcodes, "w");
+    if (!f || !opcode_total.PROFILE_WriteCSV(f))
+      fprintf(stderr, "Cannot write %s\n", opt.opcodes);
+    if (f)
+      fclose(f);
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+//
+// romfile.h
+//
+// Read-only mapping of a ROM dump for the host tools. The pages are only
+// read once, when the RomSet is created, and dropped with the mapping.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+struct RomFile {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+
+  RomFile() = default;
+  RomFile(const RomFile &) = delete;
+  RomFile &operator=(const RomFile &) = delete;
+  ~RomFile() { ROMFILE_Close(); }
+
+  // data holds size bytes afterwards; a shorter file is read into a zero
+  // padded copy, as a mapping would fault past its end
+  bool ROMFILE_Open(const char *path, size_t size) {
+    ROMFILE_Close();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Cannot open %s\n", path);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= size) {
+      void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        close(fd);
+        data = (const uint8_t *)p;
+        this->size = size;
+        mapped = true;
+        return true;
+      }
+    }
+    copy.assign(size, 0);
+    ssize_t n = read(fd, &copy[0], size);
+    close(fd);
+    if (n < 0) {
+      fprintf(stderr, "Cannot read %s\n", path);
+      return false;
+    }
+    data = &copy[0];
+    this->size = size;
+    return true;
+  }
+
+  void ROMFILE_Close() {
+    if (mapped)
+      munmap((void *)data, size);
+    mapped = false;
+    copy.clear();
+    data = nullptr;
+    size = 0;
+  }
+
+private:
+  bool mapped = false;
+  std::vector<uint8_t> copy;
+};
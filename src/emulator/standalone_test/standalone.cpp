@@ -1,8 +1,16 @@
 #define STANDALONE
 
 #include "../mcu.h"
+#include "../midi.h"
+#include "../resampler.h"
+#include "romfile.h"
 #include "SDL.h"
+#include <atomic>
 #include <chrono>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
 
 SDL_AudioDeviceID sdl_audio;
 SDL_Window *window;
@@ -13,6 +21,52 @@ MCU mcu;
 bool working = true;
 int nSamples = 0;
 static SDL_mutex *work_thread_lock;
+
+// Serial MIDI stand-in: a pseudo-terminal behaves like the Pi's UART, so
+// e.g. `ttymidi`/`socat` or a plain `cat file.mid.raw > /dev/pts/N` can
+// drive the same parser and queue as the DIN input on the hardware.
+int midi_pty = -1;
+MidiQueue midi_queue;
+MidiParser midi_parser;
+MidiMerge midi_merge;
+MidiTxRing midi_tx_ring;
+
+int SDLCALL midi_thread(void *data) {
+  uint8_t buffer[64];
+  while (working) {
+    // MIDI OUT goes back to the same pty
+    uint32_t out = midi_tx_ring.MIDI_Read(buffer, sizeof(buffer));
+    if (out)
+      write(midi_pty, buffer, out);
+
+    ssize_t n = read(midi_pty, buffer, sizeof(buffer));
+    if (n <= 0) {
+      SDL_Delay(1);
+      continue;
+    }
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+    midi_parser.MIDI_Parse(buffer, (int)n, now, &midi_queue);
+  }
+  return 0;
+}
+
+int open_midi_pty() {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+    return -1;
+
+  struct termios tio;
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(fd, TCSANOW, &tio);
+
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+
+  printf("MIDI in/out on %s\n", ptsname(fd));
+  return fd;
+}
 // 13333 iters per loop
 
 int SDLCALL pcm_thread(void *data) {
@@ -25,40 +79,46 @@ int SDLCALL pcm_thread(void *data) {
   return 0;
 }
 
+// the device runs at 64 kHz; without oversampling the 32 kHz output is
+// upsampled. Toggled with the O key.
+const int output_rate = 64000;
+Resampler resampler[2];
+std::atomic<bool> oversampling{false};
+int32_t render_buffer[audio_buffer_size];
+
 double avg = 0;
 int cnt = 0;
 void audio_callback(void * /*userdata*/, Uint8 *stream, int len) {
   auto start = std::chrono::high_resolution_clock::now();
 
-  nSamples = len / sizeof(int16_t);
+  int out_frames = len / (2 * sizeof(int32_t));
+  mcu.pcm.oversampling = oversampling;
+  Resampler *rs = &resampler[mcu.pcm.oversampling];
+  int32_t *target =
+      rs->RESAMPLER_IsBypass() ? (int32_t *)stream : render_buffer;
+  nSamples = rs->RESAMPLER_InputFrames(out_frames) * 2;
+  if (mcu.pcm.oversampling)
+    nSamples = (nSamples + 3) & ~3;
   // mcu.updateSC55(nSamples);
 
-  mcu.sample_write_ptr = 0;
-  while (mcu.sample_write_ptr < nSamples) {
-    // for (size_t i = 0; i < 13333; i++) {
-    // SDL_UnlockMutex(work_thread_lock);
+  MidiQueue *const midi_queues[] = {&midi_queue};
+  midi_merge.MIDI_Drain(midi_queues, 1, &mcu);
 
-    if (!mcu.mcu.ex_ignore)
-      mcu.MCU_Interrupt_Handle();
-    else
-      mcu.mcu.ex_ignore = 0;
-
-    if (!mcu.mcu.sleep)
-      mcu.MCU_ReadInstruction();
-
-    mcu.mcu.cycles += 12; // FIXME: assume 12 cycles per instruction
-
-    mcu.TIMER_Clock(mcu.mcu.cycles);
-    mcu.MCU_UpdateUART_RX();
-    mcu.MCU_UpdateUART_TX();
-    mcu.MCU_UpdateAnalog(mcu.mcu.cycles);
-
-    // mcu.pcm.PCM_Update(mcu.mcu.cycles);
-  }
+  // render straight into SDL's buffer if no conversion is needed
+  mcu.MCU_SetSampleBuffer(target, nSamples);
+  while (mcu.sample_write_ptr < nSamples)
+    mcu.MCU_Step();
   if (nSamples != mcu.sample_write_ptr)
     printf("expected %d rendered %d\n", nSamples, mcu.sample_write_ptr);
 
-  memcpy(stream, mcu.sample_buffer, len);
+  if (!rs->RESAMPLER_IsBypass()) {
+    int n = rs->RESAMPLER_Process(render_buffer, nSamples / 2,
+                                  (int32_t *)stream, out_frames);
+    if (n < out_frames)
+      memset((int32_t *)stream + 2 * n, 0, (out_frames - n) * 8);
+  }
+
+  mcu.MCU_FlushUART_TX(&midi_tx_ring);
 
   auto stop = std::chrono::high_resolution_clock::now();
   auto duration =
@@ -90,8 +150,8 @@ int main() {
 
   SDL_AudioSpec spec = {};
   SDL_AudioSpec spec_actual = {};
-  spec.format = AUDIO_S16SYS;
-  spec.freq = 32000 * 2;
+  spec.format = AUDIO_S32SYS; // the emulator's native sample format
+  spec.freq = output_rate;
   spec.channels = 2;
   spec.callback = audio_callback;
   spec.samples = 256 * 2;
@@ -105,34 +165,27 @@ int main() {
       SDL_CreateTexture(renderer, SDL_PIXELFORMAT_BGR888,
                         SDL_TEXTUREACCESS_STREAMING, lcd_width, lcd_height);
 
-  uint8_t rom1[ROM1_SIZE];
-  uint8_t rom2[ROM2_SIZE];
-  uint8_t nvram[NVRAM_SIZE];
-  uint8_t pcm1[0x200000];
-  uint8_t pcm2[0x200000];
-  FILE *f = NULL;
-
-  f = fopen("jv880_rom1.bin", "rb");
-  fread(rom1, 1, ROM1_SIZE, f);
-  fclose(f);
-  f = fopen("jv880_rom2.bin", "rb");
-  fread(rom2, 1, ROM2_SIZE, f);
-  fclose(f);
-  f = fopen("jv880_nvram.bin", "rb");
-  fread(nvram, 1, NVRAM_SIZE, f);
-  fclose(f);
-  f = fopen("jv880_waverom1.bin", "rb");
-  fread(pcm1, 1, 0x200000, f);
-  fclose(f);
-  f = fopen("jv880_waverom2.bin", "rb");
-  fread(pcm2, 1, 0x200000, f);
-  fclose(f);
-
-  mcu.startSC55(rom1, rom2, pcm1, pcm2, nvram);
+  RomFile rom1, rom2, nvram, pcm1, pcm2;
+  if (!rom1.ROMFILE_Open("jv880_rom1.bin", ROM1_SIZE) ||
+      !rom2.ROMFILE_Open("jv880_rom2.bin", ROM2_SIZE) ||
+      !nvram.ROMFILE_Open("jv880_nvram.bin", NVRAM_SIZE) ||
+      !pcm1.ROMFILE_Open("jv880_waverom1.bin", WAVEROM_SIZE) ||
+      !pcm2.ROMFILE_Open("jv880_waverom2.bin", WAVEROM_SIZE))
+    return 1;
+
+  mcu.startSC55(rom1.data, rom2.data, pcm1.data, pcm2.data, nvram.data);
+
+  for (int i = 0; i < 2; i++)
+    resampler[i].RESAMPLER_Init(32000 << i, output_rate,
+                                RESAMPLER_QUALITY_HIGH, audio_buffer_size / 2);
 
   SDL_Thread *thread = SDL_CreateThread(pcm_thread, "pcm thread", 0);
+  midi_pty = open_midi_pty();
+  if (midi_pty >= 0)
+    SDL_CreateThread(midi_thread, "midi thread", 0);
   SDL_PauseAudioDevice(sdl_audio, 0);
 
+  uint32_t lcd_generation = mcu.lcd.LCD_GetGeneration() - 1;
   while (working) {
     SDL_Event sdl_event;
     while (SDL_PollEvent(&sdl_event)) {
@@ -141,6 +194,10 @@ int main() {
           mcu.MCU_EncoderTrigger(0);
         if (sdl_event.key.keysym.scancode == SDL_SCANCODE_PERIOD)
           mcu.MCU_EncoderTrigger(1);
+        if (sdl_event.key.keysym.scancode == SDL_SCANCODE_O) {
+          oversampling = !oversampling;
+          printf("oversampling %s\n", oversampling ? "on" : "off");
+        }
       }
 
       switch (sdl_event.type) {
@@ -170,8 +227,13 @@ int main() {
       }
     }
 
-    uint32_t *lcd_buffer = mcu.lcd.LCD_Update();
-    SDL_UpdateTexture(texture, NULL, lcd_buffer, lcd_width * 4);
+    // only upload the LCD when it has changed
+    uint32_t generation = mcu.lcd.LCD_GetGeneration();
+    if (generation != lcd_generation) {
+      lcd_generation = generation;
+      uint32_t *lcd_buffer = mcu.lcd.LCD_Update();
+      SDL_UpdateTexture(texture, NULL, lcd_buffer, lcd_width * 4);
+    }
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
   }
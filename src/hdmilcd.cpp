@@ -0,0 +1,185 @@
+//
+// hdmilcd.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "hdmilcd.h"
+#include <circle/logger.h>
+#include <circle/string.h>
+#include <circle/synchronize.h>
+#include <circle/timer.h>
+#include <assert.h>
+#include <string.h>
+
+LOGMODULE ("hdmilcd");
+
+#define MAX_SCALE	4
+
+CHDMILCD::CHDMILCD (CScreenDevice *pScreen, LCD *pLCD, unsigned nScale, unsigned nFrameRate)
+:	m_pScreen (pScreen),
+	m_pLCD (pLCD),
+	m_nScale (nScale),
+	m_nInterval (CLOCKHZ / (nFrameRate > 0 ? nFrameRate : 1)),
+	m_pBuffer (0),
+	m_nPitch (0),
+	m_bShown (false),
+	m_nGeneration (0)
+{
+	if (m_nScale < 1)
+	{
+		m_nScale = 1;
+	}
+	else if (m_nScale > MAX_SCALE)
+	{
+		m_nScale = MAX_SCALE;
+	}
+}
+
+bool CHDMILCD::Initialize (void)
+{
+	assert (m_pScreen != 0);
+	assert (m_pLCD != 0);
+
+#if RASPPI >= 5
+	LOGWARN ("Not supported on Raspberry Pi 5");
+
+	return false;
+#else
+	CBcmFrameBuffer *pFrameBuffer = m_pScreen->GetFrameBuffer ();
+	if (   pFrameBuffer == 0
+	    || pFrameBuffer->GetBuffer () == 0
+	    || pFrameBuffer->GetDepth () != 16)
+	{
+		LOGWARN ("No 16-bit frame buffer");
+
+		return false;
+	}
+
+	// leave at least half of the screen to the log
+	unsigned nWidth = pFrameBuffer->GetWidth ();
+	unsigned nHeight = pFrameBuffer->GetHeight ();
+	while (   m_nScale > 1
+	       && (   lcd_width * m_nScale > nWidth
+		   || lcd_height * m_nScale > nHeight / 2))
+	{
+		m_nScale--;
+	}
+
+	if (lcd_width > nWidth || lcd_height > nHeight / 2)
+	{
+		LOGWARN ("Screen too small (%ux%u)", nWidth, nHeight);
+
+		return false;
+	}
+
+	m_nPitch = pFrameBuffer->GetPitch () / sizeof (u16);
+	m_pBuffer =   (u16 *) (uintptr) pFrameBuffer->GetBuffer ()
+		    + (nWidth - lcd_width * m_nScale) / 2;
+
+	// the log scrolls in the rows below the LCD
+	unsigned nRows = m_pScreen->GetRows ();
+	unsigned nRowHeight = nHeight / nRows;
+	unsigned nTopRow = (lcd_height * m_nScale + nRowHeight - 1) / nRowHeight + 1;
+	CString Region;
+	Region.Format ("\x1B[%u;%ur\x1B[%u;1H", nTopRow, nRows, nTopRow);
+	m_pScreen->Write (Region, Region.GetLength ());
+
+	LOGNOTE ("%ux%u at scale %u", lcd_width, lcd_height, m_nScale);
+
+	return true;
+#endif
+}
+
+void CHDMILCD::Run (void)
+{
+	unsigned nLastTicks = CTimer::GetClockTicks ();
+	while (true)
+	{
+		// the timer event stream wakes this core up regularly
+		while (CTimer::GetClockTicks () - nLastTicks < m_nInterval)
+		{
+			WaitForEvent ();
+		}
+		nLastTicks = CTimer::GetClockTicks ();
+
+		Update ();
+	}
+}
+
+void CHDMILCD::Update (void)
+{
+	unsigned nGeneration = m_pLCD->LCD_GetGeneration ();
+	if (m_bShown && nGeneration == m_nGeneration)
+	{
+		return;
+	}
+	m_nGeneration = nGeneration;
+
+	uint32_t Rendered[lcd_rows];
+	m_pLCD->LCD_Update (Rendered);
+
+	if (!m_bShown)
+	{
+		// the background between the cells too
+		Blit (0, 0, lcd_width, lcd_height);
+		m_bShown = true;
+
+		return;
+	}
+
+	for (int nRow = 0; nRow < lcd_rows; nRow++)
+	{
+		for (uint32_t nBits = Rendered[nRow]; nBits != 0; nBits &= nBits - 1)
+		{
+			int nCol = __builtin_ctz (nBits);
+			Blit (lcd_cell_left (nCol), lcd_cell_top (nRow),
+			      lcd_cell_width, lcd_cell_height);
+		}
+	}
+}
+
+void CHDMILCD::Blit (unsigned nX, unsigned nY, unsigned nWidth, unsigned nHeight)
+{
+	assert (m_pBuffer != 0);
+
+	for (unsigned y = nY; y < nY + nHeight; y++)
+	{
+		// the pixel buffer holds 16-bit colours in 32-bit words
+		const uint32_t *pSource = &m_pLCD->lcd_buffer[y][nX];
+		u16 *pLine = m_pBuffer + y * m_nScale * m_nPitch + nX * m_nScale;
+
+		if (m_nScale == 1)
+		{
+			for (unsigned x = 0; x < nWidth; x++)
+			{
+				pLine[x] = (u16) pSource[x];
+			}
+
+			continue;
+		}
+
+		for (unsigned x = 0; x < nWidth; x++)
+		{
+			for (unsigned i = 0; i < m_nScale; i++)
+			{
+				pLine[x * m_nScale + i] = (u16) pSource[x];
+			}
+		}
+
+		for (unsigned i = 1; i < m_nScale; i++)
+		{
+			memcpy (pLine + i * m_nPitch, pLine, nWidth * m_nScale * sizeof (u16));
+		}
+	}
+}
@@ -0,0 +1,60 @@
+//
+// hdmilcd.h
+//
+// Shows the emulated JV-880 LCD at the top of the HDMI screen, above the
+// log. Core 1 copies the character cells that have changed from the
+// LCD's pixel buffer into the frame buffer, at most nFrameRate times a
+// second.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _hdmilcd_h
+#define _hdmilcd_h
+
+#include "emulator/lcd.h"
+#include <circle/screen.h>
+#include <circle/types.h>
+
+class CHDMILCD
+{
+public:
+	// nScale is reduced to what fits the screen
+	CHDMILCD (CScreenDevice *pScreen, LCD *pLCD, unsigned nScale, unsigned nFrameRate);
+
+	// Runs on core 0 and keeps the log below the LCD. Fails without a
+	// 16-bit frame buffer, which is what the LCD colours are made for.
+	bool Initialize (void);
+
+	// core 1, does not return
+	void Run (void);
+
+private:
+	void Update (void);
+	// copies a rectangle of the LCD's pixel buffer, scaled
+	void Blit (unsigned nX, unsigned nY, unsigned nWidth, unsigned nHeight);
+
+private:
+	CScreenDevice *m_pScreen;
+	LCD *m_pLCD;
+	unsigned m_nScale;
+	unsigned m_nInterval;		// microseconds between two updates
+
+	u16 *m_pBuffer;			// where the LCD starts in the frame buffer
+	unsigned m_nPitch;		// in pixels
+
+	bool m_bShown;
+	unsigned m_nGeneration;		// of what is shown
+};
+
+#endif
@@ -0,0 +1,129 @@
+//
+// latencycontrol.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "latencycontrol.h"
+#include <assert.h>
+
+// a render pass using more than this share of the time the queue
+// has left counts as a near miss
+#define NEAR_MISS_PERCENT	75
+
+// seconds without underruns or near misses before shrinking by one step
+#define SHRINK_SECONDS		10
+
+CLatencyControl::CLatencyControl (unsigned nSampleRate, unsigned nMinFrames, unsigned nMaxFrames,
+				  bool bAdaptive)
+:	m_nSampleRate (nSampleRate),
+	m_nMinFrames (nMinFrames),
+	m_nMaxFrames (nMaxFrames),
+	m_bAdaptive (bAdaptive),
+	m_bStarted (false),
+	m_nStepFrames (nSampleRate / 1000),	// 1 ms
+	m_nCleanFrames (0),
+	m_nChunkFrames (nMinFrames),
+	m_nUnderruns (0),
+	m_nNearMisses (0),
+	m_nPeakLoad (0)
+{
+	assert (0 < nMinFrames && nMinFrames <= nMaxFrames);
+}
+
+unsigned CLatencyControl::GetRenderFrames (unsigned nQueuedFrames, unsigned nFreeFrames) const
+{
+	unsigned nChunkFrames = m_nChunkFrames;
+	if (nQueuedFrames > nChunkFrames)
+	{
+		return 0;
+	}
+
+	unsigned nFrames = 2*nChunkFrames - nQueuedFrames;
+	if (nFrames > nFreeFrames)
+	{
+		nFrames = nFreeFrames;
+	}
+
+	return nFrames;
+}
+
+void CLatencyControl::Update (unsigned nQueuedFrames, unsigned nRenderFrames,
+			      unsigned nRenderMicros, bool bDropped)
+{
+	if (nRenderFrames == 0)
+	{
+		return;
+	}
+
+	// the queue is empty before the first pass, that is no underrun
+	if (!m_bStarted)
+	{
+		m_bStarted = true;
+
+		return;
+	}
+
+	unsigned nLoad = (u64) nRenderMicros * m_nSampleRate / 10000 / nRenderFrames;
+	if (nLoad > m_nPeakLoad)
+	{
+		m_nPeakLoad = nLoad;
+	}
+
+	if (nQueuedFrames == 0 || bDropped)
+	{
+		m_nUnderruns++;
+
+		Grow (m_nChunkFrames / 2);
+	}
+	else if ((u64) nRenderMicros * m_nSampleRate * 100
+		 > (u64) nQueuedFrames * 1000000 * NEAR_MISS_PERCENT)
+	{
+		m_nNearMisses++;
+
+		Grow (m_nStepFrames);
+	}
+	else if (m_bAdaptive)
+	{
+		m_nCleanFrames += nRenderFrames;
+		if (   m_nCleanFrames >= SHRINK_SECONDS * m_nSampleRate
+		    && m_nChunkFrames >= m_nMinFrames + m_nStepFrames)
+		{
+			m_nChunkFrames -= m_nStepFrames;
+			m_nCleanFrames = 0;
+		}
+	}
+}
+
+void CLatencyControl::Grow (unsigned nFrames)
+{
+	m_nCleanFrames = 0;
+
+	if (!m_bAdaptive)
+	{
+		return;
+	}
+
+	if (nFrames < m_nStepFrames)
+	{
+		nFrames = m_nStepFrames;
+	}
+
+	unsigned nChunkFrames = m_nChunkFrames + nFrames;
+	if (nChunkFrames > m_nMaxFrames)
+	{
+		nChunkFrames = m_nMaxFrames;
+	}
+
+	m_nChunkFrames = nChunkFrames;
+}
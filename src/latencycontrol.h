@@ -0,0 +1,70 @@
+//
+// latencycontrol.h
+//
+// Adapts the audio render chunk to what the emulator can sustain: it is
+// grown after underruns and near misses, and shrunk again while rendering
+// stays well ahead of the DMA.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _latencycontrol_h
+#define _latencycontrol_h
+
+#include <circle/types.h>
+
+class CLatencyControl
+{
+public:
+	// sizes are in frames; with bAdaptive == false the chunk stays at nMinFrames
+	CLatencyControl (unsigned nSampleRate, unsigned nMinFrames, unsigned nMaxFrames,
+			 bool bAdaptive);
+
+	// Frames to render now, given the frames still queued for the DMA and
+	// the free space of the queue; 0 if it is not time to render yet.
+	// The queue is refilled to twice the chunk once it has drained to one
+	// chunk, so the chunk is both the trigger level and the render size.
+	unsigned GetRenderFrames (unsigned nQueuedFrames, unsigned nFreeFrames) const;
+
+	// Reports one render pass: nQueuedFrames were left when it started and
+	// bDropped is set if the queue could not take all nRenderFrames.
+	void Update (unsigned nQueuedFrames, unsigned nRenderFrames,
+		     unsigned nRenderMicros, bool bDropped);
+
+	// Telemetry, may be read from another core
+	unsigned GetChunkFrames (void) const	{ return m_nChunkFrames; }
+	unsigned GetUnderruns (void) const	{ return m_nUnderruns; }
+	unsigned GetNearMisses (void) const	{ return m_nNearMisses; }
+	unsigned GetPeakLoad (void) const	{ return m_nPeakLoad; }	// percent of real time
+	void ResetPeakLoad (void)		{ m_nPeakLoad = 0; }
+
+private:
+	void Grow (unsigned nFrames);
+
+private:
+	unsigned m_nSampleRate;
+	unsigned m_nMinFrames;
+	unsigned m_nMaxFrames;
+	bool m_bAdaptive;
+	bool m_bStarted;
+
+	unsigned m_nStepFrames;
+	unsigned m_nCleanFrames;	// rendered since the last problem
+
+	volatile unsigned m_nChunkFrames;
+	volatile unsigned m_nUnderruns;
+	volatile unsigned m_nNearMisses;
+	volatile unsigned m_nPeakLoad;
+};
+
+#endif
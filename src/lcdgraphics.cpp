@@ -0,0 +1,402 @@
+//
+// lcdgraphics.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "lcdgraphics.h"
+#include <circle/logger.h>
+#include <assert.h>
+#include <string.h>
+
+LOGMODULE ("lcdgraphics");
+
+#define MAX_HEIGHT		64
+#define SSD1306_MAX_WIDTH	128
+
+#define XMAP_GAP		0xFFFF
+
+// a single transfer is worth it for gaps up to this many unchanged columns
+#define ST7789_MERGE_GAP	8
+
+// the glyph the cursor is drawn with
+#define GLYPH_CURSOR		('_' - 16 + 8)
+
+// the ST7789 takes RGB565 with the high byte first
+static inline u16 ST7789Color (u32 nColor)
+{
+	return (u16) (((nColor & 0xFF) << 8) | ((nColor >> 8) & 0xFF));
+}
+
+CLCDGraphics::CLCDGraphics (CI2CMaster *pI2CMaster, u8 ucSSD1306Address,
+			    unsigned nWidth, unsigned nHeight, bool bRotate, bool bMirror)
+:	m_pI2CMaster (pI2CMaster),
+	m_ucSSD1306Address (ucSSD1306Address),
+	m_bRotate (bRotate),
+	m_bMirror (bMirror),
+	m_pST7789Display (0),
+	m_nWidth (nWidth),
+	m_nHeight (nHeight),
+	m_pXMap (0),
+	m_pGlyph (0),
+	m_pColumns (0),
+	m_pSent (0),
+	m_nCursor (-1),
+	m_bShown (false),
+	m_pPixels (0)
+{
+}
+
+CLCDGraphics::CLCDGraphics (CST7789Display *pST7789Display)
+:	m_pI2CMaster (0),
+	m_ucSSD1306Address (0),
+	m_bRotate (false),
+	m_bMirror (false),
+	m_pST7789Display (pST7789Display),
+	m_nWidth (pST7789Display->GetWidth ()),
+	m_nHeight (pST7789Display->GetWidth () / 4),
+	m_pXMap (0),
+	m_pGlyph (0),
+	m_pColumns (0),
+	m_pSent (0),
+	m_nCursor (-1),
+	m_bShown (false),
+	m_pPixels (0)
+{
+	if (m_nHeight > pST7789Display->GetHeight ())
+	{
+		m_nHeight = pST7789Display->GetHeight ();
+	}
+}
+
+CLCDGraphics::~CLCDGraphics (void)
+{
+	delete [] m_pPixels;
+	delete [] m_pSent;
+	delete [] m_pColumns;
+	delete [] m_pGlyph;
+	delete [] m_pXMap;
+}
+
+bool CLCDGraphics::Initialize (void)
+{
+	if (m_nHeight > MAX_HEIGHT)
+	{
+		m_nHeight = MAX_HEIGHT;
+	}
+
+	if (   m_nWidth < lcd_cols * 5
+	    || m_nHeight < lcd_rows * 8
+	    || (m_pI2CMaster != 0 && (m_nWidth > SSD1306_MAX_WIDTH || m_nHeight % 8 != 0)))
+	{
+		LOGWARN ("Cannot show the LCD on %ux%u pixels", m_nWidth, m_nHeight);
+
+		return false;
+	}
+
+	m_pXMap = new u16[m_nWidth];
+	m_pGlyph = new u64[lcd_rows][Glyphs][5];
+	m_pColumns = new u64[m_nWidth];
+	m_pSent = new u64[m_nWidth];
+	memset (m_pColumns, 0, m_nWidth * sizeof (u64));
+	memset (m_pSent, 0, m_nWidth * sizeof (u64));
+
+	// The cells are as wide as the display allows. The 5 dots of a glyph
+	// take all of a cell, less a sixth as the gap to the next one if
+	// there is room for it. So on 128 pixels a dot is a pixel.
+	for (unsigned nCol = 0; nCol < lcd_cols; nCol++)
+	{
+		unsigned x0 = nCol * m_nWidth / lcd_cols;
+		unsigned nCellWidth = (nCol + 1) * m_nWidth / lcd_cols - x0;
+		unsigned nGlyphWidth = nCellWidth >= 6 ? nCellWidth - nCellWidth / 6 : nCellWidth;
+		for (unsigned i = 0; i < nCellWidth; i++)
+		{
+			m_pXMap[x0 + i] =   i < nGlyphWidth
+					  ? (nCol << 8) | (i * 5 / nGlyphWidth)
+					  : XMAP_GAP;
+		}
+	}
+
+	// the same for the 7 dot rows, with an eighth as the gap
+	memset (m_RowBits, 0, sizeof m_RowBits);
+	for (unsigned nRow = 0; nRow < lcd_rows; nRow++)
+	{
+		unsigned y0 = nRow * m_nHeight / lcd_rows;
+		unsigned nCellHeight = (nRow + 1) * m_nHeight / lcd_rows - y0;
+		unsigned nGlyphHeight = nCellHeight - nCellHeight / 8;
+		m_RowMask[nRow] = 0;
+		for (unsigned i = 0; i < nCellHeight; i++)
+		{
+			if (i < nGlyphHeight)
+			{
+				m_RowBits[nRow][i * 7 / nGlyphHeight] |= (u64) 1 << (y0 + i);
+			}
+			m_RowMask[nRow] |= (u64) 1 << (y0 + i);
+		}
+	}
+
+	for (unsigned nGlyph = 8; nGlyph < Glyphs; nGlyph++)
+	{
+		BuildGlyph (nGlyph, lcd_font[nGlyph - 8]);
+	}
+
+	if (m_pI2CMaster != 0)
+	{
+		// horizontal addressing, so that a run of a page is one transfer
+		u8 uchSegmentRemap = m_bRotate == m_bMirror ? 0xA1 : 0xA0;
+		u8 uchCOMScan = m_bRotate ? 0xC0 : 0xC8;
+		const u8 Setup[] = {0x00, 0x20, 0x00, uchSegmentRemap, uchCOMScan};
+		if (m_pI2CMaster->Write (m_ucSSD1306Address, Setup, sizeof Setup) != (int) sizeof Setup)
+		{
+			LOGWARN ("SSD1306 does not respond");
+
+			return false;
+		}
+	}
+	else
+	{
+		m_pPixels = new u16[m_nWidth * MAX_HEIGHT];
+	}
+
+	LOGNOTE ("LCD on %ux%u pixels", m_nWidth, m_nHeight);
+
+	return true;
+}
+
+void CLCDGraphics::Update (const LCD *pLCD)
+{
+	assert (pLCD != 0);
+	assert (m_pColumns != 0);
+
+	// CG RAM characters that were redefined
+	unsigned nCGChanged = 0;
+	for (unsigned nChar = 0; nChar < 8; nChar++)
+	{
+		const u8 *pFont = &pLCD->LCD_CG[nChar * 8];
+		if (   !m_bShown
+		    || memcmp (&m_CG[nChar * 8], pFont, 8) != 0)
+		{
+			memcpy (&m_CG[nChar * 8], pFont, 8);
+			BuildGlyph (nChar, &m_CG[nChar * 8]);
+			nCGChanged |= 1 << nChar;
+		}
+	}
+
+	int nCursorCol = pLCD->LCD_DD_RAM % 0x40;
+	int nCursorRow = pLCD->LCD_DD_RAM / 0x40;
+	int nCursor = -1;
+	if (nCursorRow < lcd_rows && nCursorCol < lcd_cols && pLCD->LCD_C)
+	{
+		nCursor = nCursorRow * lcd_cols + nCursorCol;
+	}
+
+	bool bRendered = false;
+	for (unsigned nRow = 0; nRow < lcd_rows; nRow++)
+	{
+		for (unsigned nCol = 0; nCol < lcd_cols; nCol++)
+		{
+			u8 uchChar = pLCD->LCD_Data[nRow * 40 + nCol];
+			int nCell = nRow * lcd_cols + nCol;
+			if (   m_bShown
+			    && uchChar == m_Chars[nRow][nCol]
+			    && !(uchChar < 16 && (nCGChanged & (1 << (uchChar & 7))))
+			    && (nCell == nCursor) == (nCell == m_nCursor))
+			{
+				continue;
+			}
+
+			m_Chars[nRow][nCol] = uchChar;
+			RenderCell (nRow, nCol, uchChar, nCell == nCursor);
+			bRendered = true;
+		}
+	}
+	m_nCursor = nCursor;
+
+	if (!bRendered)
+	{
+		return;
+	}
+
+	if (m_pI2CMaster != 0)
+	{
+		SendSSD1306 ();
+	}
+	else
+	{
+		SendST7789 ();
+	}
+
+	m_bShown = true;
+}
+
+void CLCDGraphics::BuildGlyph (unsigned nGlyph, const u8 *pFont)
+{
+	for (unsigned nRow = 0; nRow < lcd_rows; nRow++)
+	{
+		for (unsigned nDot = 0; nDot < 5; nDot++)
+		{
+			u64 ulBits = 0;
+			for (unsigned k = 0; k < 7; k++)
+			{
+				if (pFont[k] & (1 << (4 - nDot)))
+				{
+					ulBits |= m_RowBits[nRow][k];
+				}
+			}
+
+			m_pGlyph[nRow][nGlyph][nDot] = ulBits;
+		}
+	}
+}
+
+void CLCDGraphics::RenderCell (unsigned nRow, unsigned nCol, u8 uchChar, bool bCursor)
+{
+	const u64 *pDots = m_pGlyph[nRow][uchChar >= 16 ? uchChar - 16 + 8 : uchChar & 7];
+	const u64 *pCursor = m_pGlyph[nRow][GLYPH_CURSOR];
+
+	unsigned x0 = nCol * m_nWidth / lcd_cols;
+	unsigned x1 = (nCol + 1) * m_nWidth / lcd_cols;
+	for (unsigned x = x0; x < x1; x++)
+	{
+		u64 ulBits = 0;
+		if (m_pXMap[x] != XMAP_GAP)
+		{
+			unsigned nDot = m_pXMap[x] & 0xFF;
+			ulBits = pDots[nDot];
+			if (bCursor)
+			{
+				ulBits |= pCursor[nDot];
+			}
+		}
+
+		m_pColumns[x] = (m_pColumns[x] & ~m_RowMask[nRow]) | ulBits;
+	}
+}
+
+void CLCDGraphics::SendSSD1306 (void)
+{
+	assert (m_nWidth <= SSD1306_MAX_WIDTH);
+
+	for (unsigned nPage = 0; nPage < m_nHeight / 8; nPage++)
+	{
+		// the first time the text the display had shows through otherwise
+		unsigned nShift = nPage * 8;
+		unsigned x0 = 0;
+		unsigned x1 = m_nWidth;
+		if (m_bShown)
+		{
+			while (   x0 < m_nWidth
+			       && ((m_pColumns[x0] ^ m_pSent[x0]) >> nShift & 0xFF) == 0)
+			{
+				x0++;
+			}
+			while (   x1 > x0
+			       && ((m_pColumns[x1 - 1] ^ m_pSent[x1 - 1]) >> nShift & 0xFF) == 0)
+			{
+				x1--;
+			}
+		}
+		if (x0 == x1)
+		{
+			continue;
+		}
+
+		const u8 Address[] = {0x00, 0x21, (u8) x0, (u8) (x1 - 1), 0x22, (u8) nPage, (u8) nPage};
+		m_pI2CMaster->Write (m_ucSSD1306Address, Address, sizeof Address);
+
+		u8 Data[1 + SSD1306_MAX_WIDTH];
+		Data[0] = 0x40;
+		for (unsigned x = x0; x < x1; x++)
+		{
+			Data[1 + x - x0] = (u8) (m_pColumns[x] >> nShift);
+
+			u64 ulMask = (u64) 0xFF << nShift;
+			m_pSent[x] = (m_pSent[x] & ~ulMask) | (m_pColumns[x] & ulMask);
+		}
+		m_pI2CMaster->Write (m_ucSSD1306Address, Data, 1 + x1 - x0);
+	}
+}
+
+void CLCDGraphics::SendST7789 (void)
+{
+	assert (m_pST7789Display != 0);
+
+	if (!m_bShown)
+	{
+		// clear the text below the LCD
+		unsigned nHeight = m_pST7789Display->GetHeight ();
+		for (unsigned y = m_nHeight; y < nHeight; y += MAX_HEIGHT)
+		{
+			unsigned y2 = y + MAX_HEIGHT <= nHeight ? y + MAX_HEIGHT - 1 : nHeight - 1;
+			SendST7789Area (0, m_nWidth - 1, y, y2, true);
+		}
+
+		SendST7789Area (0, m_nWidth - 1, 0, m_nHeight - 1, false);
+
+		return;
+	}
+
+	// the runs of changed columns
+	unsigned x = 0;
+	while (x < m_nWidth)
+	{
+		if (m_pColumns[x] == m_pSent[x])
+		{
+			x++;
+			continue;
+		}
+
+		unsigned x1 = x;
+		for (unsigned i = x + 1; i < m_nWidth && i <= x1 + ST7789_MERGE_GAP; i++)
+		{
+			if (m_pColumns[i] != m_pSent[i])
+			{
+				x1 = i;
+			}
+		}
+
+		SendST7789Area (x, x1, 0, m_nHeight - 1, false);
+		x = x1 + 1;
+	}
+}
+
+void CLCDGraphics::SendST7789Area (unsigned nX1, unsigned nX2, unsigned nY1, unsigned nY2,
+				   bool bClear)
+{
+	assert (m_pPixels != 0);
+	assert (nY2 - nY1 < MAX_HEIGHT);
+
+	const u16 usOn = ST7789Color (lcd_col1);
+	const u16 usOff = ST7789Color (lcd_col3);
+
+	u16 *pPixel = m_pPixels;
+	for (unsigned y = nY1; y <= nY2; y++)
+	{
+		for (unsigned x = nX1; x <= nX2; x++)
+		{
+			*pPixel++ = !bClear && (m_pColumns[x] >> y & 1) ? usOn : usOff;
+		}
+	}
+
+	if (!bClear)
+	{
+		memcpy (m_pSent + nX1, m_pColumns + nX1, (nX2 - nX1 + 1) * sizeof (u64));
+	}
+
+	CDisplay::TArea Area;
+	Area.x1 = nX1;
+	Area.x2 = nX2;
+	Area.y1 = nY1;
+	Area.y2 = nY2;
+	m_pST7789Display->SetArea (Area, m_pPixels);
+}
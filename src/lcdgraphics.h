@@ -0,0 +1,86 @@
+//
+// lcdgraphics.h
+//
+// Draws the emulated JV-880 LCD dot for dot on a small graphic display
+// (SSD1306 OLED or ST7789), instead of its text. The 24x2 characters are
+// mapped to the display resolution once; every 5x7 glyph is kept as
+// bitmaps of its dot columns at that resolution. An update redraws the
+// cells that changed and sends only the changed part of the display.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _lcdgraphics_h
+#define _lcdgraphics_h
+
+#include "emulator/lcd.h"
+#include <display/st7789device.h>
+#include <circle/i2cmaster.h>
+#include <circle/types.h>
+
+class CLCDGraphics
+{
+public:
+	// the controller must have been initialized by CSSD1306Device
+	CLCDGraphics (CI2CMaster *pI2CMaster, u8 ucSSD1306Address,
+		      unsigned nWidth, unsigned nHeight, bool bRotate, bool bMirror);
+	// the LCD is drawn at the top, a quarter as high as wide
+	CLCDGraphics (CST7789Display *pST7789Display);
+	~CLCDGraphics (void);
+
+	bool Initialize (void);
+
+	// redraws what has changed since the last call
+	void Update (const LCD *pLCD);
+
+private:
+	void BuildGlyph (unsigned nGlyph, const u8 *pFont);
+	void RenderCell (unsigned nRow, unsigned nCol, u8 uchChar, bool bCursor);
+
+	void SendSSD1306 (void);
+	void SendST7789 (void);
+	void SendST7789Area (unsigned nX1, unsigned nX2, unsigned nY1, unsigned nY2, bool bClear);
+
+private:
+	CI2CMaster *m_pI2CMaster;
+	u8 m_ucSSD1306Address;
+	bool m_bRotate;
+	bool m_bMirror;
+	CST7789Display *m_pST7789Display;
+
+	unsigned m_nWidth;
+	unsigned m_nHeight;		// of the LCD, at most 64
+
+	// for each x: (column << 8) | dot, or 0xFFFF between two characters
+	u16 *m_pXMap;
+	// the y bits of each dot row of both character rows
+	u64 m_RowBits[lcd_rows][7];
+	u64 m_RowMask[lcd_rows];
+
+	// the dot columns of every glyph at the display resolution: the 8 CG
+	// RAM characters, then lcd_font from code 16 on
+	static const unsigned Glyphs = 8 + 240;
+	u64 (*m_pGlyph)[Glyphs][5];
+
+	// what is drawn, a word of y bits per x
+	u64 *m_pColumns;
+	u64 *m_pSent;			// what the display shows
+	u8 m_Chars[lcd_rows][lcd_cols];
+	u8 m_CG[64];
+	int m_nCursor;
+	bool m_bShown;
+
+	u16 *m_pPixels;			// for the ST7789
+};
+
+#endif
@@ -23,9 +23,11 @@
 #include <circle/gpiopin.h>
 #include <circle/logger.h>
 #include <circle/memory.h>
+#include <circle/timer.h>
 #include <circle/sound/hdmisoundbasedevice.h>
 #include <circle/sound/i2ssoundbasedevice.h>
 #include <circle/sound/pwmsoundbasedevice.h>
+#include <circle/synchronize.h>
 #include <circle/usb/usbmidihost.h>
 #include <stdio.h>
 #include <string.h>
@@ -34,13 +36,82 @@ CMiniJV880 *CMiniJV880::s_pThis = 0;
 
 LOGMODULE("minijv880");
 
+// Let the generic timer generate an event every 2^16 counter ticks (about
+// 1 to 3 ms depending on the model), so a missed wakeup never stalls the
+// render loop for long. This only affects the calling core.
+static void EnableTimerEventStream(void) {
+#if AARCH == 64
+  u64 nCNTKCTL;
+  asm volatile("mrs %0, cntkctl_el1" : "=r"(nCNTKCTL));
+  nCNTKCTL = (nCNTKCTL & ~0xF0UL) | (15 << 4) | (1 << 2); // EVNTI, EVNTEN
+  asm volatile("msr cntkctl_el1, %0" : : "r"(nCNTKCTL));
+#else
+  u32 nCNTKCTL;
+  asm volatile("mrc p15, 0, %0, c14, c1, 0" : "=r"(nCNTKCTL));
+  nCNTKCTL = (nCNTKCTL & ~0xF0U) | (15 << 4) | (1 << 2);
+  asm volatile("mcr p15, 0, %0, c14, c1, 0" : : "r"(nCNTKCTL));
+#endif
+  asm volatile("isb");
+}
+
+// Identifies a card or expansion image for the snapshot by its name, size
+// and time stamp, so that a snapshot can be checked before the images,
+// which load in the background, have been read. 0 without one.
+static u64 WaveROMIdentity(const char *pFileName) {
+  if (*pFileName == '\0')
+    return 0;
+
+  u64 nHash = SNAPSHOT_Hash(pFileName, strlen(pFileName));
+  FILINFO Info;
+  if (f_stat(pFileName, &Info) == FR_OK) {
+    nHash = SNAPSHOT_Hash(&Info.fsize, sizeof Info.fsize, nHash);
+    nHash = SNAPSHOT_Hash(&Info.fdate, sizeof Info.fdate, nHash);
+    nHash = SNAPSHOT_Hash(&Info.ftime, sizeof Info.ftime, nHash);
+  }
+  return nHash;
+}
+
 CMiniJV880::CMiniJV880(CConfig *pConfig, CInterruptSystem *pInterrupt,
                        CGPIOManager *pGPIOManager, CI2CMaster *pI2CMaster, CSPIMaster *pSPIMaster,
                        FATFS *pFileSystem, CScreenDevice *mScreenUnbuffered)
     : CMultiCoreSupport(CMemorySystem::Get()), m_pConfig(pConfig),
       m_pFileSystem(pFileSystem), m_pSoundDevice(0),
       m_bChannelsSwapped(pConfig->GetChannelsSwapped()),
+      m_bOversampling(pConfig->GetOversampling()),
+      m_bResamplerOversampling(m_bOversampling),
+      m_nSoundFormat(AUDIO_FORMAT_S16),
       screenUnbuffered(mScreenUnbuffered),
+      m_SerialMIDI(pInterrupt, pConfig, &m_SerialMIDIQueue),
+      m_pRomSet(0),
+      m_WaveROMLoadState(WaveROMLoadIdle),
+      m_nWaveROMLoad(0),
+      m_pWaveROMImage(0),
+      m_nWaveROMSize(0),
+      m_nWaveROMRead(0),
+      m_bWaveROMLoaded(false),
+      m_SnapshotState(SnapshotNone),
+      m_pSnapshot(0),
+      m_nSnapshotSize(0),
+      m_nBootTicks(0),
+      m_pNVRAMJournal(0),
+      m_NVRAMState(NVRAMIdle),
+      m_nNVRAMTicks(0),
+      m_pHDMILCD(0),
+      m_pSecondMCU(0),
+      m_bMIDISplit(strcmp(pConfig->GetInstanceMIDI(), "all") != 0),
+      m_nSecondSamples(0),
+      m_bSecondOversampling(false),
+      m_nSecondRequest(0),
+      m_nSecondDone(0),
+      m_nMIDIOutSysExLength(0),
+      m_nMIDIOutSerialLength(0),
+      m_Latency(pConfig->GetSampleRate(), pConfig->GetChunkSizeMin() / 2,
+                pConfig->GetChunkSizeMax() / 2,
+                pConfig->GetAdaptiveChunkSize()),
+      m_nLastUnderruns(0),
+      m_nLastNearMisses(0),
+      m_nLastTelemetryTicks(0),
+      m_nLastProfileTicks(0),
       m_UI(this, pGPIOManager, pI2CMaster, pSPIMaster, pConfig),
       m_lastTick(0),
       m_lastTick1(0) {
@@ -48,12 +119,22 @@ CMiniJV880::CMiniJV880(CConfig *pConfig, CInterruptSystem *pInterrupt,
 
   s_pThis = this;
 
+  for (unsigned i = 0; i < MCU_REGIONS; i++)
+    m_pNVRAMImage[i] = 0;
+  memset(m_NVRAMPages, 0, sizeof m_NVRAMPages);
+
+  const char *pMIDIOut = pConfig->GetMIDIOutDevice();
+  m_bMIDIOutUSB =
+      strcmp(pMIDIOut, "usb") == 0 || strcmp(pMIDIOut, "both") == 0;
+  m_bMIDIOutSerial =
+      strcmp(pMIDIOut, "serial") == 0 || strcmp(pMIDIOut, "both") == 0;
+
   // select the sound device
   const char *pDeviceName = pConfig->GetSoundDevice();
   if (strcmp(pDeviceName, "i2s") == 0) {
     LOGNOTE("I2S mode");
     m_pSoundDevice = new CI2SSoundBaseDevice(
-        pInterrupt, 32000, pConfig->GetChunkSize(), false, pI2CMaster,
+        pInterrupt, pConfig->GetSampleRate(), pConfig->GetChunkSize(), false, pI2CMaster,
         pConfig->GetDACI2CAddress(), CI2SSoundBaseDevice::DeviceModeTXOnly,
         2); // 2 channels - L+R
   } else if (strcmp(pDeviceName, "hdmi") == 0) {
@@ -63,7 +144,8 @@ CMiniJV880::CMiniJV880(CConfig *pConfig, CInterruptSystem *pInterrupt,
     LOGNOTE("HDMI mode");
 
     m_pSoundDevice =
-        new CHDMISoundBaseDevice(pInterrupt, 32000, pConfig->GetChunkSize());
+        new CHDMISoundBaseDevice(pInterrupt, pConfig->GetSampleRate(),
+                                 pConfig->GetChunkSize());
 
     // The channels are swapped by default in the HDMI sound driver.
     // TODO: Remove this line, when this has been fixed in the driver.
@@ -73,7 +155,8 @@ CMiniJV880::CMiniJV880(CConfig *pConfig, CInterruptSystem *pInterrupt,
     LOGNOTE("PWM mode");
 
     m_pSoundDevice =
-        new CPWMSoundBaseDevice(pInterrupt, 32000, pConfig->GetChunkSize());
+        new CPWMSoundBaseDevice(pInterrupt, pConfig->GetSampleRate(),
+                                pConfig->GetChunkSize());
   }
 };
 
@@ -87,6 +170,11 @@ bool CMiniJV880::Initialize(void) {
 		return false;
 	}
 
+  if (!m_SerialMIDI.Initialize()) {
+    LOGERR("Failed to initialize serial MIDI");
+    return false;
+  }
+
   LOGNOTE("Loading emu files");
   uint8_t *rom1 = (uint8_t *)malloc(ROM1_SIZE);
   uint8_t *rom2 = (uint8_t *)malloc(ROM2_SIZE);
@@ -129,34 +217,175 @@ bool CMiniJV880::Initialize(void) {
   f_close(&f);
   LOGNOTE("Emu files loaded");
 
-  int ret = mcu.startSC55(rom1, rom2, pcm1, pcm2, nvram);
-  LOGNOTE("startSC55 returned: %d", ret);
+  // card and expansion images follow in the background, see
+  // ProcessWaveROMLoad ()
+  m_pRomSet = RomSet::ROMSET_Create(rom1, rom2, pcm1, pcm2);
   free(rom1);
   free(rom2);
-  free(nvram);
   free(pcm1);
   free(pcm2);
+  if (m_pRomSet == 0) {
+    free(nvram);
+    LOGERR("Cannot allocate ROM set");
+    return false;
+  }
+
+  int ret = mcu.startSC55(m_pRomSet, nvram);
+  LOGNOTE("startSC55 returned: %d", ret);
+
+  if (m_pConfig->GetInstances() > 1) {
+    m_pSecondMCU = new MCU;
+    m_pSecondMCU->startSC55(m_pRomSet, nvram);
+    LOGNOTE("Second instance started, MIDI %s",
+            m_bMIDISplit ? "split" : "to all instances");
+  }
+
+  m_SnapshotImages.nvram = SNAPSHOT_Hash(nvram, NVRAM_SIZE);
+  free(nvram);
+
+  const char *pSnapshot = m_pConfig->GetSnapshot();
+  if (*pSnapshot != '\0') {
+    m_SnapshotImages.card = WaveROMIdentity(m_pConfig->GetWaveROMCard());
+    m_SnapshotImages.expansion =
+        WaveROMIdentity(m_pConfig->GetWaveROMExpansion());
+
+    m_nSnapshotSize = SNAPSHOT_Size(&mcu);
+    m_pSnapshot = (u8 *)malloc(m_nSnapshotSize);
+
+    bool bRestored = false;
+    if (f_open(&f, pSnapshot, FA_READ | FA_OPEN_EXISTING) == FR_OK) {
+      f_read(&f, m_pSnapshot, m_nSnapshotSize, &nBytesRead);
+      f_close(&f);
+
+      bRestored = SNAPSHOT_Load(&mcu, m_SnapshotImages, m_pSnapshot,
+                                nBytesRead);
+      if (bRestored && m_pSecondMCU != 0)
+        SNAPSHOT_Load(m_pSecondMCU, m_SnapshotImages, m_pSnapshot, nBytesRead);
+      if (!bRestored)
+        LOGWARN("%s does not match this version, the ROMs or the images",
+                pSnapshot);
+    }
+
+    if (bRestored) {
+      LOGNOTE("Restored %s", pSnapshot);
+      free(m_pSnapshot);
+      m_pSnapshot = 0;
+    } else {
+      m_SnapshotState = SnapshotWait;
+    }
+  }
+
+  // after the snapshot, which holds the card RAM of when it was taken
+  const char *pCardRAM = m_pConfig->GetCardRAM();
+  if (*pCardRAM != '\0') {
+    u8 *pCardImage = (u8 *)malloc(CARDRAM_SIZE);
+    memset(pCardImage, 0, CARDRAM_SIZE);
+    if (f_open(&f, pCardRAM, FA_READ | FA_OPEN_EXISTING) == FR_OK) {
+      f_read(&f, pCardImage, CARDRAM_SIZE, &nBytesRead);
+      f_close(&f);
+
+      mcu.MCU_LoadCardRAM(pCardImage);
+      if (m_pSecondMCU != 0)
+        m_pSecondMCU->MCU_LoadCardRAM(pCardImage);
+      LOGNOTE("Card RAM %s loaded", pCardRAM);
+    } else {
+      LOGWARN("Cannot open %s", pCardRAM);
+    }
+    free(pCardImage);
+  }
+
+  for (unsigned i = 0; i < 2; i++) {
+    if (!m_Resampler[i].RESAMPLER_Init(32000 << i, m_pConfig->GetSampleRate(),
+                                       m_pConfig->GetResamplerQuality(),
+                                       audio_buffer_size / 2)) {
+      LOGERR("Sample rate %u not supported", m_pConfig->GetSampleRate());
+      return false;
+    }
+  }
 
   // setup and start the sound device
-  int Channels = 2; // 16-bit Stereo
+  int Channels = 2; // Stereo
   // Need 2 x ChunkSize / Channel queue frames as the audio driver uses
   // two DMA channels each of ChunkSize and one single single frame
-  // contains a sample for each of all the channels.
+  // contains a sample for each of all the channels. The render chunk may
+  // grow up to ChunkSizeMax, so size the queue for that.
   //
   // See discussion here: https://github.com/rsta2/circle/discussions/453
-  if (!m_pSoundDevice->AllocateQueueFrames(2 * m_pConfig->GetChunkSize() /
+  if (!m_pSoundDevice->AllocateQueueFrames(2 * m_pConfig->GetChunkSizeMax() /
                                            Channels)) {
     LOGERR("Cannot allocate sound queue");
 
     return false;
   }
 
-  m_pSoundDevice->SetWriteFormat(SoundFormatSigned16, Channels);
+  // Circle has no float write format, the 24 bits of s24_32 hold all of
+  // the PCM's resolution anyway
+  m_nSoundFormat = AUDIO_ParseFormat(m_pConfig->GetSoundFormat());
+  if (m_nSoundFormat == AUDIO_FORMAT_F32) {
+    LOGWARN("Sound format f32 not supported by the device, using s24_32");
+    m_nSoundFormat = AUDIO_FORMAT_S24_32;
+  } else if (m_nSoundFormat < 0) {
+    LOGWARN("Unknown sound format %s", m_pConfig->GetSoundFormat());
+    m_nSoundFormat = AUDIO_FORMAT_S16;
+  }
+
+  m_pSoundDevice->SetWriteFormat(m_nSoundFormat == AUDIO_FORMAT_S16
+                                     ? SoundFormatSigned16
+                                     : SoundFormatSigned24_32,
+                                 Channels);
 
   m_nQueueSizeFrames = m_pSoundDevice->GetQueueSizeFrames();
 
+  m_pSoundDevice->RegisterNeedDataCallback(SoundNeedDataHandler, this);
+
   m_pSoundDevice->Start();
 
+  // after the snapshot, the journal holds newer changes
+  const char *pJournal = m_pConfig->GetNVRAMJournal();
+  if (*pJournal != '\0') {
+    unsigned nRegionMask = 1 << MCU_REGION_NVRAM;
+    if (*m_pConfig->GetCardRAM() != '\0')
+      nRegionMask |= 1 << MCU_REGION_CARDRAM;
+    if (m_pConfig->GetPersistSRAM())
+      nRegionMask |= 1 << MCU_REGION_SRAM;
+
+    m_pNVRAMJournal = new CNVRAMJournal(pJournal, nRegionMask);
+    if (m_pNVRAMJournal->Initialize(&mcu)) {
+      if (m_pSecondMCU != 0)
+        m_pNVRAMJournal->Restore(m_pSecondMCU);
+
+      for (unsigned i = 0; i < MCU_REGIONS; i++) {
+        if (nRegionMask & (1 << i))
+          m_pNVRAMImage[i] = (u8 *)malloc(MCU_REGION_SIZE);
+      }
+
+      // the RAMs are what the journal holds now
+      memset(mcu.dirty_pages, 0, sizeof mcu.dirty_pages);
+    } else {
+      LOGWARN("RAM contents will not be saved");
+      delete m_pNVRAMJournal;
+      m_pNVRAMJournal = 0;
+    }
+  }
+
+  if (m_pConfig->GetHDMILCDEnabled()) {
+    m_pHDMILCD = new CHDMILCD(screenUnbuffered, &mcu.lcd,
+                              m_pConfig->GetHDMILCDScale(),
+                              m_pConfig->GetHDMILCDFrameRate());
+    if (!m_pHDMILCD->Initialize()) {
+      delete m_pHDMILCD;
+      m_pHDMILCD = 0;
+    }
+  }
+
+  m_nBootTicks = CTimer::GetClockTicks();
+  m_nNVRAMTicks = m_nBootTicks;
+
+#ifndef JV880_PROFILE
+  if (m_pConfig->GetProfileEnabled())
+    LOGWARN("ProfileEnabled needs a build with PROFILE=1");
+#endif
+
   CMultiCoreSupport::Initialize();
   LOGNOTE("initialised");
 
@@ -167,6 +396,14 @@ void CMiniJV880::Process(bool bPlugAndPlayUpdated) {
 
   m_UI.Process ();
 
+  m_SerialMIDI.Process();
+  ProcessMIDIOut();
+  ProcessAudioTelemetry();
+  ProcessProfile();
+  ProcessWaveROMLoad();
+  ProcessSnapshot();
+  ProcessNVRAMJournal();
+
   if (!bPlugAndPlayUpdated)
     return;
 
@@ -180,11 +417,289 @@ void CMiniJV880::Process(bool bPlugAndPlayUpdated) {
   }
 }
 
+void CMiniJV880::SetOversampling(bool bOversampling) {
+  if (bOversampling == m_bOversampling)
+    return;
+  m_bOversampling = bOversampling;
+  LOGNOTE("Oversampling %s", bOversampling ? "on" : "off");
+
+  if (!m_pConfig->SaveOversampling(bOversampling))
+    LOGWARN("Cannot save Oversampling to minijv880.ini");
+}
+
+void CMiniJV880::ProcessMIDIOut(void) {
+  // what the serial port did not take goes first; until it has, nothing
+  // more is read, so the full ring holds the emulated UART back
+  if (m_nMIDIOutSerialLength > 0) {
+    int nResult = m_SerialMIDI.Write(m_MIDIOutSerial, m_nMIDIOutSerialLength);
+    if (nResult > 0) {
+      m_nMIDIOutSerialLength -= nResult;
+      memmove(m_MIDIOutSerial, m_MIDIOutSerial + nResult,
+              m_nMIDIOutSerialLength);
+    }
+    if (m_nMIDIOutSerialLength > 0)
+      return;
+  }
+
+  u8 Buffer[sizeof m_MIDIOutSerial];
+  unsigned nLength = m_MIDITxRing.MIDI_Read(Buffer, sizeof Buffer);
+  if (nLength == 0)
+    return;
+
+  if (m_bMIDIOutSerial) {
+    int nResult = m_SerialMIDI.Write(Buffer, nLength);
+    unsigned nWritten = nResult > 0 ? nResult : 0;
+    m_nMIDIOutSerialLength = nLength - nWritten;
+    memcpy(m_MIDIOutSerial, Buffer + nWritten, m_nMIDIOutSerialLength);
+  }
+
+  if (!m_bMIDIOutUSB)
+    return;
+
+  m_MIDIOutParser.MIDI_Parse(Buffer, nLength, 0, &m_MIDIOutQueue);
+
+  const midi_event_t *pEvent;
+  while ((pEvent = m_MIDIOutQueue.MIDI_Peek()) != 0) {
+    CUSBMIDIDevice *pMIDIDevice = m_pMIDIDevice;
+
+    if (pEvent->data[0] == 0xF0)
+      m_nMIDIOutSysExLength = 0;
+
+    if (pEvent->data[0] < 0x80 || pEvent->data[0] == 0xF0 ||
+        pEvent->data[pEvent->length - 1] == 0xF7) {
+      // SysEx is collected and sent in one piece
+      if (m_nMIDIOutSysExLength + pEvent->length <= sizeof m_MIDIOutSysEx) {
+        memcpy(m_MIDIOutSysEx + m_nMIDIOutSysExLength, pEvent->data,
+               pEvent->length);
+      }
+      m_nMIDIOutSysExLength += pEvent->length;
+
+      if (pEvent->data[pEvent->length - 1] == 0xF7) {
+        if (m_nMIDIOutSysExLength > sizeof m_MIDIOutSysEx)
+          LOGWARN("SysEx of %u bytes too long for USB", m_nMIDIOutSysExLength);
+        else if (pMIDIDevice != 0)
+          pMIDIDevice->SendPlainMIDI(0, m_MIDIOutSysEx, m_nMIDIOutSysExLength);
+        m_nMIDIOutSysExLength = 0;
+      }
+    } else if (pMIDIDevice != 0) {
+      pMIDIDevice->SendPlainMIDI(0, pEvent->data, pEvent->length);
+    }
+
+    m_MIDIOutQueue.MIDI_Pop();
+  }
+}
+
+void CMiniJV880::ProcessAudioTelemetry(void) {
+  unsigned nTicks = CTimer::GetClockTicks();
+  if (nTicks - m_nLastTelemetryTicks < 5 * CLOCKHZ)
+    return;
+  m_nLastTelemetryTicks = nTicks;
+
+  unsigned nUnderruns = m_Latency.GetUnderruns();
+  unsigned nNearMisses = m_Latency.GetNearMisses();
+  if (nUnderruns == m_nLastUnderruns && nNearMisses == m_nLastNearMisses)
+    return;
+
+  LOGNOTE("Audio: %u underruns, %u near misses, chunk %u frames, peak load "
+          "%u%%",
+          nUnderruns - m_nLastUnderruns, nNearMisses - m_nLastNearMisses,
+          m_Latency.GetChunkFrames(), m_Latency.GetPeakLoad());
+
+  m_nLastUnderruns = nUnderruns;
+  m_nLastNearMisses = nNearMisses;
+  m_Latency.ResetPeakLoad();
+}
+
+// Logs where the emulator cores spent their time since the last report
+void CMiniJV880::ProcessProfile(void) {
+#ifdef JV880_PROFILE
+  if (!m_pConfig->GetProfileEnabled())
+    return;
+
+  unsigned nTicks = CTimer::GetClockTicks();
+  if (nTicks - m_nLastProfileTicks < 10 * CLOCKHZ)
+    return;
+  m_nLastProfileTicks = nTicks;
+
+  MCU *const pMCUs[] = {&mcu, m_pSecondMCU};
+  for (unsigned i = 0; i < 2 && pMCUs[i] != 0; i++) {
+    // updated by another core, the report may be off by a chunk
+    Profile Current = pMCUs[i]->profile;
+    Profile Interval;
+    Interval.PROFILE_Diff(Current, m_LastProfile[i]);
+    m_LastProfile[i] = Current;
+
+    char Report[512];
+    Interval.PROFILE_Format(Report, sizeof Report);
+    for (char *pLine = Report; *pLine != '\0';) {
+      char *pEnd = strchr(pLine, '\n');
+      if (pEnd != 0)
+        *pEnd = '\0';
+      LOGNOTE("Profile %u: %s", i + 1, pLine);
+      if (pEnd == 0)
+        break;
+      pLine = pEnd + 1;
+    }
+  }
+#endif
+}
+
+void CMiniJV880::ProcessWaveROMLoad(void) {
+  switch (m_WaveROMLoadState.load(std::memory_order_acquire)) {
+  case WaveROMLoadIdle: {
+    const char *pFileName = 0;
+    for (; m_nWaveROMLoad < 2; m_nWaveROMLoad++) {
+      pFileName = m_nWaveROMLoad == 0 ? m_pConfig->GetWaveROMCard()
+                                      : m_pConfig->GetWaveROMExpansion();
+      if (*pFileName != '\0')
+        break;
+    }
+    if (m_nWaveROMLoad == 2) {
+      m_WaveROMLoadState.store(WaveROMLoadFinished, std::memory_order_release);
+      DataSyncBarrier();
+      SendEvent();
+      break;
+    }
+
+    if (f_open(&m_WaveROMFile, pFileName, FA_READ | FA_OPEN_EXISTING) !=
+        FR_OK) {
+      LOGERR("Cannot open %s", pFileName);
+      m_nWaveROMLoad++;
+      break;
+    }
+
+    m_nWaveROMSize = m_nWaveROMLoad == 0 ? WAVEROM_SIZE : WAVEROM_EXP_SIZE;
+    m_pWaveROMImage = (u8 *)malloc(m_nWaveROMSize);
+    if (m_pWaveROMImage == 0) {
+      LOGERR("Cannot allocate %u bytes for %s", m_nWaveROMSize, pFileName);
+      f_close(&m_WaveROMFile);
+      m_nWaveROMLoad++;
+      break;
+    }
+
+    // a shorter image (e.g. a 4 MiB board) reads as zeros at the end
+    memset(m_pWaveROMImage, 0, m_nWaveROMSize);
+    m_nWaveROMRead = 0;
+    m_WaveROMLoadState.store(WaveROMLoadReading, std::memory_order_relaxed);
+  } break;
+
+  case WaveROMLoadReading: {
+    // small reads, so that the UI and MIDI OUT keep running
+    unsigned nChunk = m_nWaveROMSize - m_nWaveROMRead;
+    if (nChunk > 0x10000)
+      nChunk = 0x10000;
+
+    unsigned nBytesRead = 0;
+    if (f_read(&m_WaveROMFile, m_pWaveROMImage + m_nWaveROMRead, nChunk,
+               &nBytesRead) != FR_OK ||
+        nBytesRead < nChunk)
+      m_nWaveROMRead = m_nWaveROMSize;
+    else
+      m_nWaveROMRead += nBytesRead;
+
+    if (m_nWaveROMRead == m_nWaveROMSize) {
+      f_close(&m_WaveROMFile);
+      m_WaveROMLoadState.store(WaveROMLoadUnscramble,
+                               std::memory_order_release);
+      DataSyncBarrier();
+      SendEvent();
+    }
+  } break;
+
+  case WaveROMLoadDone:
+    free(m_pWaveROMImage);
+    m_pWaveROMImage = 0;
+
+    if (m_bWaveROMLoaded)
+      LOGNOTE("%s wave ROM enabled",
+              m_nWaveROMLoad == 0 ? "Card" : "Expansion");
+    else
+      LOGERR("Cannot allocate %s wave ROM",
+             m_nWaveROMLoad == 0 ? "card" : "expansion");
+
+    m_nWaveROMLoad++;
+    m_WaveROMLoadState.store(WaveROMLoadIdle, std::memory_order_relaxed);
+    break;
+
+  default:
+    break;
+  }
+}
+
+void CMiniJV880::ProcessSnapshot(void) {
+  switch (m_SnapshotState.load(std::memory_order_acquire)) {
+  case SnapshotWait:
+    // by then the firmware has booted and shows the patch; the card and
+    // expansion must be in, as the snapshot claims them
+    if (CTimer::GetClockTicks() - m_nBootTicks >= 5 * CLOCKHZ &&
+        m_WaveROMLoadState.load(std::memory_order_acquire) ==
+            WaveROMLoadFinished)
+      m_SnapshotState.store(SnapshotRequested, std::memory_order_release);
+    break;
+
+  case SnapshotTaken: {
+    const char *pSnapshot = m_pConfig->GetSnapshot();
+    FIL File;
+    unsigned nBytesWritten = 0;
+    if (f_open(&File, pSnapshot, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK) {
+      f_write(&File, m_pSnapshot, m_nSnapshotSize, &nBytesWritten);
+      f_close(&File);
+    }
+    if (nBytesWritten == m_nSnapshotSize)
+      LOGNOTE("Saved %s", pSnapshot);
+    else
+      LOGERR("Cannot write %s", pSnapshot);
+
+    free(m_pSnapshot);
+    m_pSnapshot = 0;
+    m_SnapshotState.store(SnapshotNone, std::memory_order_relaxed);
+  } break;
+
+  default:
+    break;
+  }
+}
+
+void CMiniJV880::ProcessNVRAMJournal(void) {
+  if (m_pNVRAMJournal == 0)
+    return;
+
+  switch (m_NVRAMState.load(std::memory_order_acquire)) {
+  case NVRAMIdle:
+    // batches the writes of e.g. a SysEx bulk dump
+    if (CTimer::GetClockTicks() - m_nNVRAMTicks >= 2 * CLOCKHZ)
+      m_NVRAMState.store(NVRAMRequested, std::memory_order_release);
+    break;
+
+  case NVRAMTaken:
+    for (unsigned i = 0; i < MCU_REGIONS; i++) {
+      if (m_pNVRAMImage[i] != 0)
+        m_pNVRAMJournal->Write(i, m_NVRAMPages[i], m_pNVRAMImage[i]);
+    }
+    m_nNVRAMTicks = CTimer::GetClockTicks();
+    m_NVRAMState.store(NVRAMIdle, std::memory_order_relaxed);
+    break;
+
+  default:
+    break;
+  }
+}
+
 void CMiniJV880::USBMIDIMessageHandler(unsigned nCable, u8 *pPacket,
                                        unsigned nLength) {
   // LOGERR("CMiniJV880::USBMIDIMessageHandler");
   CMiniJV880 *pThis = static_cast<CMiniJV880 *>(s_pThis);
-  pThis->mcu.postMidiSC55(pPacket, nLength);
+  pThis->m_USBMIDIParser.MIDI_Parse(pPacket, nLength,
+                                    CTimer::GetClockTicks64(),
+                                    &pThis->m_USBMIDIQueue);
+}
+
+void CMiniJV880::SoundNeedDataHandler(void *pParam) {
+  // runs in the sound IRQ once the DMA has taken a chunk from the queue;
+  // core 2 sleeps in WFE until then and reads the queue level itself. The
+  // DSB before each SEV makes the stores it announces visible first.
+  DataSyncBarrier();
+  SendEvent();
 }
 
 void CMiniJV880::DeviceRemovedHandler(CDevice *pDevice, void *pContext) {
@@ -197,74 +712,175 @@ void CMiniJV880::DeviceRemovedHandler(CDevice *pDevice, void *pContext) {
     pThis->m_pMIDIDevice = 0;
 }
 
-// double avg = 0;
-// int cnt = 0;
 int nSamples = 0;
 
 void CMiniJV880::Run(unsigned nCore) {
   assert(1 <= nCore && nCore < CORES);
 
   if (nCore == 1) {
-    // while (true) {
-    //   if (m_pMIDIDevice != 0) {
-    //     assert(m_pMIDIDevice->hostDevice != 0);
-    //     m_pMIDIDevice->hostDevice->Update();
-    //   }
-    // }
+    // unscrambles the images read by ProcessWaveROMLoad ()
+    EnableTimerEventStream();
+
+    int nState;
+    while ((nState = m_WaveROMLoadState.load(std::memory_order_acquire)) !=
+           WaveROMLoadFinished) {
+      if (nState != WaveROMLoadUnscramble) {
+        WaitForEvent();
+        continue;
+      }
+
+      m_bWaveROMLoaded =
+          m_nWaveROMLoad == 0
+              ? m_pRomSet->ROMSET_LoadCard(m_pWaveROMImage)
+              : m_pRomSet->ROMSET_LoadExpansion(m_pWaveROMImage);
+
+      m_WaveROMLoadState.store(WaveROMLoadDone, std::memory_order_release);
+    }
+
+    if (m_pHDMILCD != 0)
+      m_pHDMILCD->Run();
     return;
   } else if (nCore == 2) {
     // emulator
+    EnableTimerEventStream();
+    Profile::PROFILE_Enable();
+
     while (true) {
+      // the first instance is between two chunks here
+      if (m_SnapshotState.load(std::memory_order_acquire) ==
+          SnapshotRequested) {
+        SNAPSHOT_Save(&mcu, m_SnapshotImages, m_pSnapshot, m_nSnapshotSize);
+        m_SnapshotState.store(SnapshotTaken, std::memory_order_release);
+      }
+      if (m_NVRAMState.load(std::memory_order_acquire) == NVRAMRequested) {
+        for (unsigned i = 0; i < MCU_REGIONS; i++) {
+          if (m_pNVRAMImage[i] != 0)
+            mcu.MCU_CollectDirtyPages(i, m_pNVRAMImage[i], m_NVRAMPages[i]);
+        }
+        m_NVRAMState.store(NVRAMTaken, std::memory_order_release);
+      }
+
+      unsigned nQueued = m_pSoundDevice->GetQueueFramesAvail();
       unsigned nFrames =
-          m_nQueueSizeFrames - m_pSoundDevice->GetQueueFramesAvail();
-      if (nFrames >= m_nQueueSizeFrames / 2) {
-        // unsigned int startT = CTimer::GetClockTicks();
-
-        nSamples = (int)nFrames * 2;
-        // Try on single core only RPi4
-        // mcu.updateSC55(nSamples);
-
-        mcu.sample_write_ptr = 0;
-        while (mcu.sample_write_ptr < nSamples) {
-          if (!mcu.mcu.ex_ignore)
-            mcu.MCU_Interrupt_Handle();
-          else
-            mcu.mcu.ex_ignore = 0;
-
-          if (!mcu.mcu.sleep)
-            mcu.MCU_ReadInstruction();
-
-          mcu.mcu.cycles += 12; // FIXME: assume 12 cycles per instruction
-
-          mcu.TIMER_Clock(mcu.mcu.cycles);
-          mcu.MCU_UpdateUART_RX();
-          mcu.MCU_UpdateUART_TX();
-          mcu.MCU_UpdateAnalog(mcu.mcu.cycles);
-          mcu.pcm.PCM_Update(mcu.mcu.cycles);
+          m_Latency.GetRenderFrames(nQueued, m_nQueueSizeFrames - nQueued);
+      if (nFrames > audio_buffer_size / 2)
+        nFrames = audio_buffer_size / 2;
+      if (nFrames == 0) {
+        // the queue is filled ahead by one chunk, nothing to do until the
+        // DMA has consumed some of it
+        WaitForEvent();
+      } else {
+        unsigned nStartTicks = CTimer::GetClockTicks();
+
+        // nFrames is at the device rate, the emulator renders at 32 kHz,
+        // or 64 kHz with two frames per PCM update
+        bool bOversampling = m_bOversampling;
+        Resampler *pResampler = &m_Resampler[bOversampling];
+        if (bOversampling != m_bResamplerOversampling) {
+          // its history is from the last time it was used
+          pResampler->RESAMPLER_Reset();
+          m_bResamplerOversampling = bOversampling;
+        }
+
+        unsigned nInFrames = pResampler->RESAMPLER_InputFrames(nFrames);
+        if (bOversampling)
+          nInFrames = (nInFrames + 1) & ~1U;
+        if (nInFrames > audio_buffer_size / 2)
+          nInFrames = audio_buffer_size / 2;
+        nSamples = (int)nInFrames * 2;
+
+        // the second instance is idle here, so its UART may be fed from
+        // this core
+        MidiQueue *const midiQueues[] = {&m_USBMIDIQueue, &m_SerialMIDIQueue};
+        unsigned nRequest = m_nSecondRequest.load(std::memory_order_relaxed);
+        if (m_pSecondMCU == 0) {
+          m_MIDIMerge.MIDI_Drain(midiQueues, 2, &mcu);
+        } else {
+          if (m_bMIDISplit) {
+            m_MIDIMerge.MIDI_Drain(&midiQueues[0], 1, &mcu);
+            m_SecondMIDIMerge.MIDI_Drain(&midiQueues[1], 1, m_pSecondMCU);
+          } else {
+            MCU *const pMCUs[] = {&mcu, m_pSecondMCU};
+            m_MIDIMerge.MIDI_Drain(midiQueues, 2, pMCUs, 2);
+          }
+
+          m_nSecondSamples = nSamples;
+          m_bSecondOversampling = bOversampling;
+          m_nSecondRequest.store(++nRequest, std::memory_order_release);
+          DataSyncBarrier();
+          SendEvent();
         }
 
-        // unsigned int endT = CTimer::GetClockTicks();
-        // avg = avg == 0 ? (endT - startT) : avg * 0.99 + (endT - startT) *
-        // 0.01; if (cnt++ == 100) {
-        //   LOGNOTE("%f\n", avg);
-        //   cnt = 0;
-        // }
+        RenderInstance(&mcu, nSamples, bOversampling);
 
-        int len = nSamples * sizeof(int16_t);
-        if (m_pSoundDevice->Write(mcu.sample_buffer, len) != len) {
-          LOGERR("Sound data dropped");
+        mcu.MCU_FlushUART_TX(&m_MIDITxRing);
+
+        if (m_pSecondMCU != 0) {
+          while (m_nSecondDone.load(std::memory_order_acquire) != nRequest)
+            WaitForEvent();
+
+          AUDIO_MixS32(m_pSecondMCU->sample_buffer, mcu.sample_buffer,
+                       nSamples);
+        }
+
+        PROFILE_START(mcu.profile);
+
+        const int32_t *pSamples = mcu.sample_buffer;
+        if (!pResampler->RESAMPLER_IsBypass()) {
+          nFrames = pResampler->RESAMPLER_Process(
+              mcu.sample_buffer, nInFrames, m_ResampleBuffer,
+              sizeof m_ResampleBuffer / (2 * sizeof(int32_t)));
+          pSamples = m_ResampleBuffer;
         }
+
+        // converted to the write format of the device here, so that its
+        // Write () only has to copy
+        AUDIO_Convert(m_nSoundFormat, pSamples, m_OutputBuffer, nFrames * 2);
+
+        int len = nFrames * 2 * AUDIO_BytesPerSample(m_nSoundFormat);
+        bool bDropped = m_pSoundDevice->Write(m_OutputBuffer, len) != len;
+        PROFILE_STAGE(mcu.profile, PROFILE_AUDIO_WRITE);
+
+        unsigned nRenderTicks = CTimer::GetClockTicks() - nStartTicks;
+        m_Latency.Update(nQueued, nFrames, nRenderTicks, bDropped);
+        // the queue would have run dry after the frames it still had
+        PROFILE_CHUNK(mcu.profile, nRenderTicks,
+                      (u64)nQueued * CLOCKHZ / m_pConfig->GetSampleRate());
       }
     }
     // LOGNOTE("%d samples in %d time", nFrames, m_GetChunkTimer);
   } else if (nCore == 3) {
-    // pcm chip
-    // while (true) {
-    //   // while (mcu.sample_write_ptr >= nSamples) {
-    //   // }
-    //   // Try on single core only RPi4
-    //   mcu.pcm.PCM_Update(mcu.mcu.cycles);
-    // }
-    return;
+    // second instance, renders on request of core 2
+    if (m_pSecondMCU == 0)
+      return;
+
+    EnableTimerEventStream();
+    Profile::PROFILE_Enable();
+
+    unsigned nDone = 0;
+    while (true) {
+      unsigned nRequest = m_nSecondRequest.load(std::memory_order_acquire);
+      if (nRequest == nDone) {
+        WaitForEvent();
+        continue;
+      }
+
+      RenderInstance(m_pSecondMCU, m_nSecondSamples, m_bSecondOversampling);
+      // its MIDI OUT is not connected
+      m_pSecondMCU->uart_tx_count = 0;
+
+      nDone = nRequest;
+      m_nSecondDone.store(nDone, std::memory_order_release);
+      DataSyncBarrier();
+      SendEvent();
+    }
   }
 }
+
+void CMiniJV880::RenderInstance(MCU *pMCU, int nSamples, bool bOversampling) {
+  pMCU->pcm.oversampling = bOversampling;
+  pMCU->MCU_SetSampleBuffer(pMCU->sample_buffer, nSamples);
+  PROFILE_START(pMCU->profile);
+  while (pMCU->sample_write_ptr < nSamples)
+    pMCU->MCU_Step();
+}
@@ -24,7 +24,16 @@
 
 #include "config.h"
 #include "userinterface.h"
+#include "serialmidi.h"
+#include "latencycontrol.h"
+#include "nvramjournal.h"
+#include "hdmilcd.h"
 #include "emulator/mcu.h"
+#include "emulator/midi.h"
+#include "emulator/romset.h"
+#include "emulator/snapshot.h"
+#include "emulator/resampler.h"
+#include "emulator/audioformat.h"
 #include <circle/gpiomanager.h>
 #include <circle/i2cmaster.h>
 #include <circle/interrupt.h>
@@ -37,6 +46,7 @@
 // #include <circle/usb/usbkompletekontrol.h>
 #include <circle/usb/usbmidi.h>
 #include <fatfs/ff.h>
+#include <atomic>
 #include <stdint.h>
 
 class CMiniJV880 : public CMultiCoreSupport {
@@ -48,12 +58,31 @@ public:
   bool Initialize(void);
   void Process(bool bPlugAndPlayUpdated);
 
+  // takes effect at the next render pass and is saved to minijv880.ini
+  void SetOversampling(bool bOversampling);
+  bool GetOversampling(void) const { return m_bOversampling; }
+
+private:
+  void ProcessMIDIOut(void);
+  void ProcessAudioTelemetry(void);
+  void ProcessProfile(void);
+  void ProcessWaveROMLoad(void);
+  void ProcessSnapshot(void);
+  void ProcessNVRAMJournal(void);
+
+  // runs the emulator until nSamples are in its sample_buffer
+  static void RenderInstance(MCU *pMCU, int nSamples, bool bOversampling);
+
+public:
+
   virtual void Run(unsigned nCore) override;
 
   static void USBMIDIMessageHandler(unsigned nCable, u8 *pPacket,
                                     unsigned nLength);
   static void DeviceRemovedHandler(CDevice *pDevice, void *pContext);
+  static void SoundNeedDataHandler(void *pParam);
 
+  // the instance the UI and MIDI OUT are connected to
   MCU mcu;
 
   CScreenDevice *screenUnbuffered;
@@ -63,6 +92,89 @@ private:
   FATFS *m_pFileSystem;
 
   CUSBMIDIDevice *volatile m_pMIDIDevice = 0;
+  CSerialMIDIDevice m_SerialMIDI;
+
+  // one queue per input, so each has a single producer; only core 2
+  // touches the emulated UART
+  MidiQueue m_USBMIDIQueue;
+  MidiQueue m_SerialMIDIQueue;
+  MidiParser m_USBMIDIParser;
+  MidiMerge m_MIDIMerge;
+
+  // the ROM images of all instances
+  RomSet *m_pRomSet;
+
+  // Card and expansion wave ROMs are loaded after startup: core 0 reads
+  // the image a bit per Process () call, then core 1 unscrambles it into
+  // m_pRomSet, which switches the banks in for all instances
+  enum TWaveROMLoadState {
+    WaveROMLoadIdle,
+    WaveROMLoadReading,
+    WaveROMLoadUnscramble, // core 1
+    WaveROMLoadDone,
+    WaveROMLoadFinished
+  };
+  std::atomic<int> m_WaveROMLoadState;
+  unsigned m_nWaveROMLoad; // 0 card, 1 expansion
+  FIL m_WaveROMFile;
+  u8 *m_pWaveROMImage;
+  unsigned m_nWaveROMSize;
+  unsigned m_nWaveROMRead;
+  bool m_bWaveROMLoaded;
+
+  // Snapshot: restored by Initialize (); without one, core 2 takes it
+  // between two chunks when ProcessSnapshot () asks for it
+  enum TSnapshotState {
+    SnapshotNone,
+    SnapshotWait,
+    SnapshotRequested, // core 2
+    SnapshotTaken
+  };
+  std::atomic<int> m_SnapshotState;
+  u8 *m_pSnapshot;
+  size_t m_nSnapshotSize;
+  SnapshotImages m_SnapshotImages;
+  unsigned m_nBootTicks;
+
+  // RAM persistence: every few seconds core 2 copies the pages of the
+  // first instance written meanwhile, core 0 journals them
+  enum TNVRAMState {
+    NVRAMIdle,
+    NVRAMRequested, // core 2
+    NVRAMTaken
+  };
+  CNVRAMJournal *m_pNVRAMJournal;
+  std::atomic<int> m_NVRAMState;
+  unsigned m_nNVRAMTicks;
+  u8 *m_pNVRAMImage[MCU_REGIONS];
+  u32 m_NVRAMPages[MCU_REGIONS][MCU_REGION_PAGES / 32];
+
+  // the LCD of mcu on HDMI, drawn by core 1 once the wave ROMs are loaded
+  CHDMILCD *m_pHDMILCD;
+
+  // Instances=2: a second emulator on core 3, sharing the ROM images with
+  // mcu and mixed into its output. Core 2 drains its MIDI input and then
+  // hands it a render request; both sequence numbers only ever increase.
+  MCU *m_pSecondMCU;
+  bool m_bMIDISplit; // USB to mcu, serial to m_pSecondMCU
+  MidiMerge m_SecondMIDIMerge;
+  int m_nSecondSamples;
+  bool m_bSecondOversampling;
+  std::atomic<unsigned> m_nSecondRequest;
+  std::atomic<unsigned> m_nSecondDone;
+
+  // MIDI OUT: filled by core 2 once per chunk, drained in Process ()
+  MidiTxRing m_MIDITxRing;
+  bool m_bMIDIOutUSB;
+  bool m_bMIDIOutSerial;
+  // USB MIDI packets need complete messages, so the TX stream is framed
+  MidiParser m_MIDIOutParser;
+  MidiQueue m_MIDIOutQueue;
+  u8 m_MIDIOutSysEx[1024];
+  unsigned m_nMIDIOutSysExLength;
+  // the part of the last read the serial port did not take yet
+  u8 m_MIDIOutSerial[256];
+  unsigned m_nMIDIOutSerialLength;
   // CUSBKompleteKontrolDevice *volatile m_KompleteKontrol = 0;
   int lastEncoderPos = 0;
 
@@ -70,6 +182,28 @@ private:
   bool m_bChannelsSwapped;
   unsigned m_nQueueSizeFrames;
 
+  // native 32 kHz, or 64 kHz with oversampling, to SampleRate; one per
+  // PCM rate so that switching does not allocate on core 2
+  Resampler m_Resampler[2];
+  volatile bool m_bOversampling;
+  bool m_bResamplerOversampling; // the one used last, core 2
+  int32_t m_ResampleBuffer[audio_buffer_size + 64];
+
+  // SoundFormat, converted from the emulator's int32_t samples
+  int m_nSoundFormat;
+  u8 m_OutputBuffer[(audio_buffer_size + 64) * sizeof(int32_t)]
+      __attribute__((aligned(16)));
+
+  // chunk size control and underrun counters, updated by core 2
+  CLatencyControl m_Latency;
+  unsigned m_nLastUnderruns;
+  unsigned m_nLastNearMisses;
+  unsigned m_nLastTelemetryTicks;
+
+  // stage counters of both instances at the last report (ProfileEnabled)
+  Profile m_LastProfile[2];
+  unsigned m_nLastProfileTicks;
+
   CUserInterface m_UI;
 
   unsigned m_lastTick;
@@ -0,0 +1,378 @@
+//
+// nvramjournal.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "nvramjournal.h"
+#include <circle/logger.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+LOGMODULE ("nvramjournal");
+
+#define JOURNAL_VERSION		1
+
+// the pages before this record are a complete image
+#define REGION_COMMIT		0xFF
+
+// compact when the journal holds this many times the kept pages
+#define COMPACT_FACTOR		4
+
+struct TJournalHeader
+{
+	char	Magic[8];
+	u32	nVersion;
+	u32	nGeneration;		// the newer journal of the two wins
+};
+
+struct TJournalRecord
+{
+	u8	uchRegion;
+	u8	uchPage;
+	u16	usReserved;
+	u32	nChecksum;		// a torn record at the end is ignored
+	u8	Data[MCU_PAGE_SIZE];
+};
+
+static const char JournalMagic[8] = {'J', 'V', '8', '8', '0', 'N', 'V', 'J'};
+
+static u32 RecordChecksum (const TJournalRecord &Record)
+{
+	u32 nHash = 2166136261U;
+	nHash = (nHash ^ Record.uchRegion) * 16777619U;
+	nHash = (nHash ^ Record.uchPage) * 16777619U;
+	for (unsigned i = 0; i < MCU_PAGE_SIZE; i++)
+	{
+		nHash = (nHash ^ Record.Data[i]) * 16777619U;
+	}
+
+	return nHash;
+}
+
+CNVRAMJournal::CNVRAMJournal (const char *pFileName, unsigned nRegionMask)
+:	m_FileName (pFileName),
+	m_nRegionMask (nRegionMask),
+	m_bFileOpen (false),
+	m_nFile (0),
+	m_nGeneration (0),
+	m_nRecords (0)
+{
+	for (unsigned i = 0; i < MCU_REGIONS; i++)
+	{
+		m_pImage[i] = 0;
+	}
+}
+
+CNVRAMJournal::~CNVRAMJournal (void)
+{
+	if (m_bFileOpen)
+	{
+		f_close (&m_File);
+	}
+
+	for (unsigned i = 0; i < MCU_REGIONS; i++)
+	{
+		free (m_pImage[i]);
+	}
+}
+
+bool CNVRAMJournal::Initialize (MCU *pMCU)
+{
+	assert (pMCU != 0);
+
+	for (unsigned i = 0; i < MCU_REGIONS; i++)
+	{
+		if (m_nRegionMask & (1 << i))
+		{
+			m_pImage[i] = (u8 *) malloc (MCU_REGION_SIZE);
+			if (m_pImage[i] == 0)
+			{
+				return false;
+			}
+		}
+	}
+
+	// try the newer journal first
+	u32 Generation[2] = {0, 0};
+	for (unsigned nFile = 0; nFile < 2; nFile++)
+	{
+		FIL File;
+		if (f_open (&File, GetFileName (nFile).c_str (), FA_READ | FA_OPEN_EXISTING) != FR_OK)
+		{
+			continue;
+		}
+
+		TJournalHeader Header;
+		unsigned nBytesRead;
+		if (   f_read (&File, &Header, sizeof Header, &nBytesRead) == FR_OK
+		    && nBytesRead == sizeof Header
+		    && memcmp (Header.Magic, JournalMagic, sizeof JournalMagic) == 0
+		    && Header.nVersion == JOURNAL_VERSION)
+		{
+			Generation[nFile] = Header.nGeneration;
+		}
+
+		f_close (&File);
+	}
+
+	unsigned nNewer = Generation[1] > Generation[0] ? 1 : 0;
+	for (unsigned nTry = 0; nTry < 2; nTry++)
+	{
+		unsigned nFile = nTry == 0 ? nNewer : !nNewer;
+		if (Generation[nFile] == 0)
+		{
+			continue;
+		}
+
+		for (unsigned i = 0; i < MCU_REGIONS; i++)
+		{
+			if (m_pImage[i] != 0)
+			{
+				memcpy (m_pImage[i], pMCU->MCU_GetRegion (i), MCU_REGION_SIZE);
+			}
+		}
+
+		if (Replay (nFile, &m_nGeneration))
+		{
+			m_nFile = nFile;
+			Restore (pMCU);
+
+			if (f_open (&m_File, GetFileName (nFile).c_str (),
+				    FA_WRITE | FA_OPEN_APPEND) != FR_OK)
+			{
+				LOGERR ("Cannot open %s", GetFileName (nFile).c_str ());
+				return false;
+			}
+			m_bFileOpen = true;
+
+			LOGNOTE ("Restored from %s (%u pages)", GetFileName (nFile).c_str (), m_nRecords);
+
+			return true;
+		}
+
+		LOGWARN ("%s is incomplete", GetFileName (nFile).c_str ());
+	}
+
+	// no journal yet, start one with what was loaded
+	for (unsigned i = 0; i < MCU_REGIONS; i++)
+	{
+		if (m_pImage[i] != 0)
+		{
+			memcpy (m_pImage[i], pMCU->MCU_GetRegion (i), MCU_REGION_SIZE);
+		}
+	}
+
+	m_nFile = 1;
+	m_nGeneration = 0;
+
+	return Compact ();
+}
+
+void CNVRAMJournal::Restore (MCU *pMCU) const
+{
+	for (unsigned i = 0; i < MCU_REGIONS; i++)
+	{
+		if (m_pImage[i] != 0)
+		{
+			memcpy (pMCU->MCU_GetRegion (i), m_pImage[i], MCU_REGION_SIZE);
+		}
+	}
+}
+
+void CNVRAMJournal::Write (unsigned nRegion, u32 *pPages, const u8 *pImage)
+{
+	assert (nRegion < MCU_REGIONS);
+	if (!m_bFileOpen || m_pImage[nRegion] == 0)
+	{
+		return;
+	}
+
+	bool bAppended = false;
+	for (unsigned nPage = 0; nPage < MCU_REGION_PAGES; nPage++)
+	{
+		u32 nBit = 1U << (nPage % 32);
+		if (!(pPages[nPage / 32] & nBit))
+		{
+			continue;
+		}
+
+		// the firmware often writes back what was there
+		unsigned nOffset = nPage * MCU_PAGE_SIZE;
+		if (memcmp (m_pImage[nRegion] + nOffset, pImage + nOffset, MCU_PAGE_SIZE) != 0)
+		{
+			// this page and the ones after it stay in pPages for the next call
+			if (!AppendPage (&m_File, nRegion, nPage, pImage + nOffset))
+			{
+				LOGERR ("Cannot write %s", GetFileName (m_nFile).c_str ());
+				break;
+			}
+			memcpy (m_pImage[nRegion] + nOffset, pImage + nOffset, MCU_PAGE_SIZE);
+			m_nRecords++;
+			bAppended = true;
+		}
+
+		pPages[nPage / 32] &= ~nBit;
+	}
+
+	if (!bAppended)
+	{
+		return;
+	}
+
+	f_sync (&m_File);
+
+	unsigned nKeptPages = 0;
+	for (unsigned i = 0; i < MCU_REGIONS; i++)
+	{
+		if (m_pImage[i] != 0)
+		{
+			nKeptPages += MCU_REGION_PAGES;
+		}
+	}
+
+	if (m_nRecords > COMPACT_FACTOR * nKeptPages)
+	{
+		Compact ();
+	}
+}
+
+bool CNVRAMJournal::Replay (unsigned nFile, u32 *pGeneration)
+{
+	FIL File;
+	if (f_open (&File, GetFileName (nFile).c_str (), FA_READ | FA_OPEN_EXISTING) != FR_OK)
+	{
+		return false;
+	}
+
+	TJournalHeader Header;
+	unsigned nBytesRead;
+	f_read (&File, &Header, sizeof Header, &nBytesRead);
+	*pGeneration = Header.nGeneration;
+
+	// the image written by Compact (), then the pages appended since
+	bool bComplete = false;
+	m_nRecords = 0;
+
+	TJournalRecord Record;
+	while (   f_read (&File, &Record, sizeof Record, &nBytesRead) == FR_OK
+	       && nBytesRead == sizeof Record
+	       && Record.nChecksum == RecordChecksum (Record))
+	{
+		if (Record.uchRegion == REGION_COMMIT)
+		{
+			bComplete = true;
+			continue;
+		}
+
+		if (   Record.uchRegion < MCU_REGIONS
+		    && m_pImage[Record.uchRegion] != 0
+		    && Record.uchPage < MCU_REGION_PAGES)
+		{
+			memcpy (m_pImage[Record.uchRegion] + Record.uchPage * MCU_PAGE_SIZE,
+				Record.Data, MCU_PAGE_SIZE);
+		}
+
+		if (bComplete)
+		{
+			m_nRecords++;
+		}
+	}
+
+	f_close (&File);
+
+	return bComplete;
+}
+
+bool CNVRAMJournal::Compact (void)
+{
+	unsigned nNewFile = !m_nFile;
+	std::string NewFileName = GetFileName (nNewFile);
+
+	FIL File;
+	if (f_open (&File, NewFileName.c_str (), FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+	{
+		LOGERR ("Cannot create %s", NewFileName.c_str ());
+		return false;
+	}
+
+	TJournalHeader Header;
+	memcpy (Header.Magic, JournalMagic, sizeof JournalMagic);
+	Header.nVersion = JOURNAL_VERSION;
+	Header.nGeneration = m_nGeneration + 1;
+
+	unsigned nBytesWritten;
+	bool bOK =    f_write (&File, &Header, sizeof Header, &nBytesWritten) == FR_OK
+		   && nBytesWritten == sizeof Header;
+
+	for (unsigned i = 0; bOK && i < MCU_REGIONS; i++)
+	{
+		for (unsigned nPage = 0; bOK && m_pImage[i] != 0 && nPage < MCU_REGION_PAGES; nPage++)
+		{
+			bOK = AppendPage (&File, i, nPage, m_pImage[i] + nPage * MCU_PAGE_SIZE);
+		}
+	}
+
+	static const u8 Empty[MCU_PAGE_SIZE] = {0};
+	bOK = bOK && AppendPage (&File, REGION_COMMIT, 0, Empty);
+	bOK = bOK && f_sync (&File) == FR_OK;
+	f_close (&File);
+
+	if (!bOK)
+	{
+		LOGERR ("Cannot write %s", NewFileName.c_str ());
+		f_unlink (NewFileName.c_str ());
+		return false;
+	}
+
+	// the new journal is complete, the old one can go
+	if (m_bFileOpen)
+	{
+		f_close (&m_File);
+		m_bFileOpen = false;
+	}
+	f_unlink (GetFileName (m_nFile).c_str ());
+
+	m_nFile = nNewFile;
+	m_nGeneration++;
+	m_nRecords = 0;
+
+	if (f_open (&m_File, NewFileName.c_str (), FA_WRITE | FA_OPEN_APPEND) != FR_OK)
+	{
+		LOGERR ("Cannot open %s", NewFileName.c_str ());
+		return false;
+	}
+	m_bFileOpen = true;
+
+	return true;
+}
+
+bool CNVRAMJournal::AppendPage (FIL *pFile, unsigned nRegion, unsigned nPage, const u8 *pData)
+{
+	TJournalRecord Record;
+	Record.uchRegion = nRegion;
+	Record.uchPage = nPage;
+	Record.usReserved = 0;
+	memcpy (Record.Data, pData, MCU_PAGE_SIZE);
+	Record.nChecksum = RecordChecksum (Record);
+
+	unsigned nBytesWritten;
+	return    f_write (pFile, &Record, sizeof Record, &nBytesWritten) == FR_OK
+	       && nBytesWritten == sizeof Record;
+}
+
+std::string CNVRAMJournal::GetFileName (unsigned nFile) const
+{
+	return m_FileName + (nFile == 0 ? ".0" : ".1");
+}
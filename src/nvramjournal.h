@@ -0,0 +1,75 @@
+//
+// nvramjournal.h
+//
+// Keeps the battery backed RAMs of the JV-880 (nvram, and optionally the
+// card RAM and sram) on the SD card. Changed 256 byte pages are appended
+// to a journal file; when it has grown, the current images are written to
+// a fresh journal that replaces it. Two files alternate for that, so a
+// power loss at any point leaves one complete journal behind.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _nvramjournal_h
+#define _nvramjournal_h
+
+#include "emulator/mcu.h"
+#include <circle/types.h>
+#include <fatfs/ff.h>
+#include <string>
+
+class CNVRAMJournal
+{
+public:
+	// pFileName.0 and pFileName.1 are used; nRegionMask has a bit for
+	// each MCU_REGION_* to keep
+	CNVRAMJournal (const char *pFileName, unsigned nRegionMask);
+	~CNVRAMJournal (void);
+
+	// Reads the newest complete journal into the kept regions of pMCU.
+	// Without one, the current contents of pMCU start a new journal.
+	bool Initialize (MCU *pMCU);
+
+	// copies the kept regions as loaded by Initialize () to another instance
+	void Restore (MCU *pMCU) const;
+
+	unsigned GetRegionMask (void) const	{ return m_nRegionMask; }
+
+	// Appends the pages in pPages (as filled by MCU_CollectDirtyPages)
+	// that differ from what is on the card, and compacts the journal when
+	// it has grown too large. Clears the bits of the pages it is done
+	// with; after a write error the others are left for the next call.
+	// Runs on core 0, only FatFs is blocking here.
+	void Write (unsigned nRegion, u32 *pPages, const u8 *pImage);
+
+private:
+	bool Replay (unsigned nFile, u32 *pGeneration);
+	bool Compact (void);
+	bool AppendPage (FIL *pFile, unsigned nRegion, unsigned nPage, const u8 *pData);
+	std::string GetFileName (unsigned nFile) const;
+
+private:
+	std::string m_FileName;
+	unsigned m_nRegionMask;
+
+	// what the journal holds
+	u8 *m_pImage[MCU_REGIONS];
+
+	FIL m_File;
+	bool m_bFileOpen;
+	unsigned m_nFile;		// 0 or 1
+	u32 m_nGeneration;
+	unsigned m_nRecords;
+};
+
+#endif
@@ -0,0 +1,73 @@
+//
+// serialmidi.cpp
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "serialmidi.h"
+#include <circle/logger.h>
+#include <circle/timer.h>
+#include <assert.h>
+
+LOGMODULE ("serialmidi");
+
+CSerialMIDIDevice::CSerialMIDIDevice (CInterruptSystem *pInterrupt, CConfig *pConfig, MidiQueue *pQueue)
+:	m_pConfig (pConfig),
+	m_pQueue (pQueue),
+	m_Serial (pInterrupt, TRUE)
+{
+}
+
+CSerialMIDIDevice::~CSerialMIDIDevice (void)
+{
+}
+
+bool CSerialMIDIDevice::Initialize (void)
+{
+	assert (m_pConfig);
+
+	if (!m_Serial.Initialize (m_pConfig->GetMIDIBaudRate ()))
+	{
+		LOGERR ("Cannot initialize UART");
+
+		return false;
+	}
+
+	LOGNOTE ("Serial MIDI at %u baud", m_pConfig->GetMIDIBaudRate ());
+
+	return true;
+}
+
+void CSerialMIDIDevice::Process (void)
+{
+	assert (m_pQueue);
+
+	u8 Buffer[64];
+	int nResult = m_Serial.Read (Buffer, sizeof Buffer);
+	if (nResult <= 0)
+	{
+		if (nResult < 0)
+		{
+			LOGWARN ("UART error %d", nResult);
+		}
+
+		return;
+	}
+
+	m_Parser.MIDI_Parse (Buffer, nResult, CTimer::GetClockTicks64 (), m_pQueue);
+}
+
+int CSerialMIDIDevice::Write (const u8 *pData, unsigned nLength)
+{
+	return m_Serial.Write (pData, nLength);
+}
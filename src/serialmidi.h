@@ -0,0 +1,54 @@
+//
+// serialmidi.h
+//
+// 5-pin DIN MIDI input on the PL011 UART (GPIO 15)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _serialmidi_h
+#define _serialmidi_h
+
+#include "config.h"
+#include "emulator/midi.h"
+#include <circle/interrupt.h>
+#include <circle/serial.h>
+#include <circle/types.h>
+
+class CSerialMIDIDevice
+{
+public:
+	CSerialMIDIDevice (CInterruptSystem *pInterrupt, CConfig *pConfig, MidiQueue *pQueue);
+	~CSerialMIDIDevice (void);
+
+	bool Initialize (void);
+
+	// Moves the bytes the UART FIQ has collected into the queue.
+	// Call from a single context only (the queue has one producer).
+	void Process (void);
+
+	// Queues bytes for the UART transmitter, returns the number accepted
+	int Write (const u8 *pData, unsigned nLength);
+
+private:
+	CConfig *m_pConfig;
+	MidiQueue *m_pQueue;
+
+	// the FIQ handler of CSerialDevice drains the PL011 FIFO into its
+	// own ring buffer, so no byte is lost while Process () is not running
+	CSerialDevice m_Serial;
+
+	MidiParser m_Parser;
+};
+
+#endif
@@ -28,10 +28,18 @@ LOGMODULE ("uibuttons");
 CUIButton::CUIButton (void)
 :	m_pinNumber (0),
 	m_pin (0),
+	m_bInterrupt (FALSE),
+	m_pButtons (0),
+	m_index (0),
 	m_lastValue (1),
-	m_timer (0),
-	m_debounceTimer (0),
+	m_edgeTicks (0),
+	m_bSettling (FALSE),
+	m_bTiming (FALSE),
+	m_pressTicks (0),
 	m_numClicks (0),
+	m_bPulse (FALSE),
+	m_pulseEvent (BtnEventNone),
+	m_pulseTicks (0),
 	m_clickEvent(BtnEventNone),
 	m_doubleClickEvent(BtnEventNone),
 	m_longPressEvent(BtnEventNone),
@@ -44,33 +52,52 @@ CUIButton::~CUIButton (void)
 {
 	if (m_pin)
 	{
+		if (m_bInterrupt)
+		{
+			m_pin->DisableInterrupt ();
+			m_pin->DisableInterrupt2 ();
+			m_pin->DisconnectInterrupt ();
+		}
+
 		delete m_pin;
 	}
 }
 
 void CUIButton::reset (void)
 {
-	m_timer = m_longPressTimeout;
+	m_bTiming = FALSE;
 	m_numClicks = 0;
 }
 
-boolean CUIButton::Initialize (unsigned pinNumber, unsigned doubleClickTimeout, unsigned longPressTimeout)
+boolean CUIButton::Initialize (unsigned pinNumber, unsigned doubleClickTimeout, unsigned longPressTimeout,
+			       CUIButtons *pButtons, unsigned index, CGPIOManager *pGPIOManager)
 {
 	assert (!m_pin);
 	assert(longPressTimeout >= doubleClickTimeout);
+	assert (pButtons);
 
 	m_pinNumber = pinNumber;
 	m_doubleClickTimeout = doubleClickTimeout;
 	m_longPressTimeout = longPressTimeout;
-	
-	// Initialise timing values
-	m_timer = m_longPressTimeout;
-	m_debounceTimer = DEBOUNCE_TIME;
+	m_pButtons = pButtons;
+	m_index = index;
 
 	if (m_pinNumber != 0)
 	{
 		LOGDBG("GPIO Button on pin: %d (%x)", m_pinNumber, m_pinNumber);
-        m_pin = new CGPIOPin (m_pinNumber, GPIOModeInputPullUp);
+		m_pin = new CGPIOPin (m_pinNumber, GPIOModeInputPullUp, pGPIOManager);
+
+		m_lastValue = m_pin->Read ();
+		// The first edge is never a bounce
+		m_edgeTicks = CTimer::GetClockTicks () - DEBOUNCE_TIME;
+
+		if (pGPIOManager)
+		{
+			m_bInterrupt = TRUE;
+			m_pin->ConnectInterrupt (EdgeHandler, this);
+			m_pin->EnableInterrupt (GPIOInterruptOnFallingEdge);
+			m_pin->EnableInterrupt2 (GPIOInterruptOnRisingEdge);
+		}
 	}
 	return TRUE;
 }
@@ -94,32 +121,98 @@ unsigned CUIButton::getPinNumber(void)
 {
 	return m_pinNumber;
 }
-	
-CUIButton::BtnTrigger CUIButton::ReadTrigger (void)
+
+void CUIButton::EdgeHandler (void *pParam)
+{
+	CUIButton *pThis = static_cast<CUIButton *> (pParam);
+	assert (pThis != 0);
+	assert (pThis->m_pin);
+
+	pThis->m_pButtons->QueueEdge (pThis->m_index, pThis->m_pin->Read (),
+				      CTimer::GetClockTicks ());
+}
+
+boolean CUIButton::hasInterrupt(void)
+{
+	return m_bInterrupt;
+}
+
+void CUIButton::Sample (unsigned nTicks)
 {
-	unsigned value;
-	
 	if (!m_pin)
+	{
+		return;
+	}
+
+	unsigned value = m_pin->Read ();
+	if (value != m_lastValue)
+	{
+		Edge (value, nTicks);
+	}
+}
+
+void CUIButton::Edge (unsigned value, unsigned nTicks)
+{
+	// Whatever was due before this edge happens first
+	Poll (nTicks);
+
+	if (value == m_lastValue)
+	{
+		// A bounce back to where the pin was
+		return;
+	}
+
+	// Debounce here - the first edge counts at once, the ones following it
+	// within the debounce time are bounces. The pin is read again after
+	// them, in case they ended on the other level.
+	if (nTicks - m_edgeTicks < DEBOUNCE_TIME)
+	{
+		m_bSettling = TRUE;
+		return;
+	}
+
+	Transition (value, nTicks);
+}
+
+void CUIButton::Poll (unsigned nTicks)
+{
+	if (!m_pin)
+	{
+		return;
+	}
+
+	if (m_bSettling && nTicks - m_edgeTicks >= DEBOUNCE_TIME)
+	{
+		m_bSettling = FALSE;
+
+		unsigned value = m_pin->Read ();
+		if (value != m_lastValue)
 		{
-			// Always return "not pressed" if not configured
-			return BtnTriggerNone;
+			Transition (value, nTicks);
 		}
-		value = m_pin->Read();
+	}
+
+	if (m_bPulse && nTicks - m_pulseTicks >= BUTTON_PULSE_TIME)
+	{
+		m_bPulse = FALSE;
+		m_pButtons->Emit (m_pulseEvent, FALSE);
+	}
 
-	if (m_timer < m_longPressTimeout) {
-		m_timer++;
+	if (m_bTiming)
+	{
+		unsigned timer = nTicks - m_pressTicks;
 
-		if (m_timer == m_doubleClickTimeout && m_lastValue == 1 && m_numClicks == 1) {
+		if (timer >= m_doubleClickTimeout && m_lastValue == 1 && m_numClicks == 1) {
 			// The user has clicked and released the button once within the
 			// timeout - this must be a single click
 			reset();
-			return BtnTriggerClick;
+			Trigger (BtnTriggerClick, nTicks);
 		}
-		if (m_timer == m_longPressTimeout) {
+		else if (timer >= m_longPressTimeout) {
 			if (m_lastValue == 0 && m_numClicks == 1) {
 				// Single long press
 				reset();
-				return BtnTriggerLongPress;
+				Trigger (BtnTriggerLongPress, nTicks);
 			}
 			else {
 				// Just reset it - we've run out of possible interactions
@@ -127,82 +220,96 @@ CUIButton::BtnTrigger CUIButton::ReadTrigger (void)
 			}
 		}
 	}
+}
 
-	// Debounce here - we don't need to do anything if the debounce timer is active
-	if (m_debounceTimer < DEBOUNCE_TIME) {
-		m_debounceTimer++;
-		return BtnTriggerNone;
+void CUIButton::Transition (unsigned value, unsigned nTicks)
+{
+	m_lastValue = value;
+	m_edgeTicks = nTicks;
+
+	// Without other actions, the button is held as long as the pin, so that
+	// it can be held together with others. The button shared with the
+	// encoder is not, a turn of the encoder while it is down cancels it.
+	if (   m_bInterrupt
+	    && m_doubleClickEvent == BtnEventNone
+	    && m_longPressEvent == BtnEventNone)
+	{
+		if (m_clickEvent != BtnEventNone)
+		{
+			// Buttons in PULL UP mode are "active low"
+			m_pButtons->Emit (m_clickEvent, value == 0);
+		}
+
+		return;
 	}
-	
+
 	// Buttons in PULL UP mode are "active low"
 	if (value == 0)
 	{
-		if (m_lastValue == 0) {
-			// 0 -> 0 : Button is pressed, was already pressed
+		// 1 -> 0 : Button was not pressed but is now pressed
+		if (m_numClicks == 0) {
+			// No clicks recorded - start a new timer
+			m_bTiming = TRUE;
+			m_pressTicks = nTicks;
 		}
-		else {
-			// 1 -> 0 : Button was not pressed but is now pressed
-			m_lastValue = 0;
-			m_debounceTimer = 0;
-
-			if (m_numClicks == 0) {
-				// No clicks recorded - start a new timer
-				m_timer = 0;
-			}
-			if (m_numClicks < 2) {
-				m_numClicks++;
-			}
+		if (m_numClicks < 2) {
+			m_numClicks++;
 		}
 	}
 	else
 	{
-		if (m_lastValue == 1) {
-			// 1 -> 1 : Button is not pressed, was already not pressed
+		// 0 -> 1 : Button was pressed but is now not pressed (it was released)
+		unsigned timer = nTicks - m_pressTicks;
+
+		if (m_numClicks == 1 &&
+				(m_doubleClickEvent == BtnEventNone ||
+				 timer >= m_doubleClickTimeout && timer < m_longPressTimeout)
+		) {
+			// Either the user released the button when there is no double
+			// click mapped
+			// OR:
+			// The user released the button after the double click
+			// timeout, but before the long press timeout
+			reset();
+			Trigger (BtnTriggerClick, nTicks);
 		}
-		else {
-			// 0 -> 1 : Button was pressed but is now not pressed (it was released)
-			m_lastValue = 1;
-			m_debounceTimer = 0;
-
-			if (m_numClicks == 1 &&
-					(m_doubleClickEvent == BtnEventNone ||
-					 m_timer >= m_doubleClickTimeout && m_timer < m_longPressTimeout)
-			) {
-				// Either the user released the button when there is no double
-				// click mapped
-				// OR:
-				// The user released the button after the double click
-				// timeout, but before the long press timeout
-				reset();
-				return BtnTriggerClick;
-			}
-			else if (m_numClicks == 2) {
-				// This is the second release in a short period of time
-				reset();
-				return BtnTriggerDoubleClick;
-			}
+		else if (m_numClicks == 2) {
+			// This is the second release in a short period of time
+			reset();
+			Trigger (BtnTriggerDoubleClick, nTicks);
 		}
 	}
-
-	return BtnTriggerNone;
 }
 
-CUIButton::BtnEvent CUIButton::Read (void) {
-	BtnTrigger trigger = ReadTrigger();
+void CUIButton::Trigger (BtnTrigger trigger, unsigned nTicks)
+{
+	BtnEvent event = BtnEventNone;
 
 	if (trigger == BtnTriggerClick) {
-		return m_clickEvent;
+		event = m_clickEvent;
 	}
 	else if (trigger == BtnTriggerDoubleClick) {
-		return m_doubleClickEvent;
+		event = m_doubleClickEvent;
 	}
 	else if (trigger == BtnTriggerLongPress) {
-		return m_longPressEvent;
+		event = m_longPressEvent;
 	}
 
-	assert (trigger == BtnTriggerNone);
+	if (event == BtnEventNone)
+	{
+		return;
+	}
+
+	if (m_bPulse)
+	{
+		m_pButtons->Emit (m_pulseEvent, FALSE);
+	}
+
+	m_pButtons->Emit (event, TRUE);
 
-	return BtnEventNone;
+	m_bPulse = TRUE;
+	m_pulseEvent = event;
+	m_pulseTicks = nTicks;
 }
 
 CUIButton::BtnTrigger CUIButton::triggerTypeFromString(const char* triggerString)
@@ -241,10 +348,15 @@ CUIButtons::CUIButtons (
 			unsigned monitorPin, const char *monitorAction,
 			unsigned comparePin, const char *compareAction,
 			unsigned enterPin, const char *enterAction,
-			unsigned doubleClickTimeout, unsigned longPressTimeout
+			unsigned oversamplingPin, const char *oversamplingAction,
+			unsigned doubleClickTimeout, unsigned longPressTimeout,
+			CGPIOManager *pGPIOManager,
+			unsigned sampledPin
 )
 :	m_doubleClickTimeout(doubleClickTimeout),
 	m_longPressTimeout(longPressTimeout),
+	m_pGPIOManager(pGPIOManager),
+	m_sampledPin(sampledPin),
 	m_previewPin(previewPin), m_previewAction(CUIButton::triggerTypeFromString(previewAction)),
 	m_leftPin(leftPin), m_leftAction(CUIButton::triggerTypeFromString(leftAction)),
 	m_rightPin(rightPin), m_rightAction(CUIButton::triggerTypeFromString(rightAction)),
@@ -259,8 +371,11 @@ CUIButtons::CUIButtons (
 	m_monitorPin(monitorPin), m_monitorAction(CUIButton::triggerTypeFromString(monitorAction)),
 	m_comparePin(comparePin), m_compareAction(CUIButton::triggerTypeFromString(compareAction)),
 	m_enterPin(enterPin), m_enterAction(CUIButton::triggerTypeFromString(enterAction)),
+	m_oversamplingPin(oversamplingPin), m_oversamplingAction(CUIButton::triggerTypeFromString(oversamplingAction)),
 	m_eventHandler (0),
-	m_lastTick (0)
+	m_edgeIn (0),
+	m_edgeOut (0),
+	m_bEdgeOverflow (false)
 {
 }
 
@@ -271,10 +386,10 @@ CUIButtons::~CUIButtons (void)
 boolean CUIButtons::Initialize (void)
 {
 	// First sanity check and convert the timeouts:
-	// Internally values are in tenths of a millisecond, but config values
-	// are in milliseconds
-	unsigned doubleClickTimeout = m_doubleClickTimeout * 10;
-	unsigned longPressTimeout = m_longPressTimeout * 10;
+	// Internally values are in microseconds, but config values are in
+	// milliseconds
+	unsigned doubleClickTimeout = m_doubleClickTimeout * 1000;
+	unsigned longPressTimeout = m_longPressTimeout * 1000;
 
 	if (longPressTimeout < doubleClickTimeout) {
 		// This is invalid - long press must be longest timeout
@@ -293,12 +408,14 @@ boolean CUIButtons::Initialize (void)
 		m_previewPin, m_leftPin, m_rightPin, m_dataPin, m_toneSelectPin,
 		m_patchPerformPin,  m_editPin,  m_systemPin,  m_rhythmPin, 
 		m_utilityPin, m_mutePin, m_monitorPin, m_comparePin, m_enterPin,
+		m_oversamplingPin,
 	};
 	CUIButton::BtnTrigger triggers[MAX_BUTTONS] = {
 		// Normal buttons
 		m_previewAction, m_leftAction, m_rightAction, m_dataAction, m_toneSelectAction,
 		m_patchPerformAction, m_editAction, m_systemAction, m_rhythmAction,
 		m_utilityAction, m_muteAction, m_monitorAction, m_compareAction, m_enterAction,
+		m_oversamplingAction,
 	};
 	CUIButton::BtnEvent events[MAX_BUTTONS] = {
 		// Normal buttons
@@ -316,6 +433,7 @@ boolean CUIButtons::Initialize (void)
 		CUIButton::BtnEventMonitor,
 		CUIButton::BtnEventCompare,
 		CUIButton::BtnEventEnter,
+		CUIButton::BtnEventOversampling,
 	};
 
 	// Setup normal GPIO buttons first
@@ -335,8 +453,10 @@ boolean CUIButtons::Initialize (void)
 				break;
 			}
 			else if (m_buttons[j].getPinNumber() == 0) {
-				// This is un-initialised so can be assigned
-				m_buttons[j].Initialize(pins[i], doubleClickTimeout, longPressTimeout);
+				// This is un-initialised so can be assigned. The pin
+				// of the encoder switch interrupts the encoder already.
+				m_buttons[j].Initialize(pins[i], doubleClickTimeout, longPressTimeout,
+							this, j, pins[i] != m_sampledPin ? m_pGPIOManager : 0);
 				break;
 			}
 		}
@@ -393,23 +513,53 @@ void CUIButtons::Update (void)
 {
 	assert (m_eventHandler);
 
-	// Don't update unless enough time has elapsed.
-	// Get the current time in microseconds
-	unsigned currentTick = CTimer::GetClockTicks();
-	if (currentTick - m_lastTick < BUTTONS_UPDATE_NUM_TICKS) {
-		// Not enough time has passed, just return
-		return;
+	// The edges are taken in the order they happened, with their time
+	unsigned out = m_edgeOut.load (std::memory_order_relaxed);
+	unsigned in = m_edgeIn.load (std::memory_order_acquire);
+	for (; out != in; out++)
+	{
+		const TEdge &edge = m_edges[out & (EDGE_QUEUE_SIZE-1)];
+		m_buttons[edge.index].Edge (edge.value, edge.nTicks);
 	}
+	m_edgeOut.store (out, std::memory_order_release);
+
+	unsigned currentTick = CTimer::GetClockTicks();
 
-	m_lastTick = currentTick;
+	// If edges were lost, go by the level of the pins
+	boolean bOverflow = m_bEdgeOverflow.exchange (false, std::memory_order_relaxed);
 
 	for (unsigned i=0; i<MAX_BUTTONS; i++) {
-		CUIButton::BtnEvent event = m_buttons[i].Read();
-		if (event != CUIButton::BtnEventNone) {
-//			LOGDBG("Event: %u", event);
-			(*m_eventHandler) (event, m_eventParam);
+		if (bOverflow || !m_buttons[i].hasInterrupt()) {
+			m_buttons[i].Sample(currentTick);
 		}
+		m_buttons[i].Poll(currentTick);
+	}
+}
+
+void CUIButtons::QueueEdge (unsigned index, unsigned value, unsigned nTicks)
+{
+	unsigned in = m_edgeIn.load (std::memory_order_relaxed);
+	if (in - m_edgeOut.load (std::memory_order_acquire) >= EDGE_QUEUE_SIZE)
+	{
+		m_bEdgeOverflow.store (true, std::memory_order_relaxed);
+
+		return;
 	}
+
+	TEdge &edge = m_edges[in & (EDGE_QUEUE_SIZE-1)];
+	edge.nTicks = nTicks;
+	edge.index = index;
+	edge.value = value;
+
+	m_edgeIn.store (in + 1, std::memory_order_release);
+}
+
+void CUIButtons::Emit (CUIButton::BtnEvent event, boolean bPressed)
+{
+	assert (m_eventHandler);
+
+//	LOGDBG("Event: %u %u", event, bPressed);
+	(*m_eventHandler) (event, bPressed, m_eventParam);
 }
 
 void CUIButtons::ResetButton (unsigned pinNumber)
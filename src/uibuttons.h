@@ -20,13 +20,16 @@
 #ifndef _uibuttons_h
 #define _uibuttons_h
 
+#include <circle/gpiomanager.h>
 #include <circle/gpiopin.h>
 #include <circle/types.h>
+#include <atomic>
 #include "config.h"
 
-#define BUTTONS_UPDATE_NUM_TICKS 100
-#define DEBOUNCE_TIME 20
-#define MAX_GPIO_BUTTONS 14  // 14 UI buttons
+#define DEBOUNCE_TIME 2000		// microseconds
+#define BUTTON_PULSE_TIME 100000	// how long a click etc. holds its button, microseconds
+#define EDGE_QUEUE_SIZE 64		// pin edges not yet processed, a power of 2
+#define MAX_GPIO_BUTTONS 15  // 14 JV-880 buttons and oversampling
 #define MAX_BUTTONS (MAX_GPIO_BUTTONS)
 
 class CUIButtons;
@@ -59,39 +62,64 @@ public:
 		BtnEventMonitor = 12,
 		BtnEventCompare = 13,
 		BtnEventEnter = 14,
-		BtnEventUnknown = 15
+		BtnEventOversampling = 15,
+		BtnEventUnknown = 16
 	};
 	
 	CUIButton (void);
 	~CUIButton (void);
 	
 	void reset (void);
-	boolean Initialize (unsigned pinNumber, unsigned doubleClickTimeout, unsigned longPressTimeout);
+	// without a GPIO manager the pin is sampled by Sample() instead of
+	// interrupting on its edges
+	boolean Initialize (unsigned pinNumber, unsigned doubleClickTimeout, unsigned longPressTimeout,
+			    CUIButtons *pButtons, unsigned index, CGPIOManager *pGPIOManager);
 
 	void setClickEvent(BtnEvent clickEvent);
 	void setDoubleClickEvent(BtnEvent doubleClickEvent);
 	void setLongPressEvent(BtnEvent longPressEvent);
 
 	unsigned getPinNumber(void);
-	
-	BtnTrigger ReadTrigger (void);
-	BtnEvent Read (void);
+	boolean hasInterrupt(void);
+
+	// the pin has changed to value at the time nTicks
+	void Edge (unsigned value, unsigned nTicks);
+	// fires the events that are due at the time nTicks
+	void Poll (unsigned nTicks);
+	// reads the pin, for one without interrupt
+	void Sample (unsigned nTicks);
 
 	static BtnTrigger triggerTypeFromString(const char* triggerString);
-	
+
+private:
+	void Transition (unsigned value, unsigned nTicks);
+	void Trigger (BtnTrigger trigger, unsigned nTicks);
+
+	static void EdgeHandler (void *pParam);
+
 private:
 	// Pin number
 	unsigned m_pinNumber;
 	// GPIO pin
 	CGPIOPin *m_pin;
-	// The value of the pin at the end of the last loop
+	boolean m_bInterrupt;
+	CUIButtons *m_pButtons;
+	unsigned m_index;
+	// The debounced value of the pin
 	unsigned m_lastValue;
-	// Set to 0 on press, increment each read, use to trigger events
-	uint16_t m_timer;
-	// Debounce timer
-	uint16_t m_debounceTimer;
+	// Time of the last accepted change of the pin
+	unsigned m_edgeTicks;
+	// An edge inside the debounce time was ignored, read the pin after it
+	boolean m_bSettling;
+	// Time of the first press of a click, double click or long press
+	boolean m_bTiming;
+	unsigned m_pressTicks;
 	// Number of clicks recorded since last timer reset
 	uint8_t m_numClicks;
+	// A click, double click or long press holds its button for a while
+	boolean m_bPulse;
+	BtnEvent m_pulseEvent;
+	unsigned m_pulseTicks;
 	// Event to fire on click
 	BtnEvent m_clickEvent;
 	// Event to fire on double click
@@ -99,16 +127,18 @@ private:
 	// Event to fire on long press
 	BtnEvent m_longPressEvent;
 	
-	// Timeout for double click in tenths of a millisecond
+	// Timeout for double click in microseconds
 	unsigned m_doubleClickTimeout;
-	// Timeout for long press in tenths of a millisecond
+	// Timeout for long press in microseconds
 	unsigned m_longPressTimeout;
 };
 
 class CUIButtons
 {
 public:
-	typedef void BtnEventHandler (CUIButton::BtnEvent Event, void *param);
+	// a button with only a click action is held as long as its pin;
+	// other actions press the button and release it BUTTON_PULSE_TIME later
+	typedef void BtnEventHandler (CUIButton::BtnEvent Event, boolean bPressed, void *param);
 
 public:
 	CUIButtons (
@@ -126,7 +156,10 @@ public:
 			unsigned monitorPin, const char *monitorAction,
 			unsigned comparePin, const char *compareAction,
 			unsigned enterPin, const char *enterAction,
-			unsigned doubleClickTimeout, unsigned longPressTimeout
+			unsigned oversamplingPin, const char *oversamplingAction,
+			unsigned doubleClickTimeout, unsigned longPressTimeout,
+			CGPIOManager *pGPIOManager,
+			unsigned sampledPin	// shared with the rotary encoder, or 0
 	);
 	~CUIButtons (void);
 	
@@ -137,15 +170,26 @@ public:
 	void Update (void);
 
 	void ResetButton (unsigned pinNumber);
-	
+
+private:
+	friend class CUIButton;
+
+	// from the GPIO interrupt
+	void QueueEdge (unsigned index, unsigned value, unsigned nTicks);
+
+	void Emit (CUIButton::BtnEvent event, boolean bPressed);
+
 private:
 	// Array of normal GPIO buttons and "MIDI buttons"
 	CUIButton m_buttons[MAX_BUTTONS];
 	
-	// Timeout for double click in tenths of a millisecond
+	// Timeout for double click in milliseconds
 	unsigned m_doubleClickTimeout;
-	// Timeout for long press in tenths of a millisecond
+	// Timeout for long press in milliseconds
 	unsigned m_longPressTimeout;
+
+	CGPIOManager *m_pGPIOManager;
+	unsigned m_sampledPin;
 	
 	// Configuration for buttons
 	unsigned m_previewPin;
@@ -176,11 +220,25 @@ private:
 	CUIButton::BtnTrigger m_compareAction;
 	unsigned m_enterPin;
 	CUIButton::BtnTrigger m_enterAction;
+	unsigned m_oversamplingPin;
+	CUIButton::BtnTrigger m_oversamplingAction;
 
 	BtnEventHandler *m_eventHandler;
 	void *m_eventParam;
 
-	unsigned m_lastTick;
+	// pin edges with the time they happened, from the interrupt handler
+	// (the only writer of m_edgeIn) to Update() (the only writer of
+	// m_edgeOut)
+	struct TEdge
+	{
+		unsigned nTicks;
+		u8 index;
+		u8 value;
+	};
+	TEdge m_edges[EDGE_QUEUE_SIZE];
+	std::atomic<unsigned> m_edgeIn;
+	std::atomic<unsigned> m_edgeOut;
+	std::atomic<bool> m_bEdgeOverflow;
 
 	void bindButton(unsigned pinNumber, CUIButton::BtnTrigger trigger, CUIButton::BtnEvent event);
 };
@@ -30,13 +30,6 @@
 
 LOGMODULE ("ui");
 
-void set_pixel(unsigned char *screen, int x, int y, bool value) {
-  if (!value)
-    screen[(y / 8) * 128 + x] |= 1 << (y % 8);
-  else
-    screen[(y / 8) * 128 + x] &= ~(1 << (y % 8));
-}
-
 CUserInterface::CUserInterface (CMiniJV880 *pMiniJV880, CGPIOManager *pGPIOManager, CI2CMaster *pI2CMaster, CSPIMaster *pSPIMaster, CConfig *pConfig)
 :	m_pMiniJV880 (pMiniJV880),
 	m_pGPIOManager (pGPIOManager),
@@ -45,18 +38,29 @@ CUserInterface::CUserInterface (CMiniJV880 *pMiniJV880, CGPIOManager *pGPIOManag
 	m_pConfig (pConfig),
 	m_pLCD (0),
 	m_pLCDBuffered (0),
+	m_pLCDGraphics (0),
 	m_pUIButtons (0),
 	m_pRotaryEncoder (0),
 	m_bSwitchPressed (false),
-	m_lastTick (0)
+	m_nEncoderTicks (0),
+	m_nEncoderDirection (-1),
+	m_lastTick (0),
+	m_nLCDGeneration (0),
+	m_bLCDRefresh (true),
+	m_nLCDUpdateTime (0),
+	m_nMessageTime (0),
+	m_bMessageShown (false)
 {
-	screen_buffer = (u8 *)malloc(512);
+	// nothing the emulator shows, so that everything is written first
+	memset (m_LCDText, 0, sizeof m_LCDText);
+	m_Message[0] = '\0';
 }
 
 CUserInterface::~CUserInterface (void)
 {
 	delete m_pRotaryEncoder;
 	delete m_pUIButtons;
+	delete m_pLCDGraphics;
 	delete m_pLCDBuffered;
 	delete m_pLCD;
 }
@@ -170,6 +174,28 @@ bool CUserInterface::Initialize (void)
 		LCDWrite ("MiniJV880\nLoading...");
 		m_pLCDBuffered->Update ();
 
+		if (m_pConfig->GetLCDGraphics ())
+		{
+			if (ssd1306addr != 0)
+			{
+				m_pLCDGraphics = new CLCDGraphics (m_pI2CMaster, ssd1306addr,
+								   m_pConfig->GetSSD1306LCDWidth (),
+								   m_pConfig->GetSSD1306LCDHeight (),
+								   m_pConfig->GetSSD1306LCDRotate (),
+								   m_pConfig->GetSSD1306LCDMirror ());
+			}
+			else if (st7789)
+			{
+				m_pLCDGraphics = new CLCDGraphics (m_pST7789Display);
+			}
+
+			if (m_pLCDGraphics != 0 && !m_pLCDGraphics->Initialize ())
+			{
+				delete m_pLCDGraphics;
+				m_pLCDGraphics = 0;
+			}
+		}
+
 		LOGDBG ("LCD initialized");
 	}
 
@@ -188,7 +214,10 @@ bool CUserInterface::Initialize (void)
                   m_pConfig->GetButtonPinMonitor (), m_pConfig->GetButtonActionMonitor (),
                   m_pConfig->GetButtonPinCompare (), m_pConfig->GetButtonActionCompare (),
 									m_pConfig->GetButtonPinEnter (), m_pConfig->GetButtonActionEnter (),
-									m_pConfig->GetDoubleClickTimeout (), m_pConfig->GetLongPressTimeout ()
+									m_pConfig->GetButtonPinOversampling (), m_pConfig->GetButtonActionOversampling (),
+									m_pConfig->GetDoubleClickTimeout (), m_pConfig->GetLongPressTimeout (),
+									m_pGPIOManager,
+									m_pConfig->GetEncoderEnabled () ? m_pConfig->GetButtonPinEnter () : 0
 								  );
 	assert (m_pUIButtons);
 
@@ -225,14 +254,6 @@ bool CUserInterface::Initialize (void)
 
 void CUserInterface::Process (void)
 {
-	uint32_t* lcd_buffer = m_pMiniJV880->mcu.lcd.LCD_Update();
-
-	// for (size_t y = 0; y < lcd_height; y++) {
-	// 	for (size_t x = 0; x < lcd_width; x++) {
-	// 		m_pMiniJV880->screenUnbuffered->SetPixel(x + 700, y + 50, lcd_buffer[y * lcd_width + x]);
-	// 	}
-	// }
-
 	if (m_pLCDBuffered)
 	{
 		m_pLCDBuffered->Update ();
@@ -241,84 +262,189 @@ void CUserInterface::Process (void)
 	{
 		m_pUIButtons->Update();
 	}
-	// for (size_t y = 0; y < 32; y++) {
-  //     for (size_t x = 0; x < 128; x++) {
-  //       int destX = (int)(((float)x / 128) * 820);
-  //       int destY = (int)(((float)y / 32) * 100);
-  //       int sum = 0;
-  //       for (int py = -1; py <= 1; py++) {
-  //         for (int px = -1; px <= 1; px++) {
-  //           if ((destY + py) >= 0 && (destX + px) >= 0) {
-  //             bool pixel = m_pMiniJV880->mcu.lcd.lcd_buffer[destY + py][destX + px] == lcd_col1;
-  //             sum += pixel;
-  //           }
-  //         }
-  //       }
-
-  //       bool pixel = sum > 0;
-  //       // bool pixel = mcu.lcd.lcd_buffer[destY][destX] == lcd_col1;
-  //       set_pixel(screen_buffer, x, y, pixel);
-	//
-  //       // m_ScreenUnbuffered->SetPixel(x + 800, y + 300, pixel ? 0xFFFF : 0x0000);
-  //     }
-  //   }
 	int displayCols = m_pConfig->GetLCDColumns();
-	CString Msg ("\x1B[H\E[?25l");
-	for (int i = 0; i < 2; i++)
-	{
-		unsigned long currentTime = CTimer::GetClockTicks();
-
-		// Handle scrolling and pausing logic
-    if (currentTime - m_lastScrollTime >= SCROLL_INTERVAL) {
-			for (int r = 0; r < 2; r++) {
-				if (isPaused[r]) {
-					// Check if pause duration has elapsed
-					if (currentTime - pauseStartTime[r] >= PAUSE_DURATION) {
-						isPaused[r] = false;
-						if (isAtEnd[r]) {
-							// Reset to beginning after pause at end
-							m_scrollPosition[r] = 0;
-							isAtEnd[r] = false;
-							isPaused[r] = true;  // Pause again at start
-							pauseStartTime[r] = currentTime;
-						}
-					}
-				} else {
-					// Update scroll position
-					m_scrollPosition[r]++;
-					// Check if we've reached the end
-					if (m_scrollPosition[r] >= ACTUAL_COLS - displayCols) {
-						m_scrollPosition[r] = ACTUAL_COLS - displayCols;
-						isPaused[r] = true;
-						isAtEnd[r] = true;
+	unsigned long currentTime = CTimer::GetClockTicks();
+
+	// Handle scrolling and pausing logic
+	if (currentTime - m_lastScrollTime >= SCROLL_INTERVAL) {
+		for (int r = 0; r < 2; r++) {
+			int scrollPosition = m_scrollPosition[r];
+			if (isPaused[r]) {
+				// Check if pause duration has elapsed
+				if (currentTime - pauseStartTime[r] >= PAUSE_DURATION) {
+					isPaused[r] = false;
+					if (isAtEnd[r]) {
+						// Reset to beginning after pause at end
+						m_scrollPosition[r] = 0;
+						isAtEnd[r] = false;
+						isPaused[r] = true;  // Pause again at start
 						pauseStartTime[r] = currentTime;
 					}
 				}
+			} else {
+				// Update scroll position
+				m_scrollPosition[r]++;
+				// Check if we've reached the end
+				if (m_scrollPosition[r] >= ACTUAL_COLS - displayCols) {
+					m_scrollPosition[r] = ACTUAL_COLS - displayCols;
+					isPaused[r] = true;
+					isAtEnd[r] = true;
+					pauseStartTime[r] = currentTime;
+				}
+			}
+			if (m_scrollPosition[r] != scrollPosition) {
+				m_bLCDRefresh = true;
 			}
-			m_lastScrollTime = currentTime;
 		}
+		m_lastScrollTime = currentTime;
+	}
 
+	// a message of the UI covers the first row for a while
+	bool bMessage =    m_Message[0] != '\0'
+			&& currentTime - m_nMessageTime < MESSAGE_DURATION;
+	if (bMessage != m_bMessageShown)
+	{
+		m_bMessageShown = bMessage;
+		m_bLCDRefresh = true;
+	}
+
+	// Only rewrite the display when the emulated one has changed. Updates
+	// are coalesced, so that a burst of LCD writes from the firmware costs
+	// one transfer to the display.
+	LCD &lcd = m_pMiniJV880->mcu.lcd;
+	unsigned nGeneration = lcd.LCD_GetGeneration ();
+	if (nGeneration != m_nLCDGeneration)
+	{
+		m_bLCDRefresh = true;
+	}
+	if (   !m_bLCDRefresh
+	    || currentTime - m_nLCDUpdateTime < LCD_UPDATE_INTERVAL)
+	{
+		return;
+	}
+	m_bLCDRefresh = false;
+	m_nLCDGeneration = nGeneration;
+	m_nLCDUpdateTime = currentTime;
 
+	if (m_pLCDGraphics)
+	{
+		m_pLCDGraphics->Update (&lcd);
+
+		return;
+	}
+
+	if (displayCols > ACTUAL_COLS)
+	{
+		displayCols = ACTUAL_COLS;
+	}
+
+	int jj = lcd.LCD_DD_RAM % 0x40;
+	int ii = lcd.LCD_DD_RAM / 0x40;
+	bool bCursor = ii < 2 && jj < ACTUAL_COLS && lcd.LCD_C;
+
+	char Text[2][ACTUAL_COLS];
+	int nMessageLength = strlen (m_Message);
+	for (int i = 0; i < 2; i++)
+	{
 		// Calculate starting position for this row
-    int startPos = m_scrollPosition[i];
+		int startPos = m_scrollPosition[i];
 		for (int j = 0; j < displayCols; j++)
 		{
-			int sourcePos = (j + startPos) % ACTUAL_COLS;
-			uint8_t ch = m_pMiniJV880->mcu.lcd.LCD_Data[i * 40 + sourcePos];
-			std::string str(1, ch);
-			const char *pString = str.c_str();
+			if (i == 0 && m_bMessageShown)
+			{
+				Text[i][j] = j < nMessageLength ? m_Message[j] : ' ';
+				continue;
+			}
 
-			int jj = m_pMiniJV880->mcu.lcd.LCD_DD_RAM % 0x40;
-    	int ii = m_pMiniJV880->mcu.lcd.LCD_DD_RAM / 0x40;
-			if (i == ii && j == jj && ii < 2 && jj < ACTUAL_COLS && m_pMiniJV880->mcu.lcd.LCD_C) {
+			int sourcePos = (j + startPos) % ACTUAL_COLS;
+			char ch = lcd.LCD_Data[i * 40 + sourcePos];
+			if (bCursor && i == ii && sourcePos == jj) {
 				// cursor
-				Msg.Append("_");
-			} else {
-				Msg.Append(pString);
+				ch = '_';
+			} else if ((u8) ch < ' ') {
+				// CG RAM characters would be control codes here
+				ch = ' ';
+			}
+			Text[i][j] = ch;
+		}
+	}
+
+	// Write only what differs from the display, each run of changed
+	// characters after a cursor move. Unchanged characters shorter than
+	// a cursor move are written through instead.
+	char Msg[LCD_MSG_SIZE];
+	unsigned nLength = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		int j = 0;
+		while (j < displayCols)
+		{
+			if (Text[i][j] == m_LCDText[i][j])
+			{
+				j++;
+				continue;
+			}
+
+			nLength += FormatCursorMove (Msg + nLength, i + 1, j + 1);
+
+			int nEnd = j + 1;
+			for (int k = nEnd; k < displayCols && k < nEnd + LCD_MOVE_LENGTH; k++)
+			{
+				if (Text[i][k] != m_LCDText[i][k])
+				{
+					nEnd = k + 1;
+				}
 			}
+
+			memcpy (Msg + nLength, &Text[i][j], nEnd - j);
+			memcpy (&m_LCDText[i][j], &Text[i][j], nEnd - j);
+			nLength += nEnd - j;
+			j = nEnd;
 		}
 	}
-	LCDWrite(Msg);
+	assert (nLength <= sizeof Msg);
+
+	if (nLength > 0 && m_pLCDBuffered)
+	{
+		m_pLCDBuffered->Write (Msg, nLength);
+	}
+}
+
+void CUserInterface::ShowMessage (const char *pMessage)
+{
+	strncpy (m_Message, pMessage, sizeof m_Message - 1);
+	m_Message[sizeof m_Message - 1] = '\0';
+	m_nMessageTime = CTimer::GetClockTicks ();
+	m_bLCDRefresh = true;
+}
+
+// Writes "\E[row;colH" to pBuffer and returns its length, without using
+// the heap
+unsigned CUserInterface::FormatCursorMove (char *pBuffer, unsigned nRow, unsigned nColumn)
+{
+	unsigned nLength = 0;
+	pBuffer[nLength++] = '\x1B';
+	pBuffer[nLength++] = '[';
+	nLength += FormatNumber (pBuffer + nLength, nRow);
+	pBuffer[nLength++] = ';';
+	nLength += FormatNumber (pBuffer + nLength, nColumn);
+	pBuffer[nLength++] = 'H';
+
+	return nLength;
+}
+
+unsigned CUserInterface::FormatNumber (char *pBuffer, unsigned nValue)
+{
+	assert (nValue < 100);
+
+	unsigned nLength = 0;
+	if (nValue >= 10)
+	{
+		pBuffer[nLength++] = '0' + nValue / 10;
+	}
+	pBuffer[nLength++] = '0' + nValue % 10;
+
+	return nLength;
 }
 
 void CUserInterface::LCDWrite (const char *pString)
@@ -348,15 +474,15 @@ void CUserInterface::EncoderEventHandler (CKY040::TEvent Event)
 			// triggered after the encoder is rotated
 			m_pUIButtons->ResetButton(m_pConfig->GetButtonPinEnter());
 		} else {
-      m_pMiniJV880->mcu.MCU_EncoderTrigger(1);
-    }
+			m_pMiniJV880->mcu.MCU_EncoderTrigger(1, GetEncoderSteps (1));
+		}
 		break;
 
 	case CKY040::EventCounterclockwise:
 		if (m_bSwitchPressed) {
 			m_pUIButtons->ResetButton(m_pConfig->GetButtonPinEnter());
 		} else {
-			m_pMiniJV880->mcu.MCU_EncoderTrigger(0);
+			m_pMiniJV880->mcu.MCU_EncoderTrigger(0, GetEncoderSteps (0));
 		}
 		break;
 
@@ -374,6 +500,38 @@ void CUserInterface::EncoderEventHandler (CKY040::TEvent Event)
 	}
 }
 
+// The steps are queued in the emulator, which passes them to the firmware as
+// fast as it takes them. Detents in quick succession count more.
+int CUserInterface::GetEncoderSteps (int nDirection)
+{
+	unsigned nTicks = CTimer::GetClockTicks ();
+	unsigned nInterval = nTicks - m_nEncoderTicks;
+	bool bSameDirection = nDirection == m_nEncoderDirection;
+	m_nEncoderTicks = nTicks;
+	m_nEncoderDirection = nDirection;
+
+	if (   !m_pConfig->GetEncoderAcceleration ()
+	    || !bSameDirection)
+	{
+		return 1;
+	}
+
+	if (nInterval < 10000)
+	{
+		return 8;
+	}
+	if (nInterval < 20000)
+	{
+		return 4;
+	}
+	if (nInterval < 40000)
+	{
+		return 2;
+	}
+
+	return 1;
+}
+
 void CUserInterface::EncoderEventStub (CKY040::TEvent Event, void *pParam)
 {
 	CUserInterface *pThis = static_cast<CUserInterface *> (pParam);
@@ -382,87 +540,66 @@ void CUserInterface::EncoderEventStub (CKY040::TEvent Event, void *pParam)
 	pThis->EncoderEventHandler (Event);
 }
 
-void CUserInterface::UIButtonsEventHandler (CUIButton::BtnEvent Event)
+void CUserInterface::UIButtonsEventHandler (CUIButton::BtnEvent Event, boolean bPressed)
 {
-	uint32_t btn = 0;
-	if (Event == CUIButton::BtnEventPreview) {
-		btn |= 1 << MCU_BUTTON_PREVIEW;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_PREVIEW);
-	}
-	if (Event == CUIButton::BtnEventLeft) {
-		btn |= 1 << MCU_BUTTON_CURSOR_L;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_CURSOR_L);
-	}
-	if (Event == CUIButton::BtnEventRight) {
-		btn |= 1 << MCU_BUTTON_CURSOR_R;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_CURSOR_R);
-	}
-	if (Event == CUIButton::BtnEventData) {
-		btn |= 1 << MCU_BUTTON_DATA;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_DATA);
-	}
-	if (Event == CUIButton::BtnEventToneSelect) {
-		btn |= 1 << MCU_BUTTON_TONE_SELECT;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_TONE_SELECT);
-	}
-	if (Event == CUIButton::BtnEventPatchPerform) {
-		btn |= 1 << MCU_BUTTON_PATCH_PERFORM;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_PATCH_PERFORM);
-	}
-	if (Event == CUIButton::BtnEventEdit) {
-		btn |= 1 << MCU_BUTTON_EDIT;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_EDIT);
-	}
-	if (Event == CUIButton::BtnEventSystem) {
-		btn |= 1 << MCU_BUTTON_SYSTEM;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_SYSTEM);
-	}
-	if (Event == CUIButton::BtnEventRhythm) {
-		btn |= 1 << MCU_BUTTON_RHYTHM;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_RHYTHM);
-	}
-	if (Event == CUIButton::BtnEventUtility) {
-		btn |= 1 << MCU_BUTTON_UTILITY;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_UTILITY);
-	}
-	if (Event == CUIButton::BtnEventMute) {
-			btn |= 1 << MCU_BUTTON_MUTE;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_MUTE);
+	// JV-880 button of each CUIButton::BtnEvent
+	static const int Buttons[] =
+	{
+		-1,
+		MCU_BUTTON_PREVIEW,
+		MCU_BUTTON_CURSOR_L,
+		MCU_BUTTON_CURSOR_R,
+		MCU_BUTTON_DATA,
+		MCU_BUTTON_TONE_SELECT,
+		MCU_BUTTON_PATCH_PERFORM,
+		MCU_BUTTON_EDIT,
+		MCU_BUTTON_SYSTEM,
+		MCU_BUTTON_RHYTHM,
+		MCU_BUTTON_UTILITY,
+		MCU_BUTTON_MUTE,
+		MCU_BUTTON_MONITOR,
+		MCU_BUTTON_COMPARE,
+		MCU_BUTTON_ENTER,
+		-1
+	};
+
+	if (   Event <= CUIButton::BtnEventNone
+	    || Event >= CUIButton::BtnEventUnknown)
+	{
+		return;
 	}
-	if (Event == CUIButton::BtnEventMonitor) {
-		btn |= 1 << MCU_BUTTON_MONITOR;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_MONITOR);
+
+	// not a JV-880 button, it switches on the press
+	if (Event == CUIButton::BtnEventOversampling)
+	{
+		if (bPressed)
+		{
+			bool bOversampling = !m_pMiniJV880->GetOversampling ();
+			m_pMiniJV880->SetOversampling (bOversampling);
+			ShowMessage (bOversampling ? "Oversampling on" : "Oversampling off");
+		}
+
+		return;
 	}
-	if (Event == CUIButton::BtnEventCompare) {
-		btn |= 1 << MCU_BUTTON_COMPARE;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_COMPARE);
+
+	int nButton = Buttons[Event];
+	LOGDBG ("Button %d %s", nButton, bPressed ? "down" : "up");
+
+	// Only this button changes, others may be held at the same time
+	if (bPressed)
+	{
+		m_pMiniJV880->mcu.MCU_PressButton (nButton);
 	}
-	if (Event == CUIButton::BtnEventEnter) {
-		btn |= 1 << MCU_BUTTON_ENTER;
-	} else {
-		btn &= ~(1 << MCU_BUTTON_ENTER);
+	else
+	{
+		m_pMiniJV880->mcu.MCU_ReleaseButton (nButton);
 	}
-	LOGNOTE("Button: %x", btn);
-	m_pMiniJV880->mcu.mcu_button_pressed = btn;
 }
 
-void CUserInterface::UIButtonsEventStub (CUIButton::BtnEvent Event, void *pParam)
+void CUserInterface::UIButtonsEventStub (CUIButton::BtnEvent Event, boolean bPressed, void *pParam)
 {
 	CUserInterface *pThis = static_cast<CUserInterface *> (pParam);
 	assert (pThis != 0);
 
-	pThis->UIButtonsEventHandler (Event);
+	pThis->UIButtonsEventHandler (Event, bPressed);
 }
@@ -22,6 +22,7 @@
 
 #include "config.h"
 #include "uibuttons.h"
+#include "lcdgraphics.h"
 #include <sensor/ky040.h>
 #include <display/hd44780device.h>
 #include <display/ssd1306device.h>
@@ -45,12 +46,20 @@ public:
 
 	void LCDWrite (const char *pString);		// Print to optional HD44780 display
 
+	// Shows pMessage in the first row of a text display for a moment, over
+	// what the emulator shows there
+	void ShowMessage (const char *pMessage);
+
 private:
 
 	void EncoderEventHandler (CKY040::TEvent Event);
+	int GetEncoderSteps (int nDirection);
 	static void EncoderEventStub (CKY040::TEvent Event, void *pParam);
-	void UIButtonsEventHandler (CUIButton::BtnEvent Event);
-	static void UIButtonsEventStub (CUIButton::BtnEvent Event, void *pParam);
+	void UIButtonsEventHandler (CUIButton::BtnEvent Event, boolean bPressed);
+	static void UIButtonsEventStub (CUIButton::BtnEvent Event, boolean bPressed, void *pParam);
+
+	static unsigned FormatCursorMove (char *pBuffer, unsigned nRow, unsigned nColumn);
+	static unsigned FormatNumber (char *pBuffer, unsigned nValue);
 
 private:
 	CMiniJV880 *m_pMiniJV880;
@@ -65,13 +74,15 @@ private:
 	CST7789Display *m_pST7789Display;
 	CST7789Device  *m_pST7789;
 	CWriteBufferDevice *m_pLCDBuffered;
+	CLCDGraphics *m_pLCDGraphics;		// replaces the text if set
 	
 	CUIButtons *m_pUIButtons;
 
 	CKY040 *m_pRotaryEncoder;
 	bool m_bSwitchPressed;
-
-	u8 *screen_buffer;
+	// the last detent
+	unsigned m_nEncoderTicks;
+	int m_nEncoderDirection;
 
 	unsigned m_lastTick;
 
@@ -90,6 +101,27 @@ private:
 	static const unsigned long PAUSE_DURATION = 1000000;
 
 	static const int ACTUAL_COLS = 24;
+
+	// what was last written to the display
+	unsigned m_nLCDGeneration;
+	bool m_bLCDRefresh;
+	unsigned long m_nLCDUpdateTime;
+
+	static const unsigned long LCD_UPDATE_INTERVAL = 20000;
+
+	// what the display shows
+	char m_LCDText[2][ACTUAL_COLS];
+
+	char m_Message[ACTUAL_COLS + 1];
+	unsigned long m_nMessageTime;
+	bool m_bMessageShown;
+
+	static const unsigned long MESSAGE_DURATION = 1500000;
+
+	// the longest "\E[row;colH"
+	static const int LCD_MOVE_LENGTH = 7;
+	// every character with a cursor move before it
+	static const unsigned LCD_MSG_SIZE = 2 * ACTUAL_COLS * (LCD_MOVE_LENGTH + 1);
 };
 
 #endif